@@ -0,0 +1,32 @@
+# - Find LZ4
+
+if(LZ4_INCLUDE_DIR AND LZ4_LIBRARIES)
+   set(LZ4_FOUND TRUE)
+
+else(LZ4_INCLUDE_DIR AND LZ4_LIBRARIES)
+  find_path(LZ4_INCLUDE_DIR lz4.h
+      /usr/include
+      /usr/local/include
+      /opt/local/include
+      $ENV{SystemDrive}/lz4/include
+      )
+
+  find_library(LZ4_LIBRARIES NAMES lz4
+      PATHS
+      /usr/lib
+      /usr/local/lib
+      /opt/local/lib
+      $ENV{SystemDrive}/lz4/lib
+      )
+
+  if(LZ4_INCLUDE_DIR AND LZ4_LIBRARIES)
+    set(LZ4_FOUND TRUE)
+    message(STATUS "Found LZ4: ${LZ4_INCLUDE_DIR}, ${LZ4_LIBRARIES}")
+  else(LZ4_INCLUDE_DIR AND LZ4_LIBRARIES)
+    set(LZ4_FOUND FALSE)
+    message(STATUS "LZ4 not found.")
+  endif(LZ4_INCLUDE_DIR AND LZ4_LIBRARIES)
+
+  mark_as_advanced(LZ4_INCLUDE_DIR LZ4_LIBRARIES)
+
+endif(LZ4_INCLUDE_DIR AND LZ4_LIBRARIES)
@@ -0,0 +1,32 @@
+# - Find Zstandard
+
+if(ZSTD_INCLUDE_DIR AND ZSTD_LIBRARIES)
+   set(ZSTD_FOUND TRUE)
+
+else(ZSTD_INCLUDE_DIR AND ZSTD_LIBRARIES)
+  find_path(ZSTD_INCLUDE_DIR zstd.h
+      /usr/include
+      /usr/local/include
+      /opt/local/include
+      $ENV{SystemDrive}/zstd/include
+      )
+
+  find_library(ZSTD_LIBRARIES NAMES zstd
+      PATHS
+      /usr/lib
+      /usr/local/lib
+      /opt/local/lib
+      $ENV{SystemDrive}/zstd/lib
+      )
+
+  if(ZSTD_INCLUDE_DIR AND ZSTD_LIBRARIES)
+    set(ZSTD_FOUND TRUE)
+    message(STATUS "Found Zstd: ${ZSTD_INCLUDE_DIR}, ${ZSTD_LIBRARIES}")
+  else(ZSTD_INCLUDE_DIR AND ZSTD_LIBRARIES)
+    set(ZSTD_FOUND FALSE)
+    message(STATUS "Zstd not found.")
+  endif(ZSTD_INCLUDE_DIR AND ZSTD_LIBRARIES)
+
+  mark_as_advanced(ZSTD_INCLUDE_DIR ZSTD_LIBRARIES)
+
+endif(ZSTD_INCLUDE_DIR AND ZSTD_LIBRARIES)
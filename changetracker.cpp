@@ -0,0 +1,113 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "changetracker.hpp"
+#include "maputils.hpp"
+
+#include <algorithm>
+
+#include <boost/geometry/algorithms/expand.hpp>
+
+namespace ADWIF
+{
+  ChangeTracker::ChangeTracker(unsigned int chunkSizeX, unsigned int chunkSizeY, unsigned int chunkSizeZ):
+    myChunkSizeX(chunkSizeX), myChunkSizeY(chunkSizeY), myChunkSizeZ(chunkSizeZ), myEpochs(), myVersions(myEpochs),
+    mySubscribers(), mySubscriberCount(0), mySubscribersLock()
+  {
+  }
+
+  ChangeTracker::~ChangeTracker()
+  {
+    for (ChangeSubscriber * subscriber : mySubscribers)
+      delete subscriber;
+  }
+
+  void ChangeTracker::touch(const Box3D & box)
+  {
+    forEachRegionSlice(box, myChunkSizeX, myChunkSizeY, myChunkSizeZ, [&](const RegionSlice & slice)
+    {
+      record(slice.chunkX, slice.chunkY, slice.chunkZ, Box3D(Point3D(slice.minX, slice.minY, slice.minZ),
+                                                             Point3D(slice.maxX, slice.maxY, slice.maxZ)));
+    });
+  }
+
+  void ChangeTracker::touch(int x, int y, int z)
+  {
+    record(floorDiv(x, myChunkSizeX), floorDiv(y, myChunkSizeY), floorDiv(z, myChunkSizeZ),
+           Box3D(Point3D(x, y, z), Point3D(x + 1, y + 1, z + 1)));
+  }
+
+  uint64_t ChangeTracker::version(int x, int y, int z) const
+  {
+    const boost::atomic<uint64_t> * version =
+      myVersions.find(packChunkKey(floorDiv(x, myChunkSizeX), floorDiv(y, myChunkSizeY), floorDiv(z, myChunkSizeZ)));
+    return version ? version->load(boost::memory_order_acquire) : 0;
+  }
+
+  ChangeSubscriber * ChangeTracker::subscribe()
+  {
+    boost::unique_lock<boost::shared_mutex> guard(mySubscribersLock);
+    mySubscribers.push_back(new ChangeSubscriber);
+    mySubscriberCount = mySubscribers.size();
+    return mySubscribers.back();
+  }
+
+  void ChangeTracker::unsubscribe(ChangeSubscriber * subscriber)
+  {
+    boost::unique_lock<boost::shared_mutex> guard(mySubscribersLock);
+    mySubscribers.erase(std::remove(mySubscribers.begin(), mySubscribers.end(), subscriber), mySubscribers.end());
+    mySubscriberCount = mySubscribers.size();
+    delete subscriber;
+  }
+
+  void ChangeTracker::drain(ChangeSubscriber * subscriber, std::vector<Box3D> & out)
+  {
+    std::unordered_map<uint64_t, Box3D> boxes;
+    {
+      boost::mutex::scoped_lock guard(subscriber->lock);
+      boxes.swap(subscriber->boxes);
+    }
+    out.clear();
+    out.reserve(boxes.size());
+    for (auto & entry : boxes)
+      out.push_back(entry.second);
+  }
+
+  void ChangeTracker::record(int chunkX, int chunkY, int chunkZ, const Box3D & box)
+  {
+    const uint64_t key = packChunkKey(chunkX, chunkY, chunkZ);
+    boost::atomic<uint64_t> * version = myVersions.find(key);
+    if (!version)
+      version = myVersions.insert(key, new boost::atomic<uint64_t>(0));
+    version->fetch_add(1, boost::memory_order_acq_rel);
+
+    if (!mySubscriberCount.load())
+      return;
+    boost::shared_lock<boost::shared_mutex> guard(mySubscribersLock);
+    for (ChangeSubscriber * subscriber : mySubscribers)
+    {
+      boost::mutex::scoped_lock subscriberGuard(subscriber->lock);
+      auto i = subscriber->boxes.find(key);
+      if (i == subscriber->boxes.end())
+        subscriber->boxes.insert(std::make_pair(key, box));
+      else
+        boost::geometry::expand(i->second, box);
+    }
+  }
+}
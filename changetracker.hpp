@@ -0,0 +1,81 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CHANGETRACKER_H
+#define CHANGETRACKER_H
+
+#include "map.hpp"
+#include "chunkdirectory.hpp"
+#include "epochmanager.hpp"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+namespace ADWIF
+{
+  // What one Map::ChangeFeed has collected since it was last drained: a box per chunk, bounding every write made to it
+  class ChangeSubscriber
+  {
+    friend class ChangeTracker;
+
+    boost::mutex lock;
+    std::unordered_map<uint64_t, Box3D> boxes;
+  };
+
+  // Counts the writes made to every chunk through the map and hands the regions they covered to subscribers. Writes
+  // only pay for a lookup of the chunk's version while nobody is subscribed.
+  class ChangeTracker
+  {
+  public:
+    ChangeTracker(unsigned int chunkSizeX, unsigned int chunkSizeY, unsigned int chunkSizeZ);
+    ~ChangeTracker();
+
+    // To be called once the cells were written
+    void touch(const Box3D & box);
+    void touch(int x, int y, int z);
+
+    uint64_t version(int x, int y, int z) const;
+
+    ChangeSubscriber * subscribe();
+    void unsubscribe(ChangeSubscriber * subscriber);
+    // Replaces the contents of 'out' with the boxes collected by the subscriber and forgets them
+    void drain(ChangeSubscriber * subscriber, std::vector<Box3D> & out);
+
+  private:
+    ChangeTracker(const ChangeTracker &);
+    ChangeTracker & operator=(const ChangeTracker &);
+
+    void record(int chunkX, int chunkY, int chunkZ, const Box3D & box);
+
+  private:
+    int myChunkSizeX, myChunkSizeY, myChunkSizeZ;
+    mutable EpochManager myEpochs;
+    ChunkDirectory<boost::atomic<uint64_t>> myVersions;
+    std::vector<ChangeSubscriber *> mySubscribers;
+    boost::atomic<std::size_t> mySubscriberCount;
+    boost::shared_mutex mySubscribersLock;
+  };
+}
+
+#endif // CHANGETRACKER_H
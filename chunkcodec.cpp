@@ -0,0 +1,253 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.hpp"
+#include "chunkcodec.hpp"
+#include "fileutils.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/bzip2.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/lexical_cast.hpp>
+
+#ifdef ADWIF_HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#ifdef ADWIF_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace ADWIF
+{
+  static const char chunkMagic[4] = { 'A', 'D', 'W', 'C' };
+  static const uint8_t chunkHeaderVersion = 1;
+
+  std::string chunkCodecStr(ChunkCodec codec)
+  {
+    switch(codec)
+    {
+      case ChunkCodec::None: return "None";
+      case ChunkCodec::BZip2: return "BZip2";
+      case ChunkCodec::LZ4: return "LZ4";
+      case ChunkCodec::Zstd: return "Zstd";
+    }
+    return "Unknown";
+  }
+
+  ChunkCodec strChunkCodec(const std::string & codec)
+  {
+    std::string c;
+    std::transform(codec.begin(), codec.end(), std::back_inserter(c), &tolower);
+    if (c == "none") return ChunkCodec::None;
+    else if (c == "bzip2") return ChunkCodec::BZip2;
+    else if (c == "lz4") return ChunkCodec::LZ4;
+    else if (c == "zstd") return ChunkCodec::Zstd;
+    else throw std::invalid_argument("unknown chunk codec '" + codec + "'");
+  }
+
+  bool chunkCodecAvailable(ChunkCodec codec)
+  {
+    switch(codec)
+    {
+      case ChunkCodec::None:
+      case ChunkCodec::BZip2:
+        return true;
+#ifdef ADWIF_HAVE_LZ4
+      case ChunkCodec::LZ4:
+        return true;
+#endif
+#ifdef ADWIF_HAVE_ZSTD
+      case ChunkCodec::Zstd:
+        return true;
+#endif
+      default:
+        return false;
+    }
+  }
+
+  ChunkCodec defaultChunkCodec()
+  {
+    if (chunkCodecAvailable(ChunkCodec::LZ4))
+      return ChunkCodec::LZ4;
+    else if (chunkCodecAvailable(ChunkCodec::Zstd))
+      return ChunkCodec::Zstd;
+    else
+      return ChunkCodec::BZip2;
+  }
+
+  static void compress(const char * data, std::size_t size, ChunkCodec codec, int level, std::vector<char> & out)
+  {
+    out.clear();
+    switch(codec)
+    {
+      case ChunkCodec::None:
+      {
+        out.assign(data, data + size);
+        break;
+      }
+      case ChunkCodec::BZip2:
+      {
+        boost::iostreams::filtering_ostream os;
+        os.push(boost::iostreams::bzip2_compressor(boost::iostreams::bzip2_params(level ? level : 9)));
+        os.push(boost::iostreams::back_inserter(out));
+        os.write(data, size);
+        os.reset();
+        break;
+      }
+#ifdef ADWIF_HAVE_LZ4
+      case ChunkCodec::LZ4:
+      {
+        out.resize(LZ4_compressBound(size));
+        int packed = level > 0 ?
+          LZ4_compress_HC(data, out.data(), size, out.size(), level) :
+          LZ4_compress_default(data, out.data(), size, out.size());
+        if (packed <= 0)
+          throw std::runtime_error("LZ4 compression failed");
+        out.resize(packed);
+        break;
+      }
+#endif
+#ifdef ADWIF_HAVE_ZSTD
+      case ChunkCodec::Zstd:
+      {
+        out.resize(ZSTD_compressBound(size));
+        std::size_t packed = ZSTD_compress(out.data(), out.size(), data, size, level ? level : 1);
+        if (ZSTD_isError(packed))
+          throw std::runtime_error(std::string("Zstd compression failed: ") + ZSTD_getErrorName(packed));
+        out.resize(packed);
+        break;
+      }
+#endif
+      default:
+        throw std::runtime_error("chunk codec '" + chunkCodecStr(codec) + "' is not available in this build");
+    }
+  }
+
+  static void decompress(const std::vector<char> & packed, ChunkCodec codec, std::vector<char> & out)
+  {
+    switch(codec)
+    {
+      case ChunkCodec::None:
+      {
+        if (packed.size() != out.size())
+          throw std::runtime_error("chunk payload size mismatch");
+        std::copy(packed.begin(), packed.end(), out.begin());
+        break;
+      }
+      case ChunkCodec::BZip2:
+      {
+        boost::iostreams::filtering_istream is;
+        is.push(boost::iostreams::bzip2_decompressor());
+        is.push(boost::iostreams::array_source(packed.data(), packed.size()));
+        if (!is.read(out.data(), out.size()))
+          throw std::runtime_error("truncated BZip2 chunk payload");
+        break;
+      }
+#ifdef ADWIF_HAVE_LZ4
+      case ChunkCodec::LZ4:
+      {
+        int unpacked = LZ4_decompress_safe(packed.data(), out.data(), packed.size(), out.size());
+        if (unpacked < 0 || (std::size_t)unpacked != out.size())
+          throw std::runtime_error("corrupt LZ4 chunk payload");
+        break;
+      }
+#endif
+#ifdef ADWIF_HAVE_ZSTD
+      case ChunkCodec::Zstd:
+      {
+        std::size_t unpacked = ZSTD_decompress(out.data(), out.size(), packed.data(), packed.size());
+        if (ZSTD_isError(unpacked) || unpacked != out.size())
+          throw std::runtime_error("corrupt Zstd chunk payload");
+        break;
+      }
+#endif
+      default:
+        throw std::runtime_error("chunk codec '" + chunkCodecStr(codec) + "' is not available in this build");
+    }
+  }
+
+  void writeChunkData(std::ostream & os, const char * data, std::size_t size, uint8_t format,
+                      ChunkCodec codec, int level)
+  {
+    std::vector<char> packed;
+    compress(data, size, codec, level, packed);
+
+    os.write(chunkMagic, sizeof(chunkMagic));
+    write<uint8_t>(os, chunkHeaderVersion);
+    write<uint8_t>(os, (uint8_t)codec);
+    write<uint8_t>(os, format);
+    write<uint8_t>(os, 0);
+    write<uint64_t>(os, size);
+    write<uint64_t>(os, packed.size());
+    os.write(packed.data(), packed.size());
+
+    if (!os.good())
+      throw std::runtime_error("error writing chunk data");
+  }
+
+  bool readChunkData(std::istream & is, std::vector<char> & out, uint8_t & format, uint64_t maxSize)
+  {
+    std::streampos start = is.tellg();
+    char magic[sizeof(chunkMagic)];
+
+    if (!is.read(magic, sizeof(magic)) || std::memcmp(magic, chunkMagic, sizeof(magic)) != 0)
+    {
+      is.clear();
+      is.seekg(start);
+      return false;
+    }
+
+    uint8_t version, codec, reserved;
+    uint64_t size, packedSize;
+
+    if (!read<uint8_t>(is, version) || !read<uint8_t>(is, codec) || !read<uint8_t>(is, format) ||
+        !read<uint8_t>(is, reserved) || !read<uint64_t>(is, size) || !read<uint64_t>(is, packedSize))
+      throw std::runtime_error("truncated chunk header");
+
+    if (version > chunkHeaderVersion)
+      throw std::runtime_error("unsupported chunk header version " + boost::lexical_cast<std::string>((int)version));
+
+    // both sizes come from the file, and are checked before anything is allocated for them
+    if (size > maxSize)
+      throw std::runtime_error("chunk payload of " + boost::lexical_cast<std::string>(size) +
+                               " bytes exceeds the largest possible chunk");
+
+    const std::streampos payload = is.tellg();
+    is.seekg(0, std::ios_base::end);
+    const std::streampos end = is.tellg();
+    is.seekg(payload);
+    if (payload == std::streampos(-1) || end == std::streampos(-1) || packedSize > uint64_t(end - payload))
+      throw std::runtime_error("truncated chunk payload");
+
+    std::vector<char> packed(packedSize);
+    if (!is.read(packed.data(), packedSize))
+      throw std::runtime_error("truncated chunk payload");
+
+    out.resize(size);
+    decompress(packed, (ChunkCodec)codec, out);
+    return true;
+  }
+}
@@ -0,0 +1,57 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CHUNKCODEC_H
+#define CHUNKCODEC_H
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace ADWIF
+{
+  enum class ChunkCodec : uint8_t
+  {
+    None = 0,
+    BZip2 = 1,
+    LZ4 = 2,
+    Zstd = 3,
+  };
+
+  std::string chunkCodecStr(ChunkCodec codec);
+  ChunkCodec strChunkCodec(const std::string & codec);
+
+  // Whether support for the codec was compiled in
+  bool chunkCodecAvailable(ChunkCodec codec);
+  // The fastest codec compiled in
+  ChunkCodec defaultChunkCodec();
+
+  // Writes a chunk record: a fixed header naming the codec and the caller's payload format, then the payload
+  // compressed with 'codec'. A level of 0 selects the codec's default.
+  void writeChunkData(std::ostream & os, const char * data, std::size_t size, uint8_t format,
+                      ChunkCodec codec, int level = 0);
+
+  // Reads a record written by writeChunkData(). Returns false without consuming anything if the stream does
+  // not start with a chunk header, which is the case for chunks saved before the header existed. Throws if the
+  // header claims more than maxSize bytes of payload, or more packed bytes than the stream has left.
+  bool readChunkData(std::istream & is, std::vector<char> & out, uint8_t & format, uint64_t maxSize);
+}
+
+#endif // CHUNKCODEC_H
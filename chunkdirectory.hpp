@@ -0,0 +1,189 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CHUNKDIRECTORY_H
+#define CHUNKDIRECTORY_H
+
+#include "epochmanager.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include <boost/atomic.hpp>
+
+namespace ADWIF
+{
+  // Packs chunk coordinates in the range [-2^20, 2^20) into a single key
+  inline uint64_t packChunkKey(int x, int y, int z)
+  {
+    const uint64_t mask = (uint64_t(1) << 21) - 1;
+    return ((uint64_t(x) & mask) << 42) | ((uint64_t(y) & mask) << 21) | (uint64_t(z) & mask);
+  }
+
+  inline void unpackChunkKey(uint64_t key, int & x, int & y, int & z)
+  {
+    // shifting the 21 bit fields to the top and back sign extends them
+    x = int(int64_t(key << 1) >> 43);
+    y = int(int64_t(key << 22) >> 43);
+    z = int(int64_t(key << 43) >> 43);
+  }
+
+  // An open addressing table from packed chunk coordinates to chunks, owned by the directory. Lookups do not write
+  // to memory shared with other threads; insertions are serialised and grow the table by publishing a copy, with
+  // the old table reclaimed through the EpochManager. Entries are never removed.
+  template <class T>
+  class ChunkDirectory
+  {
+    struct Slot
+    {
+      boost::atomic<uint64_t> key;
+      boost::atomic<T *> value;
+    };
+
+    struct Table
+    {
+      Table(std::size_t capacity): mask(capacity - 1), slots(new Slot[capacity])
+      {
+        for (std::size_t i = 0; i < capacity; i++)
+        {
+          slots[i].key.store(emptyKey, boost::memory_order_relaxed);
+          slots[i].value.store(nullptr, boost::memory_order_relaxed);
+        }
+      }
+
+      std::size_t mask;
+      std::unique_ptr<Slot[]> slots;
+    };
+
+  public:
+    ChunkDirectory(EpochManager & epochs, std::size_t capacity = 4096): myEpochs(epochs), myTable(nullptr),
+      myCount(0), myMutex()
+    {
+      std::size_t size = 16;
+      while (size < capacity)
+        size *= 2;
+      myTable.store(new Table(size));
+    }
+
+    ~ChunkDirectory()
+    {
+      Table * table = myTable.load();
+      for (std::size_t i = 0; i <= table->mask; i++)
+        delete table->slots[i].value.load();
+      delete table;
+    }
+
+    T * find(uint64_t key) const
+    {
+      EpochManager::Guard guard(myEpochs);
+      const Table * table = myTable.load(boost::memory_order_acquire);
+      for (std::size_t i = hash(key) & table->mask; ; i = (i + 1) & table->mask)
+      {
+        const uint64_t slotKey = table->slots[i].key.load(boost::memory_order_acquire);
+        if (slotKey == key)
+          return table->slots[i].value.load(boost::memory_order_acquire);
+        if (slotKey == emptyKey)
+          return nullptr;
+      }
+    }
+
+    // Takes ownership of value and returns it, or returns the entry another thread inserted first, in which case
+    // value is deleted
+    T * insert(uint64_t key, T * value)
+    {
+      std::lock_guard<std::mutex> lock(myMutex);
+      Table * table = myTable.load(boost::memory_order_relaxed);
+
+      if ((myCount + 1) * 2 > table->mask + 1)
+      {
+        Table * grown = new Table((table->mask + 1) * 2);
+        for (std::size_t i = 0; i <= table->mask; i++)
+        {
+          const uint64_t slotKey = table->slots[i].key.load(boost::memory_order_relaxed);
+          if (slotKey != emptyKey)
+            place(grown, slotKey, table->slots[i].value.load(boost::memory_order_relaxed));
+        }
+        myTable.store(grown, boost::memory_order_release);
+        myEpochs.retire([table]() { delete table; }, (table->mask + 1) * sizeof(Slot));
+        table = grown;
+      }
+
+      for (std::size_t i = hash(key) & table->mask; ; i = (i + 1) & table->mask)
+      {
+        const uint64_t slotKey = table->slots[i].key.load(boost::memory_order_relaxed);
+        if (slotKey == key)
+        {
+          delete value;
+          return table->slots[i].value.load(boost::memory_order_relaxed);
+        }
+        if (slotKey == emptyKey)
+          break;
+      }
+
+      place(table, key, value);
+      myCount++;
+      return value;
+    }
+
+    template <class Fn>
+    void forEach(Fn fn) const
+    {
+      EpochManager::Guard guard(myEpochs);
+      const Table * table = myTable.load(boost::memory_order_acquire);
+      for (std::size_t i = 0; i <= table->mask; i++)
+        if (table->slots[i].key.load(boost::memory_order_acquire) != emptyKey)
+          fn(table->slots[i].value.load(boost::memory_order_acquire));
+    }
+
+  private:
+    ChunkDirectory(const ChunkDirectory &);
+    ChunkDirectory & operator=(const ChunkDirectory &);
+
+    static const uint64_t emptyKey = ~uint64_t(0);
+
+    static std::size_t hash(uint64_t key)
+    {
+      key ^= key >> 33;
+      key *= 0xff51afd7ed558ccdULL;
+      key ^= key >> 33;
+      key *= 0xc4ceb9fe1a85ec53ULL;
+      key ^= key >> 33;
+      return key;
+    }
+
+    // The value is published before the key, so a reader that finds the key always sees the value
+    static void place(Table * table, uint64_t key, T * value)
+    {
+      std::size_t i = hash(key) & table->mask;
+      while (table->slots[i].key.load(boost::memory_order_relaxed) != emptyKey)
+        i = (i + 1) & table->mask;
+      table->slots[i].value.store(value, boost::memory_order_relaxed);
+      table->slots[i].key.store(key, boost::memory_order_release);
+    }
+
+  private:
+    EpochManager & myEpochs;
+    boost::atomic<Table *> myTable;
+    std::size_t myCount;
+    std::mutex myMutex;
+  };
+}
+
+#endif // CHUNKDIRECTORY_H
@@ -0,0 +1,114 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "chunkprefetcher.hpp"
+
+#include <algorithm>
+#include <exception>
+
+namespace ADWIF
+{
+  const int ChunkPrefetcher::pinPriority;
+
+  ChunkPrefetcher::ChunkPrefetcher(const LoadFunction & load, unsigned int threads): myLoad(load), myQueue(),
+    myQueued(), mySequence(0), myMutex(), myCond(), myThreads(), myQuitFlag(false)
+  {
+    for (unsigned int i = 0; i < threads; i++)
+      myThreads.create_thread(boost::bind(&ChunkPrefetcher::run, this));
+  }
+
+  ChunkPrefetcher::~ChunkPrefetcher()
+  {
+    {
+      boost::lock_guard<boost::mutex> guard(myMutex);
+      myQuitFlag = true;
+      myQueue.clear();
+      myQueued.clear();
+    }
+    myCond.notify_all();
+    myThreads.join_all();
+  }
+
+  void ChunkPrefetcher::push(int x, int y, int z, int priority)
+  {
+    {
+      boost::lock_guard<boost::mutex> guard(myMutex);
+      const boost::tuple<int, int, int> chunk(x, y, z);
+      if (!myQueued.insert(chunk).second)
+      {
+        auto i = std::find_if(myQueue.begin(), myQueue.end(), [&](const Request & r) { return r.chunk == chunk; });
+        if (i == myQueue.end() || i->priority >= priority)
+          return;
+        i->priority = priority;
+        std::make_heap(myQueue.begin(), myQueue.end());
+      }
+      else
+      {
+        myQueue.push_back(Request { priority, mySequence++, chunk });
+        std::push_heap(myQueue.begin(), myQueue.end());
+      }
+    }
+    myCond.notify_one();
+  }
+
+  void ChunkPrefetcher::cancel()
+  {
+    boost::lock_guard<boost::mutex> guard(myMutex);
+    myQueue.erase(std::remove_if(myQueue.begin(), myQueue.end(), [](const Request & r)
+    {
+      return r.priority < pinPriority;
+    }), myQueue.end());
+    std::make_heap(myQueue.begin(), myQueue.end());
+    myQueued.clear();
+    for (const Request & r : myQueue)
+      myQueued.insert(r.chunk);
+  }
+
+  std::size_t ChunkPrefetcher::pending() const
+  {
+    boost::lock_guard<boost::mutex> guard(myMutex);
+    return myQueue.size();
+  }
+
+  void ChunkPrefetcher::run()
+  {
+    while (true)
+    {
+      boost::tuple<int, int, int> chunk;
+      {
+        boost::unique_lock<boost::mutex> lock(myMutex);
+        while (!myQuitFlag && myQueue.empty())
+          myCond.wait(lock);
+        if (myQuitFlag)
+          return;
+        std::pop_heap(myQueue.begin(), myQueue.end());
+        chunk = myQueue.back().chunk;
+        myQueue.pop_back();
+        myQueued.erase(chunk);
+      }
+
+      // a chunk that fails to load here fails again, and is reported, when it is actually accessed
+      try
+      {
+        myLoad(chunk.get<0>(), chunk.get<1>(), chunk.get<2>());
+      }
+      catch (std::exception &) { }
+    }
+  }
+}
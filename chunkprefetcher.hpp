@@ -0,0 +1,85 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CHUNKPREFETCHER_H
+#define CHUNKPREFETCHER_H
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <set>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/tuple/tuple.hpp>
+#include <boost/tuple/tuple_comparison.hpp>
+
+namespace ADWIF
+{
+  // Loads chunks ahead of use on a few background threads. Requests are served highest priority first and in the
+  // order they were made within the same priority; a chunk already waiting in the queue is not queued again, though a
+  // higher priority request raises its priority.
+  class ChunkPrefetcher
+  {
+  public:
+    typedef std::function<void(int x, int y, int z)> LoadFunction;
+
+    // Requests for pinned chunks, which are served ahead of all others and survive cancel()
+    static const int pinPriority = std::numeric_limits<int>::max();
+
+    ChunkPrefetcher(const LoadFunction & load, unsigned int threads = 2);
+    ~ChunkPrefetcher();
+
+    void push(int x, int y, int z, int priority);
+    // Drops every request below pinPriority that has not been picked up by a worker yet
+    void cancel();
+    std::size_t pending() const;
+
+  private:
+    ChunkPrefetcher(const ChunkPrefetcher &);
+    ChunkPrefetcher & operator=(const ChunkPrefetcher &);
+
+    struct Request
+    {
+      int priority;
+      uint64_t sequence;
+      boost::tuple<int, int, int> chunk;
+
+      bool operator< (const Request & other) const
+      {
+        return priority != other.priority ? priority < other.priority : sequence > other.sequence;
+      }
+    };
+
+    void run();
+
+  private:
+    LoadFunction myLoad;
+    std::vector<Request> myQueue;
+    std::set<boost::tuple<int, int, int>> myQueued;
+    uint64_t mySequence;
+    mutable boost::mutex myMutex;
+    boost::condition_variable myCond;
+    boost::thread_group myThreads;
+    bool myQuitFlag;
+  };
+}
+
+#endif // CHUNKPREFETCHER_H
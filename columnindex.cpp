@@ -0,0 +1,607 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "columnindex.hpp"
+#include "chunkdirectory.hpp"
+#include "maputils.hpp"
+
+#include <cstring>
+#include <fstream>
+
+#include <boost/filesystem.hpp>
+
+namespace ADWIF
+{
+  namespace
+  {
+    const char columnsMagic[4] = { 'A', 'D', 'W', 'C' };
+    const uint32_t columnsFormatVersion = 1;
+    // present while the summaries on disk match the chunks on disk
+    const char * const cleanFileName = "clean";
+    // Summaries read from their files by queries alone are never released by the backend, so only this many of them
+    // are kept, the oldest go first
+    const std::size_t queriedLayerLimit = 1024;
+
+    template <class T> void writeValue(std::ostream & os, const T & value)
+    {
+      os.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    template <class T> void readValue(std::istream & is, T & value)
+    {
+      is.read(reinterpret_cast<char *>(&value), sizeof(value));
+    }
+  }
+
+  template <class Cells> ColumnIndex::Column ColumnIndex::summarise(Cells cells) const
+  {
+    Column c;
+    c.top = c.topSeen = -1;
+    c.solid = 0;
+    for (int z = 0; z < myChunkSizeZ; z++)
+    {
+      const MapCell & cell = cells(z);
+      if (cell.used() > 0)
+        c.top = z;
+      if (cell.seen())
+        c.topSeen = z;
+      if (cell.free() == 0)
+        c.solid++;
+    }
+    return c;
+  }
+
+  ColumnIndex::ColumnIndex(const Reader & read, const boost::filesystem::path & path, unsigned int chunkSizeX,
+                           unsigned int chunkSizeY, unsigned int chunkSizeZ, const MapCell & background):
+    myRead(read), myPath(path), myChunkSizeX(chunkSizeX), myChunkSizeY(chunkSizeY), myChunkSizeZ(chunkSizeZ),
+    myBackground(), myStacks(), myStacksLock(), myReleased(), myReleasedLock(), myReleasedFlag(false), myQueried(),
+    myQueriedLock(), myMemory(0), myWrites(0), myCleanFlag(false)
+  {
+    myBackground.top = background.used() > 0 ? myChunkSizeZ - 1 : -1;
+    myBackground.topSeen = background.seen() ? myChunkSizeZ - 1 : -1;
+    myBackground.solid = background.free() == 0 ? myChunkSizeZ : 0;
+
+    // summaries written since the map was last saved may be ahead of its chunks
+    myCleanFlag = boost::filesystem::exists(myPath / cleanFileName);
+    if (!myCleanFlag)
+      boost::filesystem::remove_all(myPath);
+    boost::filesystem::create_directories(myPath);
+  }
+
+  void ColumnIndex::addChunk(int chunkX, int chunkY, int chunkZ)
+  {
+    Stack * s = stack(chunkX, chunkY, true);
+    boost::mutex::scoped_lock guard(s->lock);
+    // read from the chunk's file once asked for, or from its cells if there is none
+    s->layers[chunkZ].stored = true;
+  }
+
+  void ColumnIndex::set(int x, int y, int z, const MapCell & cell, const Writer & write)
+  {
+    update(Box3D(Point3D(x, y, z), Point3D(x + 1, y + 1, z + 1)), &cell, true, write);
+  }
+
+  void ColumnIndex::setRegion(const Box3D & box, const std::vector<MapCell> & cells, const Writer & write)
+  {
+    update(box, cells.data(), false, write);
+  }
+
+  void ColumnIndex::fill(const Box3D & box, const MapCell & cell, const Writer & write)
+  {
+    update(box, &cell, true, write);
+  }
+
+  void ColumnIndex::release(int chunkX, int chunkY, int chunkZ)
+  {
+    boost::mutex::scoped_lock guard(myReleasedLock);
+    myReleased.push_back(packChunkKey(chunkX, chunkY, chunkZ));
+    myReleasedFlag = true;
+  }
+
+  uint64_t ColumnIndex::writes() const { return myWrites.load(); }
+
+  void ColumnIndex::save(uint64_t writes)
+  {
+    drain();
+
+    std::vector<std::pair<uint64_t, Stack *>> stacks;
+    {
+      boost::shared_lock<boost::shared_mutex> guard(myStacksLock);
+      for (auto & entry : myStacks)
+        stacks.push_back(std::make_pair(entry.first, entry.second.get()));
+    }
+
+    for (auto & entry : stacks)
+    {
+      int chunkX, chunkY, chunkZ;
+      unpackChunkKey(entry.first, chunkX, chunkY, chunkZ);
+      boost::mutex::scoped_lock guard(entry.second->lock);
+      for (auto & layer : entry.second->layers)
+        if (layer.second.modified && !layer.second.columns.empty())
+        {
+          const std::size_t memory = footprint(layer.second);
+          store(chunkX, chunkY, layer.first, layer.second);
+          myMemory += footprint(layer.second) - memory;
+        }
+    }
+
+    // whatever was written meanwhile may not be in the chunks on disk yet
+    if (myWrites.load() != writes)
+      return;
+    {
+      std::ofstream os((myPath / cleanFileName).native());
+    }
+    myCleanFlag = true;
+    if (myWrites.load() != writes && myCleanFlag.exchange(false))
+      boost::filesystem::remove(myPath / cleanFileName);
+  }
+
+  std::size_t ColumnIndex::memoryUsage() const { return myMemory.load(); }
+
+  Map::ColumnSummary ColumnIndex::summary(int x, int y)
+  {
+    std::vector<Map::ColumnSummary> out;
+    summaries(x, y, 1, 1, out);
+    return out.front();
+  }
+
+  void ColumnIndex::summaries(int x, int y, int w, int h, std::vector<Map::ColumnSummary> & out)
+  {
+    drain();
+
+    Map::ColumnSummary empty;
+    empty.top = empty.topSeen = Map::ColumnSummary::noHeight;
+    empty.solid = 0;
+    out.assign(std::size_t(std::max(w, 0)) * std::max(h, 0), empty);
+
+    // only the x and y extents matter, so the region is split into chunk columns rather than chunks
+    const Box3D box(Point3D(x, y, 0), Point3D(x + w, y + h, 1));
+    forEachRegionSlice(box, myChunkSizeX, myChunkSizeY, 1, [&](const RegionSlice & slice)
+    {
+      Stack * s = stack(slice.chunkX, slice.chunkY, false);
+      if (!s)
+        return;
+      const int originX = slice.chunkX * myChunkSizeX, originY = slice.chunkY * myChunkSizeY;
+      const int minX = slice.minX - originX, minY = slice.minY - originY;
+      const int maxX = slice.maxX - originX, maxY = slice.maxY - originY;
+
+      // Chunks without summaries and columns whose heights are stale are read back without holding the lock. The
+      // version tells whether a write started or ended meanwhile, in which case they are read again next time.
+      std::vector<Rebuild> rebuilds;
+      std::vector<uint64_t> queried;
+      {
+        boost::mutex::scoped_lock guard(s->lock);
+        for (auto & entry : s->layers)
+        {
+          Layer & l = entry.second;
+          const std::size_t memory = footprint(l);
+          const bool missing = l.columns.empty();
+          resident(slice.chunkX, slice.chunkY, entry.first, l);
+          if (missing && !l.columns.empty())
+            queried.push_back(packChunkKey(slice.chunkX, slice.chunkY, entry.first));
+          myMemory += footprint(l) - memory;
+          if (l.writers)
+            continue;
+          if (l.columns.empty())
+          {
+            const Rebuild r = { entry.first, 0, 0, myChunkSizeX, myChunkSizeY, l.version };
+            rebuilds.push_back(r);
+            continue;
+          }
+          if (!l.staleCount)
+            continue;
+          Rebuild r = { entry.first, maxX, maxY, minX, minY, l.version };
+          for (int yy = minY; yy < maxY; yy++)
+            for (int xx = minX; xx < maxX; xx++)
+              if (l.stale[std::size_t(yy) * myChunkSizeX + xx])
+              {
+                r.minX = std::min(r.minX, xx);
+                r.minY = std::min(r.minY, yy);
+                r.maxX = std::max(r.maxX, xx + 1);
+                r.maxY = std::max(r.maxY, yy + 1);
+              }
+          if (r.minX < r.maxX)
+            rebuilds.push_back(r);
+        }
+      }
+      trackQueried(queried);
+
+      std::vector<const MapCell *> cells;
+      for (const Rebuild & r : rebuilds)
+      {
+        myRead(Box3D(Point3D(originX + r.minX, originY + r.minY, r.chunkZ * myChunkSizeZ),
+                     Point3D(originX + r.maxX, originY + r.maxY, (r.chunkZ + 1) * myChunkSizeZ)), cells);
+        const std::size_t w = r.maxX - r.minX, h = r.maxY - r.minY;
+
+        boost::mutex::scoped_lock guard(s->lock);
+        Layer & l = s->layers[r.chunkZ];
+        if (l.writers || l.version != r.version)
+          continue;
+        const std::size_t memory = footprint(l);
+        const std::size_t columns = std::size_t(myChunkSizeX) * myChunkSizeY;
+        if (l.columns.size() != columns)
+          l.columns.resize(columns, l.columns.empty() ? myBackground : l.columns.front());
+        for (int yy = r.minY; yy < r.maxY; yy++)
+          for (int xx = r.minX; xx < r.maxX; xx++)
+          {
+            const std::size_t column = std::size_t(yy) * myChunkSizeX + xx;
+            const std::size_t offset = std::size_t(yy - r.minY) * w + (xx - r.minX);
+            l.columns[column] = summarise([&](int z) -> const MapCell & { return *cells[z * w * h + offset]; });
+            markStale(l, column, false);
+          }
+        collapse(l);
+        l.modified = true;
+        myMemory += footprint(l) - memory;
+      }
+
+      boost::mutex::scoped_lock guard(s->lock);
+      for (int yy = slice.minY; yy < slice.maxY; yy++)
+        for (int xx = slice.minX; xx < slice.maxX; xx++)
+          combine(s, xx - originX, yy - originY, out[std::size_t(yy - y) * w + (xx - x)]);
+    });
+  }
+
+  void ColumnIndex::update(const Box3D & box, const MapCell * after, bool uniform, const Writer & write)
+  {
+    drain();
+    myWrites++;
+    if (myCleanFlag.exchange(false))
+      boost::filesystem::remove(myPath / cleanFileName);
+
+    std::vector<RegionSlice> slices;
+    forEachRegionSlice(box, myChunkSizeX, myChunkSizeY, myChunkSizeZ, [&](const RegionSlice & slice)
+    {
+      slices.push_back(slice);
+    });
+
+    // Writers are counted before the cells they replace are read, so that no query takes what it reads back meanwhile
+    // to be current. Slices covering whole columns of a chunk are summarised from what is written alone, and the
+    // summaries of others are only brought up to date while they are in memory.
+    bool needReplaced = false;
+    for (const RegionSlice & slice : slices)
+    {
+      Stack * s = stack(slice.chunkX, slice.chunkY, true);
+      boost::mutex::scoped_lock guard(s->lock);
+      Layer & l = layer(s, slice.chunkX, slice.chunkY, slice.chunkZ);
+      l.writers++;
+      l.version++;
+      if (!l.columns.empty() && !wholeColumns(slice))
+        needReplaced = true;
+    }
+
+    // Writes racing each other on the same cells leave the counts of their columns as one of them found the cells
+    std::vector<const MapCell *> replaced;
+    try
+    {
+      write(needReplaced ? &replaced : nullptr);
+    }
+    catch (...)
+    {
+      // whatever part was written, the chunks' summaries are read back from their cells
+      for (const RegionSlice & slice : slices)
+      {
+        Stack * s = stack(slice.chunkX, slice.chunkY, true);
+        boost::mutex::scoped_lock guard(s->lock);
+        Layer & l = s->layers[slice.chunkZ];
+        myMemory -= footprint(l);
+        discard(l);
+        l.writers--;
+        l.version++;
+      }
+      throw;
+    }
+
+    for (const RegionSlice & slice : slices)
+    {
+      Stack * s = stack(slice.chunkX, slice.chunkY, true);
+      boost::mutex::scoped_lock guard(s->lock);
+      Layer & l = s->layers[slice.chunkZ];
+      const std::size_t memory = footprint(l);
+      // summaries that turned up while the cells were written cannot be brought up to date without the replaced cells
+      if (!l.columns.empty() && (needReplaced || wholeColumns(slice)))
+        apply(l, slice, box, after, uniform, replaced);
+      else
+        discard(l);
+      l.modified = true;
+      l.writers--;
+      l.version++;
+      myMemory += footprint(l) - memory;
+    }
+  }
+
+  void ColumnIndex::apply(Layer & layer, const RegionSlice & slice, const Box3D & box, const MapCell * after,
+                          bool uniform, const std::vector<const MapCell *> & before)
+  {
+    const int originX = slice.chunkX * myChunkSizeX, originY = slice.chunkY * myChunkSizeY;
+    const int originZ = slice.chunkZ * myChunkSizeZ;
+    const std::size_t columns = std::size_t(myChunkSizeX) * myChunkSizeY;
+
+    for (int y = slice.minY; y < slice.maxY; y++)
+      for (int x = slice.minX; x < slice.maxX; x++)
+      {
+        const std::size_t column = std::size_t(y - originY) * myChunkSizeX + (x - originX);
+        Column c = layer.columns[layer.columns.size() == 1 ? 0 : column];
+        bool stale = layer.staleCount && layer.stale[column];
+        if (wholeColumns(slice))
+        {
+          c = summarise([&](int z) -> const MapCell &
+          {
+            return uniform ? *after : after[regionOffset(box, x, y, originZ + z)];
+          });
+          stale = false;
+        }
+        else
+          for (int z = slice.minZ; z < slice.maxZ; z++)
+          {
+            const MapCell & b = *before[regionOffset(box, x, y, z)];
+            const MapCell & a = uniform ? *after : after[regionOffset(box, x, y, z)];
+            const int16_t local = z - originZ;
+            if (a.free() == 0 && b.free() != 0)
+              c.solid++;
+            else if (a.free() != 0 && b.free() == 0)
+              c.solid--;
+            // clearing the topmost cell leaves only an upper bound until the column is read back
+            if (a.used() > 0)
+              c.top = std::max(c.top, local);
+            else if (b.used() > 0 && c.top == local)
+              stale = true;
+            if (a.seen())
+              c.topSeen = std::max(c.topSeen, local);
+            else if (b.seen() && c.topSeen == local)
+              stale = true;
+          }
+
+        if (layer.columns.size() == 1 && std::memcmp(&c, &layer.columns.front(), sizeof(Column)) != 0)
+          layer.columns.assign(columns, layer.columns.front());
+        layer.columns[layer.columns.size() == 1 ? 0 : column] = c;
+        markStale(layer, column, stale);
+      }
+
+    if (slice.maxX - slice.minX == myChunkSizeX && slice.maxY - slice.minY == myChunkSizeY)
+      collapse(layer);
+  }
+
+  ColumnIndex::Stack * ColumnIndex::stack(int chunkX, int chunkY, bool create)
+  {
+    const uint64_t key = packChunkKey(chunkX, chunkY, 0);
+    {
+      boost::shared_lock<boost::shared_mutex> guard(myStacksLock);
+      auto i = myStacks.find(key);
+      if (i != myStacks.end())
+        return i->second.get();
+    }
+    if (!create)
+      return nullptr;
+    boost::unique_lock<boost::shared_mutex> guard(myStacksLock);
+    std::unique_ptr<Stack> & s = myStacks[key];
+    if (!s)
+      s.reset(new Stack);
+    return s.get();
+  }
+
+  ColumnIndex::Layer & ColumnIndex::layer(Stack * stack, int chunkX, int chunkY, int chunkZ)
+  {
+    auto i = stack->layers.find(chunkZ);
+    Layer & l = i != stack->layers.end() ? i->second : stack->layers[chunkZ];
+    const std::size_t memory = footprint(l);
+    if (i != stack->layers.end())
+      resident(chunkX, chunkY, chunkZ, l);
+    else
+    {
+      // a chunk neither on disk nor written to before only holds the background
+      l.columns.assign(1, myBackground);
+      l.modified = true;
+    }
+    myMemory += footprint(l) - memory;
+    return l;
+  }
+
+  void ColumnIndex::resident(int chunkX, int chunkY, int chunkZ, Layer & layer)
+  {
+    if (!layer.columns.empty() || !layer.stored)
+      return;
+    std::ifstream is(layerPath(chunkX, chunkY, chunkZ).native(), std::ios_base::binary);
+    char magic[4];
+    uint32_t version = 0, count = 0, staleCount = 0;
+    is.read(magic, sizeof(magic));
+    readValue(is, version);
+    readValue(is, count);
+    const std::size_t columns = std::size_t(myChunkSizeX) * myChunkSizeY;
+    if (!is || std::memcmp(magic, columnsMagic, sizeof(magic)) != 0 || version != columnsFormatVersion ||
+        (count != 1 && count != columns))
+    {
+      // rebuilt from the chunk's cells instead
+      layer.stored = false;
+      return;
+    }
+    std::vector<Column> summaries(count);
+    is.read(reinterpret_cast<char *>(summaries.data()), summaries.size() * sizeof(Column));
+    readValue(is, staleCount);
+    std::vector<uint32_t> stale(is && staleCount <= columns ? staleCount : 0);
+    is.read(reinterpret_cast<char *>(stale.data()), stale.size() * sizeof(uint32_t));
+    if (!is || stale.size() != staleCount)
+    {
+      layer.stored = false;
+      return;
+    }
+    layer.columns.swap(summaries);
+    for (uint32_t column : stale)
+      if (column < columns)
+        markStale(layer, column, true);
+    layer.modified = false;
+  }
+
+  void ColumnIndex::store(int chunkX, int chunkY, int chunkZ, Layer & layer)
+  {
+    collapse(layer);
+    std::ofstream os(layerPath(chunkX, chunkY, chunkZ).native(), std::ios_base::binary | std::ios_base::trunc);
+    os.write(columnsMagic, sizeof(columnsMagic));
+    writeValue(os, columnsFormatVersion);
+    writeValue(os, uint32_t(layer.columns.size()));
+    os.write(reinterpret_cast<const char *>(layer.columns.data()), layer.columns.size() * sizeof(Column));
+    writeValue(os, uint32_t(layer.staleCount));
+    for (std::size_t column = 0; column < layer.stale.size(); column++)
+      if (layer.stale[column])
+        writeValue(os, uint32_t(column));
+    os.close();
+    // summaries that could not be written stay in memory
+    if (os)
+    {
+      layer.stored = true;
+      layer.modified = false;
+    }
+  }
+
+  void ColumnIndex::markStale(Layer & layer, std::size_t column, bool stale)
+  {
+    if (stale == (layer.staleCount && layer.stale[column]))
+      return;
+    if (layer.stale.empty())
+      layer.stale.assign(std::size_t(myChunkSizeX) * myChunkSizeY, false);
+    layer.stale[column] = stale;
+    if (stale)
+      layer.staleCount++;
+    else if (!--layer.staleCount)
+      std::vector<bool>().swap(layer.stale);
+  }
+
+  void ColumnIndex::discard(Layer & layer)
+  {
+    std::vector<Column>().swap(layer.columns);
+    std::vector<bool>().swap(layer.stale);
+    layer.staleCount = 0;
+    layer.stored = layer.modified = false;
+  }
+
+  void ColumnIndex::collapse(Layer & layer)
+  {
+    for (const Column & c : layer.columns)
+      if (std::memcmp(&c, &layer.columns.front(), sizeof(Column)) != 0)
+        return;
+    if (layer.columns.size() > 1)
+      std::vector<Column>(1, layer.columns.front()).swap(layer.columns);
+  }
+
+  bool ColumnIndex::wholeColumns(const RegionSlice & slice) const
+  {
+    return slice.minZ == slice.chunkZ * myChunkSizeZ && slice.maxZ == (slice.chunkZ + 1) * myChunkSizeZ;
+  }
+
+  std::size_t ColumnIndex::footprint(const Layer & layer) const
+  {
+    return layer.columns.capacity() * sizeof(Column) + layer.stale.capacity() / 8;
+  }
+
+
+  void ColumnIndex::drain()
+  {
+    if (!myReleasedFlag.load())
+      return;
+    std::vector<uint64_t> released;
+    {
+      boost::mutex::scoped_lock guard(myReleasedLock);
+      released.swap(myReleased);
+      myReleasedFlag = false;
+    }
+
+    std::vector<uint64_t> busy;
+    for (uint64_t key : released)
+    {
+      int chunkX, chunkY, chunkZ;
+      unpackChunkKey(key, chunkX, chunkY, chunkZ);
+      Stack * s = stack(chunkX, chunkY, false);
+      if (!s)
+        continue;
+      boost::mutex::scoped_lock guard(s->lock);
+      auto i = s->layers.find(chunkZ);
+      if (i == s->layers.end() || i->second.columns.empty())
+        continue;
+      Layer & l = i->second;
+      // the chunk is being written to again, its summaries go once that is done
+      if (l.writers)
+      {
+        busy.push_back(key);
+        continue;
+      }
+      const std::size_t memory = footprint(l);
+      if (l.modified)
+        store(chunkX, chunkY, chunkZ, l);
+      if (!l.modified)
+      {
+        std::vector<Column>().swap(l.columns);
+        std::vector<bool>().swap(l.stale);
+        l.staleCount = 0;
+      }
+      myMemory += footprint(l) - memory;
+    }
+
+    if (!busy.empty())
+    {
+      boost::mutex::scoped_lock guard(myReleasedLock);
+      myReleased.insert(myReleased.end(), busy.begin(), busy.end());
+      myReleasedFlag = true;
+    }
+  }
+
+  void ColumnIndex::trackQueried(const std::vector<uint64_t> & queried)
+  {
+    if (queried.empty())
+      return;
+    std::vector<uint64_t> expired;
+    {
+      boost::mutex::scoped_lock guard(myQueriedLock);
+      myQueried.insert(myQueried.end(), queried.begin(), queried.end());
+      while (myQueried.size() > queriedLayerLimit)
+      {
+        expired.push_back(myQueried.front());
+        myQueried.pop_front();
+      }
+    }
+    // a chunk the backend loaded meanwhile merely has its summaries read again the next time they are needed
+    for (uint64_t key : expired)
+    {
+      int chunkX, chunkY, chunkZ;
+      unpackChunkKey(key, chunkX, chunkY, chunkZ);
+      release(chunkX, chunkY, chunkZ);
+    }
+  }
+
+  void ColumnIndex::combine(Stack * stack, int localX, int localY, Map::ColumnSummary & out) const
+  {
+    const std::size_t column = std::size_t(localY) * myChunkSizeX + localX;
+    for (auto & entry : stack->layers)
+    {
+      const Layer & l = entry.second;
+      // summaries that could not be read back yet
+      if (l.columns.empty())
+        continue;
+      const Column & c = l.columns[l.columns.size() == 1 ? 0 : column];
+      if (out.top == Map::ColumnSummary::noHeight && c.top >= 0)
+        out.top = entry.first * myChunkSizeZ + c.top;
+      if (out.topSeen == Map::ColumnSummary::noHeight && c.topSeen >= 0)
+        out.topSeen = entry.first * myChunkSizeZ + c.topSeen;
+      out.solid += c.solid;
+    }
+  }
+
+  boost::filesystem::path ColumnIndex::layerPath(int chunkX, int chunkY, int chunkZ) const
+  {
+    return myPath / (std::to_string(chunkX) + "." + std::to_string(chunkY) + "." + std::to_string(chunkZ));
+  }
+}
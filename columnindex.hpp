@@ -0,0 +1,181 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef COLUMNINDEX_H
+#define COLUMNINDEX_H
+
+#include "map.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+namespace ADWIF
+{
+  struct RegionSlice;
+
+  // Keeps a Map::ColumnSummary for every column of every chunk known to the map. Writes bring the summaries of the
+  // columns they touch up to date from the cells they replace, which the backend hands back as it writes them, so
+  // queries are answered from the summaries alone; only columns whose topmost cell was cleared are read back, and only
+  // from the chunk that was written.
+  //
+  // A chunk whose columns all look the same keeps a single summary. The summaries of a chunk the backend evicted are
+  // written to a file of their own and freed, and read back from it when needed again. Those read back for queries
+  // alone are kept for a bounded number of chunks, since the backend never evicts them.
+  class ColumnIndex
+  {
+  public:
+    // 'read' fetches cells like Map::getRegion()
+    typedef std::function<void (const Box3D & box, std::vector<const MapCell *> & out)> Reader;
+    // Writes the cells, and when 'replaced' is given fills it with the cells written over, in getRegion() order
+    typedef std::function<void (std::vector<const MapCell *> * replaced)> Writer;
+
+    // Summaries found under 'path' are only used if they were saved after the last write, otherwise they are rebuilt
+    // from the chunks as they are asked for. Columns of chunks never written hold 'background'.
+    ColumnIndex(const Reader & read, const boost::filesystem::path & path, unsigned int chunkSizeX,
+                unsigned int chunkSizeY, unsigned int chunkSizeZ, const MapCell & background);
+
+    // Registers a chunk that is on disk
+    void addChunk(int chunkX, int chunkY, int chunkZ);
+
+    // Each runs 'write' to write the cells and then updates the summaries of the columns written. The replaced cells
+    // are only asked for when the write covers part of a chunk's columns whose summaries are in memory.
+    void set(int x, int y, int z, const MapCell & cell, const Writer & write);
+    void setRegion(const Box3D & box, const std::vector<MapCell> & cells, const Writer & write);
+    void fill(const Box3D & box, const MapCell & cell, const Writer & write);
+
+    // Writes the summaries of an evicted chunk out and frees them. Only queues the chunk, so that backends may call it
+    // with their chunk locks held.
+    void release(int chunkX, int chunkY, int chunkZ);
+
+    // Count of writes so far, to be passed to save()
+    uint64_t writes() const;
+    // Writes out every summary that changed, once the chunks were saved. The summaries on disk are marked current
+    // unless something was written since writes() returned 'writes'.
+    void save(uint64_t writes);
+
+    // Bytes held by the summaries in memory
+    std::size_t memoryUsage() const;
+
+    Map::ColumnSummary summary(int x, int y);
+    // Fills 'out' with the summaries of w * h columns, x varying fastest
+    void summaries(int x, int y, int w, int h, std::vector<Map::ColumnSummary> & out);
+
+  private:
+    ColumnIndex(const ColumnIndex &);
+    ColumnIndex & operator=(const ColumnIndex &);
+
+    // Heights are relative to the chunk's bottom and -1 when a column holds nothing
+    struct Column
+    {
+      int16_t top;
+      int16_t topSeen;
+      uint16_t solid;
+    };
+
+    struct Layer
+    {
+      Layer(): columns(), stale(), staleCount(0), version(0), writers(0), stored(false), modified(false) { }
+
+      // a single entry while every column looks the same, none while the summaries are not in memory
+      std::vector<Column> columns;
+      // columns whose topmost cell was cleared, their heights are only an upper bound until they are read back
+      std::vector<bool> stale;
+      std::size_t staleCount;
+      // bumped by every write, cells read back are only current if no write started or ended meanwhile
+      uint64_t version;
+      unsigned int writers;
+      // whether the summaries may be in a file, and whether they changed since it was written
+      bool stored;
+      bool modified;
+    };
+
+    // Every chunk of one chunk column, the topmost first
+    struct Stack
+    {
+      std::map<int, Layer, std::greater<int>> layers;
+      boost::mutex lock;
+    };
+
+    // A part of a query whose cells have to be read back
+    struct Rebuild
+    {
+      int chunkZ;
+      int minX, minY, maxX, maxY;
+      uint64_t version;
+    };
+
+    // 'after' holds a cell for every position of 'box', or a single one for all of them
+    void update(const Box3D & box, const MapCell * after, bool uniform, const Writer & write);
+    // 'before' holds the cells of 'box' that were replaced, it is only needed for slices covering part of a column
+    void apply(Layer & layer, const RegionSlice & slice, const Box3D & box, const MapCell * after, bool uniform,
+               const std::vector<const MapCell *> & before);
+
+    Stack * stack(int chunkX, int chunkY, bool create);
+    // The layers below expect the stack's lock to be held
+    Layer & layer(Stack * stack, int chunkX, int chunkY, int chunkZ);
+    // Reads the summaries back from their file, leaves them missing if there is none
+    void resident(int chunkX, int chunkY, int chunkZ, Layer & layer);
+    void store(int chunkX, int chunkY, int chunkZ, Layer & layer);
+    void markStale(Layer & layer, std::size_t column, bool stale);
+    // Drops the summaries, they are read back from the chunk's cells when next asked for
+    void discard(Layer & layer);
+    // Whether the slice covers its chunk from bottom to top
+    bool wholeColumns(const RegionSlice & slice) const;
+    void collapse(Layer & layer);
+    std::size_t footprint(const Layer & layer) const;
+    // 'cells' returns the cell of a column at a height relative to the chunk's bottom
+    template <class Cells> Column summarise(Cells cells) const;
+
+    // Frees the summaries of the chunks released since the last call
+    void drain();
+    // Remembers layers read back by a query, releasing the oldest once there are too many
+    void trackQueried(const std::vector<uint64_t> & queried);
+    void combine(Stack * stack, int localX, int localY, Map::ColumnSummary & out) const;
+    boost::filesystem::path layerPath(int chunkX, int chunkY, int chunkZ) const;
+
+  private:
+    Reader myRead;
+    boost::filesystem::path myPath;
+    int myChunkSizeX, myChunkSizeY, myChunkSizeZ;
+    Column myBackground;
+    std::unordered_map<uint64_t, std::unique_ptr<Stack>> myStacks;
+    boost::shared_mutex myStacksLock;
+    std::vector<uint64_t> myReleased;
+    boost::mutex myReleasedLock;
+    boost::atomic_bool myReleasedFlag;
+    std::deque<uint64_t> myQueried;
+    boost::mutex myQueriedLock;
+    boost::atomic<std::size_t> myMemory;
+    boost::atomic<uint64_t> myWrites;
+    // whether the summaries on disk are marked current
+    boost::atomic_bool myCleanFlag;
+  };
+}
+
+#endif // COLUMNINDEX_H
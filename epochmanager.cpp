@@ -0,0 +1,128 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "epochmanager.hpp"
+
+#include <algorithm>
+#include <limits>
+
+namespace ADWIF
+{
+  namespace
+  {
+    // Records belong to the manager and outlive the threads using them, thread exit must not free them
+    template <class T> void keepRecord(T *) { }
+
+    // Retired objects are reclaimed in batches of at least this many, owners call reclaim() themselves once they
+    // are done with a round of work so that fewer than a batch never linger
+    const std::size_t reclaimBatch = 64;
+  }
+
+  EpochManager::Guard::Guard(EpochManager & manager): myRecord(manager.record())
+  {
+    if (myRecord->depth++ == 0)
+      myRecord->epoch.store(manager.myEpoch.load(boost::memory_order_acquire), boost::memory_order_seq_cst);
+  }
+
+  EpochManager::Guard::~Guard()
+  {
+    if (--myRecord->depth == 0)
+      myRecord->epoch.store(0, boost::memory_order_release);
+  }
+
+  EpochManager::EpochManager(): myEpoch(1), myRecords(nullptr), myThreadRecord(&keepRecord<Record>),
+    myRetiredMutex(), myRetired(), myRetiredBytes(0) { }
+
+  EpochManager::~EpochManager()
+  {
+    for (Retired & retired : myRetired)
+      retired.deleter();
+    Record * record = myRecords.load();
+    while (record)
+    {
+      Record * next = record->next;
+      delete record;
+      record = next;
+    }
+  }
+
+  void EpochManager::retire(const std::function<void()> & deleter, std::size_t bytes)
+  {
+    bool full;
+    {
+      std::lock_guard<std::mutex> guard(myRetiredMutex);
+      myRetired.push_back(Retired { myEpoch.load(boost::memory_order_seq_cst), bytes, deleter });
+      myRetiredBytes += bytes;
+      full = myRetired.size() >= reclaimBatch;
+    }
+    if (full)
+      reclaim();
+  }
+
+  void EpochManager::reclaim()
+  {
+    std::vector<std::function<void()>> reclaimable;
+    std::size_t bytes = 0;
+    {
+      std::lock_guard<std::mutex> guard(myRetiredMutex);
+      myEpoch.fetch_add(1, boost::memory_order_seq_cst);
+
+      uint64_t oldest = std::numeric_limits<uint64_t>::max();
+      for (Record * record = myRecords.load(boost::memory_order_acquire); record; record = record->next)
+      {
+        const uint64_t epoch = record->epoch.load(boost::memory_order_seq_cst);
+        if (epoch)
+          oldest = std::min(oldest, epoch);
+      }
+
+      auto i = std::partition(myRetired.begin(), myRetired.end(), [&](const Retired & retired)
+      {
+        return retired.epoch >= oldest;
+      });
+      for (auto j = i; j != myRetired.end(); ++j)
+      {
+        reclaimable.push_back(std::move(j->deleter));
+        bytes += j->bytes;
+      }
+      myRetired.erase(i, myRetired.end());
+    }
+
+    for (auto & deleter : reclaimable)
+      deleter();
+    myRetiredBytes -= bytes;
+  }
+
+  std::size_t EpochManager::retiredBytes() const { return myRetiredBytes.load(); }
+
+  EpochManager::Record * EpochManager::record()
+  {
+    Record * record = myThreadRecord.get();
+    if (!record)
+    {
+      record = new Record;
+      record->epoch = 0;
+      record->depth = 0;
+      record->next = myRecords.load(boost::memory_order_relaxed);
+      while (!myRecords.compare_exchange_weak(record->next, record, boost::memory_order_release,
+                                              boost::memory_order_relaxed));
+      myThreadRecord.reset(record);
+    }
+    return record;
+  }
+}
@@ -0,0 +1,92 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef EPOCHMANAGER_H
+#define EPOCHMANAGER_H
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/tss.hpp>
+
+namespace ADWIF
+{
+  // Epoch based reclamation. Readers wrap their accesses to shared objects in a Guard, which only writes to a
+  // record owned by the calling thread. Objects unlinked by writers are handed to retire() and destroyed once no
+  // thread is still inside a guard entered before they were retired.
+  class EpochManager
+  {
+    struct Record
+    {
+      boost::atomic<uint64_t> epoch; // zero while the thread is outside any guard
+      unsigned int depth;
+      Record * next;
+      char padding[64 - sizeof(boost::atomic<uint64_t>) - sizeof(unsigned int) - sizeof(Record *)];
+    };
+
+  public:
+    class Guard
+    {
+    public:
+      Guard(EpochManager & manager);
+      ~Guard();
+
+    private:
+      Guard(const Guard &);
+      Guard & operator=(const Guard &);
+
+      Record * myRecord;
+    };
+
+    EpochManager();
+    ~EpochManager();
+
+    // bytes is what the object holds, counted by retiredBytes() until it is destroyed
+    void retire(const std::function<void()> & deleter, std::size_t bytes = 0);
+    // Advances the epoch and destroys every retired object no reader can still see
+    void reclaim();
+    std::size_t retiredBytes() const;
+
+  private:
+    EpochManager(const EpochManager &);
+    EpochManager & operator=(const EpochManager &);
+
+    Record * record();
+
+    struct Retired
+    {
+      uint64_t epoch;
+      std::size_t bytes;
+      std::function<void()> deleter;
+    };
+
+  private:
+    boost::atomic<uint64_t> myEpoch;
+    boost::atomic<Record *> myRecords;
+    boost::thread_specific_ptr<Record> myThreadRecord;
+    std::mutex myRetiredMutex;
+    std::vector<Retired> myRetired;
+    boost::atomic<std::size_t> myRetiredBytes;
+  };
+}
+
+#endif // EPOCHMANAGER_H
@@ -50,12 +50,32 @@
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/serialization/shared_ptr.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/device/file.hpp>
 #include <boost/iostreams/filter/bzip2.hpp>
 
 namespace ADWIF
 {
+  static void applyMapCodec(Map & map)
+  {
+    if (!options.count("map-codec"))
+      return;
+    std::vector<std::string> parts = split(options["map-codec"].as<std::string>(), ':');
+    if (parts.empty())
+      return;
+    map.codec(strChunkCodec(parts[0]), parts.size() > 1 ? boost::lexical_cast<int>(parts[1]) : 0);
+  }
+
+  // Only used for new maps, existing ones reopen with the chunk size recorded in their manifest
+  static const unsigned int mapChunkSizeX = 400;
+  static const unsigned int mapChunkSizeY = 240;
+  static const unsigned int mapChunkSizeZ = 8;
+
+  static std::string mapEngine()
+  {
+    return options.count("map-engine") ? options["map-engine"].as<std::string>() : std::string();
+  }
 
   Game::Game(const std::shared_ptr<ADWIF::Engine> & engine): myEngine(engine), myPlayer(nullptr),
     myMap(nullptr), myRaces(), myProfessions(), mySkills(), myFactions(), myElements(), myBiomes()
@@ -331,7 +351,8 @@ namespace ADWIF
   {
     MapCell bg;
     bg.clear();
-    myMap.reset(new Map(engine(), saveDir / "map", false, 400, 240, 8, bg));
+    myMap.reset(new Map(engine(), saveDir / "map", false, mapChunkSizeX, mapChunkSizeY, mapChunkSizeZ, bg, mapEngine()));
+    applyMapCodec(*myMap);
 
     myGenerator.reset(new MapGenerator(shared_from_this()));
 
@@ -363,7 +384,8 @@ namespace ADWIF
   {
     MapCell bg;
     bg.clear();
-    myMap.reset(new Map(engine(), saveDir / "map", true, 512, 512, 32, bg));
+    myMap.reset(new Map(engine(), saveDir / "map", true, mapChunkSizeX, mapChunkSizeY, mapChunkSizeZ, bg, mapEngine()));
+    applyMapCodec(*myMap);
 
     myGenerator.reset(new MapGenerator(shared_from_this()));
 
@@ -380,19 +402,22 @@ namespace ADWIF
     myGenerator->init();
   }
 
-  void Game::saveMap()
+  std::shared_future<void> Game::saveMap()
   {
-    myGenerator->abort();
-    myMap->save();
-
-    boost::iostreams::file_sink fs((saveDir / "generator").native());
-    boost::iostreams::filtering_ostream os;
-    os.push(boost::iostreams::bzip2_compressor());
-    os.push(fs);
-    boost::archive::binary_oarchive oa(os);
-    oa & *myGenerator;
+    // Generation carries on while the map is written. The generator goes first, so every chunk it records as generated
+    // was completed before the snapshot and is part of it; chunks still being generated are redone after loading.
+    {
+      boost::iostreams::file_sink fs((saveDir / "generator").native());
+      boost::iostreams::filtering_ostream os;
+      os.push(boost::iostreams::bzip2_compressor());
+      os.push(fs);
+      boost::archive::binary_oarchive oa(os);
+      oa & *myGenerator;
+    }
 
+    std::shared_future<void> mapSaved = myMap->snapshot();
     myGenerator->notifySave();
+    return mapSaved;
   }
 
   void Game::load(const std::string & fileName)
@@ -402,7 +427,7 @@ namespace ADWIF
 
   void Game::save(const std::string & fileName)
   {
-    saveMap();
+    saveMap().wait();
   }
 
   void Game::loadSkills(const Json::Value & skills)
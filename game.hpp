@@ -26,6 +26,7 @@
 #include <cstdint>
 #include <memory>
 #include <fstream>
+#include <future>
 
 //#include <v8.h>
 #include <json/json.h>
@@ -172,7 +173,8 @@ namespace ADWIF
 
     void createMap();
     void loadMap();
-    void saveMap();
+    // The returned future is ready once the map itself is on disk
+    std::shared_future<void> saveMap();
 
     std::shared_ptr<class Engine> engine() { return myEngine.lock(); }
     const std::shared_ptr<class Engine> engine() const { return myEngine.lock(); }
@@ -23,6 +23,7 @@
 #include <physfs.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
+#include <boost/algorithm/string/join.hpp>
 
 #include "engine.hpp"
 #include "fileutils.hpp"
@@ -75,6 +76,8 @@ int main(int argc, char ** argv)
 #ifdef ADWIF_BUILD_EDITOR
     ("editor", "start in game editor mode")
 #endif
+    ("map-codec", po::value<std::string>(), "compression used for map chunks: none, bzip2, lz4 or zstd, optionally followed by ':level'")
+    ("map-engine", po::value<std::string>(), ("storage backend for new maps: " + boost::algorithm::join(Map::backends(), ", ")).c_str())
     ("help", "show this help message");
 
   po::store(po::parse_command_line(argc, argv, odesc), options);
@@ -0,0 +1,430 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.hpp"
+#include "map.hpp"
+#include "mapimpl.hpp"
+#include "columnindex.hpp"
+#include "changetracker.hpp"
+#include "engine.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+
+#include <boost/thread/mutex.hpp>
+
+namespace ADWIF
+{
+  namespace
+  {
+    const char * const manifestFileName = "manifest";
+    // Maps saved before manifests existed may name their backend in a file of its own
+    const char * const backendFileName = "backend";
+    const char * const columnsDirName = "columns";
+
+    boost::mutex & registryMutex()
+    {
+      static boost::mutex mutex;
+      return mutex;
+    }
+
+    // Function local so that backends registering during static initialisation never see it unconstructed
+    std::map<std::string, MapImpl::Factory> & registry()
+    {
+      static std::map<std::string, MapImpl::Factory> factories;
+      return factories;
+    }
+
+    std::string recordedBackend(const boost::filesystem::path & mapPath)
+    {
+      std::string name;
+      std::ifstream is((mapPath / backendFileName).native());
+      if (is)
+        std::getline(is, name);
+      return name;
+    }
+  }
+
+  const MapCell & MapImpl::exchange(int x, int y, int z, const MapCell & cell)
+  {
+    const MapCell & before = get(x, y, z);
+    set(x, y, z, cell);
+    return before;
+  }
+
+  void MapImpl::exchangeRegion(const Box3D & box, const std::vector<MapCell> & cells,
+                               std::vector<const MapCell *> & replaced)
+  {
+    getRegion(box, replaced);
+    setRegion(box, cells);
+  }
+
+  void MapImpl::exchangeFill(const Box3D & box, const MapCell & cell, std::vector<const MapCell *> & replaced)
+  {
+    getRegion(box, replaced);
+    fill(box, cell);
+  }
+
+  void MapImpl::attach(const std::function<void (int x, int y, int z)> & unloaded,
+                       const std::function<std::size_t ()> & memory)
+  {
+    myUnloaded = unloaded;
+    myAttachedMemory = memory;
+    // backends may already be pruning on threads of their own
+    myAttachedFlag.store(true, boost::memory_order_release);
+  }
+
+  void MapImpl::chunkUnloaded(int x, int y, int z) const
+  {
+    if (myAttachedFlag.load(boost::memory_order_acquire))
+      myUnloaded(x, y, z);
+  }
+
+  std::size_t MapImpl::attachedMemory() const
+  {
+    return myAttachedFlag.load(boost::memory_order_acquire) ? myAttachedMemory() : 0;
+  }
+
+  void MapImpl::registerBackend(const std::string & name, const Factory & factory)
+  {
+    boost::mutex::scoped_lock guard(registryMutex());
+    registry()[name] = factory;
+  }
+
+  MapImpl * MapImpl::create(const std::string & name, Map * parent, const std::shared_ptr<class Engine> & engine,
+                            const boost::filesystem::path & mapPath, bool load,
+                            const std::shared_ptr<MapManifest> & manifest, const MapCell & bgValue)
+  {
+    Factory factory;
+    {
+      boost::mutex::scoped_lock guard(registryMutex());
+      auto i = registry().find(name);
+      if (i == registry().end())
+        throw std::runtime_error("map backend '" + name + "' is not available in this build");
+      factory = i->second;
+    }
+    return factory(parent, engine, mapPath, load, manifest, bgValue);
+  }
+
+  std::vector<std::string> MapImpl::backends()
+  {
+    boost::mutex::scoped_lock guard(registryMutex());
+    std::vector<std::string> names;
+    for (auto & entry : registry())
+      names.push_back(entry.first);
+    return names;
+  }
+
+  Map::Cursor::Cursor(Map & map): myCursor(map.myImpl->cursor()), myMap(&map) { }
+
+  Map::Cursor::Cursor(Map::Cursor && other): myCursor(other.myCursor), myMap(other.myMap) { other.myCursor = nullptr; }
+
+  Map::Cursor::~Cursor()
+  {
+    if (myCursor)
+      myCursor->release();
+    delete myCursor;
+  }
+
+  MapCursor & Map::Cursor::cursor()
+  {
+    if (!myCursor)
+      throw std::logic_error("map cursor used after it was moved from");
+    return *myCursor;
+  }
+
+  const MapCell & Map::Cursor::get(int x, int y, int z) { return cursor().get(x, y, z); }
+  void Map::Cursor::set(int x, int y, int z, const MapCell & cell)
+  {
+    MapCursor & c = cursor();
+    myMap->myColumns->set(x, y, z, cell, [&](std::vector<const MapCell *> * replaced)
+    {
+      if (replaced)
+        replaced->assign(1, &c.exchange(x, y, z, cell));
+      else
+        c.set(x, y, z, cell);
+    });
+    myMap->touched(x, y, z);
+  }
+
+  // a moved-from cursor holds nothing to release
+  void Map::Cursor::release()
+  {
+    if (myCursor)
+      myCursor->release();
+  }
+
+  Map::PinHandle::PinHandle(): myPin(nullptr) { }
+
+  Map::PinHandle::PinHandle(Map::PinHandle && other): myPin(other.myPin) { other.myPin = nullptr; }
+
+  Map::PinHandle & Map::PinHandle::operator=(Map::PinHandle && other)
+  {
+    if (this != &other)
+    {
+      release();
+      myPin = other.myPin;
+      other.myPin = nullptr;
+    }
+    return *this;
+  }
+
+  Map::PinHandle::~PinHandle() { release(); }
+
+  bool Map::PinHandle::empty() const { return !myPin; }
+
+  void Map::PinHandle::release()
+  {
+    delete myPin;
+    myPin = nullptr;
+  }
+
+  constexpr int Map::ColumnSummary::noHeight;
+
+  Map::ChangeFeed::ChangeFeed(): myTracker(nullptr), mySubscriber(nullptr) { }
+
+  Map::ChangeFeed::ChangeFeed(Map::ChangeFeed && other): myTracker(other.myTracker), mySubscriber(other.mySubscriber)
+  {
+    other.mySubscriber = nullptr;
+  }
+
+  Map::ChangeFeed & Map::ChangeFeed::operator=(Map::ChangeFeed && other)
+  {
+    if (this != &other)
+    {
+      release();
+      myTracker = other.myTracker;
+      mySubscriber = other.mySubscriber;
+      other.mySubscriber = nullptr;
+    }
+    return *this;
+  }
+
+  Map::ChangeFeed::~ChangeFeed() { release(); }
+
+  bool Map::ChangeFeed::empty() const { return !mySubscriber; }
+
+  void Map::ChangeFeed::drain(std::vector<Box3D> & out)
+  {
+    if (mySubscriber)
+      myTracker->drain(mySubscriber, out);
+    else
+      out.clear();
+  }
+
+  void Map::ChangeFeed::release()
+  {
+    if (mySubscriber)
+      myTracker->unsubscribe(mySubscriber);
+    mySubscriber = nullptr;
+  }
+
+  Map::Map(const std::shared_ptr<class Engine> & engine, const boost::filesystem::path & mapPath, bool load, unsigned int chunkSizeX,
+           unsigned int chunkSizeY, unsigned int chunkSizeZ, const MapCell & bgValue, const std::string & backend):
+    myImpl(nullptr), myManifest(new MapManifest(mapPath / manifestFileName))
+  {
+    const bool recorded = load && myManifest->load();
+    if (recorded)
+    {
+      if (engine && !backend.empty() && backend != myManifest->backend())
+        engine->log("Map", LogLevel::Info), "map was created with the '", myManifest->backend(), "' backend, ignoring '",
+          backend, "'";
+      if (engine && (chunkSizeX != myManifest->chunkSizeX() || chunkSizeY != myManifest->chunkSizeY() ||
+                     chunkSizeZ != myManifest->chunkSizeZ()))
+        engine->log("Map", LogLevel::Info), "map was created with chunks of ", myManifest->chunkSizeX(), "x",
+          myManifest->chunkSizeY(), "x", myManifest->chunkSizeZ(), ", ignoring ", chunkSizeX, "x", chunkSizeY, "x",
+          chunkSizeZ;
+    }
+    else
+    {
+      std::string name = load ? recordedBackend(mapPath) : std::string();
+      if (name.empty())
+        name = backend;
+      // maps from before backends were recorded were written by whichever one was built in
+      if (name.empty())
+        name = ADWIF_MAP_ENGINE;
+      myManifest->backend(name);
+      myManifest->chunkSize(chunkSizeX, chunkSizeY, chunkSizeZ);
+    }
+
+    myImpl = MapImpl::create(myManifest->backend(), this, engine, mapPath, load, myManifest, bgValue);
+
+    if (recorded && chunkCodecAvailable(myManifest->codec()))
+      myImpl->codec(myManifest->codec(), myManifest->codecLevel());
+    else
+      myManifest->codec(myImpl->codec(), myImpl->codecLevel());
+
+    // a map that was not closed cleanly, or predates manifests, may have chunks on disk its manifest does not know
+    if (!myManifest->complete())
+    {
+      std::shared_ptr<MapManifest> manifest = myManifest;
+      if (load)
+        myImpl->enumerateChunks([manifest](int x, int y, int z) { manifest->insert(x, y, z); });
+      myManifest->markComplete();
+    }
+    myManifest->save();
+    boost::filesystem::remove(mapPath / backendFileName);
+
+    MapImpl * impl = myImpl;
+    myColumns.reset(new ColumnIndex([impl](const Box3D & box, std::vector<const MapCell *> & out) { impl->getRegion(box, out); },
+                                    mapPath / columnsDirName, myManifest->chunkSizeX(), myManifest->chunkSizeY(),
+                                    myManifest->chunkSizeZ(), myImpl->background()));
+    myChanges.reset(new ChangeTracker(myManifest->chunkSizeX(), myManifest->chunkSizeY(), myManifest->chunkSizeZ()));
+    ColumnIndex * columns = myColumns.get();
+    if (load)
+      myManifest->forEachChunk([columns](int x, int y, int z) { columns->addChunk(x, y, z); });
+    myImpl->attach([columns](int x, int y, int z) { columns->release(x, y, z); },
+                   [columns]() { return columns->memoryUsage(); });
+  }
+
+  Map::~Map()
+  {
+    {
+      // the saves still running use the column index and the backend
+      boost::mutex::scoped_lock guard(mySavesLock);
+      for (const std::shared_future<void> & save : mySaves)
+        save.wait();
+    }
+    myChanges.reset();
+    // the backend tells the column index about chunks it frees until it is gone
+    delete myImpl;
+    myColumns.reset();
+    // every chunk written to disk is in the manifest by now, if this fails it is rebuilt the next time the map is opened
+    try { myManifest->save(); }
+    catch (std::exception &) { }
+  }
+
+  const std::string & Map::backend() const { return myManifest->backend(); }
+  std::vector<std::string> Map::backends() { return MapImpl::backends(); }
+
+  const MapCell & Map::get(int x, int y, int z) const { return myImpl->get(x, y, z); }
+  void Map::set(int x, int y, int z, const MapCell & cell)
+  {
+    myColumns->set(x, y, z, cell, [&](std::vector<const MapCell *> * replaced)
+    {
+      if (replaced)
+        replaced->assign(1, &myImpl->exchange(x, y, z, cell));
+      else
+        myImpl->set(x, y, z, cell);
+    });
+    touched(x, y, z);
+  }
+
+  void Map::getRegion(const Box3D & box, std::vector<const MapCell *> & out) const { myImpl->getRegion(box, out); }
+
+  void Map::setRegion(const Box3D & box, const std::vector<MapCell> & cells)
+  {
+    myColumns->setRegion(box, cells, [&](std::vector<const MapCell *> * replaced)
+    {
+      if (replaced)
+        myImpl->exchangeRegion(box, cells, *replaced);
+      else
+        myImpl->setRegion(box, cells);
+    });
+    touched(box);
+  }
+
+  void Map::fill(const Box3D & box, const MapCell & cell)
+  {
+    myColumns->fill(box, cell, [&](std::vector<const MapCell *> * replaced)
+    {
+      if (replaced)
+        myImpl->exchangeFill(box, cell, *replaced);
+      else
+        myImpl->fill(box, cell);
+    });
+    touched(box);
+  }
+
+  Map::ColumnSummary Map::surfaceAt(int x, int y) const { return myColumns->summary(x, y); }
+
+  void Map::surfaceRegion(int x, int y, int w, int h, std::vector<ColumnSummary> & out) const
+  {
+    myColumns->summaries(x, y, w, h, out);
+  }
+
+  uint64_t Map::version(int x, int y, int z) const { return myChanges->version(x, y, z); }
+
+  Map::ChangeFeed Map::changes()
+  {
+    ChangeFeed feed;
+    feed.myTracker = myChanges.get();
+    feed.mySubscriber = myChanges->subscribe();
+    return feed;
+  }
+
+  void Map::touched(const Box3D & box) { myChanges->touch(box); }
+  void Map::touched(int x, int y, int z) { myChanges->touch(x, y, z); }
+
+  void Map::focus(int x, int y, int z) { myImpl->focus(x, y, z); }
+  void Map::prefetch(const Box3D & box, int priority) { myImpl->prefetch(box, priority); }
+  void Map::cancelPrefetch() { myImpl->cancelPrefetch(); }
+
+  Map::PinHandle Map::pin(const Box3D & box)
+  {
+    PinHandle handle;
+    handle.myPin = myImpl->pin(box);
+    return handle;
+  }
+
+  ChunkCodec Map::codec() const { return myImpl->codec(); }
+  int Map::codecLevel() const { return myImpl->codecLevel(); }
+  void Map::codec(ChunkCodec codec, int level)
+  {
+    myImpl->codec(codec, level);
+    myManifest->codec(codec, level);
+  }
+
+  unsigned long int Map::memoryLimit() const { return myImpl->memoryLimit(); }
+  void Map::memoryLimit(unsigned long int megabytes) { myImpl->memoryLimit(megabytes); }
+  const MapCell & Map::background() const { return myImpl->background(); }
+  void Map::prune() const { myImpl->prune(); }
+  std::shared_future<void> Map::save() const
+  {
+    const uint64_t writes = myColumns->writes();
+    return finishSave(myImpl->save(), writes);
+  }
+
+  std::shared_future<void> Map::snapshot() const
+  {
+    const uint64_t writes = myColumns->writes();
+    return finishSave(myImpl->snapshot(), writes);
+  }
+
+  std::shared_future<void> Map::finishSave(const std::shared_future<void> & chunks, uint64_t writes) const
+  {
+    ColumnIndex * columns = myColumns.get();
+    std::shared_ptr<MapManifest> manifest = myManifest;
+    std::shared_future<void> result = std::async(std::launch::async, [chunks, columns, writes, manifest]()
+    {
+      chunks.get();
+      columns->save(writes);
+      manifest->save();
+    }).share();
+    boost::mutex::scoped_lock guard(mySavesLock);
+    mySaves.erase(std::remove_if(mySaves.begin(), mySaves.end(), [](const std::shared_future<void> & save)
+    {
+      return save.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }), mySaves.end());
+    mySaves.push_back(result);
+    return result;
+  }
+}
@@ -21,28 +21,198 @@
 #define MAP_H
 
 #include "mapcell.hpp"
+#include "chunkcodec.hpp"
+
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include <boost/filesystem.hpp>
+#include <boost/geometry/geometries/point.hpp>
+#include <boost/geometry/geometries/box.hpp>
+#include <boost/thread/mutex.hpp>
 
 namespace ADWIF
 {
+  typedef boost::geometry::model::point<int, 3, boost::geometry::cs::cartesian> Point3D;
+  typedef boost::geometry::model::box<Point3D> Box3D;
+
   class Map
   {
   public:
+    // What a column of the map holds, counting only chunks that were written or are on disk. Heights are noHeight for
+    // columns with nothing in them.
+    struct ColumnSummary
+    {
+      static constexpr int noHeight = std::numeric_limits<int>::min();
+
+      // topmost cell that is not empty
+      int top;
+      // topmost cell that was seen
+      int topSeen;
+      // number of cells without any free volume
+      unsigned int solid;
+    };
+
+    // Remembers the chunk it last touched and keeps it resident and locked, so that further accesses
+    // inside the same chunk skip the chunk lookup entirely. The chunk is released when the cursor moves
+    // into another chunk, when release() is called or when the cursor is destroyed.
+    // A cursor must not be shared between threads, and while it holds a chunk its thread must not write
+    // to that chunk through the map or through another cursor.
+    class Cursor
+    {
+    public:
+      Cursor(Map & map);
+      Cursor(Cursor && other);
+      ~Cursor();
+
+      const MapCell & get(int x, int y, int z);
+      void set(int x, int y, int z, const MapCell & cell);
+
+      void release();
+
+    private:
+      Cursor(const Cursor &);
+      Cursor & operator=(const Cursor &);
+
+      // Throws std::logic_error once the cursor has been moved from
+      class MapCursor & cursor();
+
+    private:
+      class MapCursor * myCursor;
+      Map * myMap;
+    };
+
+    // Keeps the chunks it was created for resident until it is released or destroyed; they are never pruned in the
+    // meantime. A handle must be released before the map it came from is destroyed.
+    class PinHandle
+    {
+      friend class Map;
+
+    public:
+      PinHandle();
+      PinHandle(PinHandle && other);
+      PinHandle & operator=(PinHandle && other);
+      ~PinHandle();
+
+      bool empty() const;
+      void release();
+
+    private:
+      PinHandle(const PinHandle &);
+      PinHandle & operator=(const PinHandle &);
+
+    private:
+      class MapPin * myPin;
+    };
+
+    // Collects the regions written through the map since it was last drained, coalesced into one box per chunk that
+    // bounds every write made to it. A feed must be released before the map it came from is destroyed.
+    class ChangeFeed
+    {
+      friend class Map;
+
+    public:
+      ChangeFeed();
+      ChangeFeed(ChangeFeed && other);
+      ChangeFeed & operator=(ChangeFeed && other);
+      ~ChangeFeed();
+
+      bool empty() const;
+      // Replaces the contents of 'out' with the boxes collected so far, max corners exclusive
+      void drain(std::vector<Box3D> & out);
+      void release();
+
+    private:
+      ChangeFeed(const ChangeFeed &);
+      ChangeFeed & operator=(const ChangeFeed &);
+
+    private:
+      class ChangeTracker * myTracker;
+      class ChangeSubscriber * mySubscriber;
+    };
+
+    // 'backend' names the storage backend to use, see backends(), and an empty name picks the default one chosen at
+    // build time. A loaded map always reopens with the backend and chunk size it was created with, as recorded in its
+    // manifest; the arguments only matter for new maps and for maps saved before manifests existed.
     Map(const std::shared_ptr<class Engine> & engine, const boost::filesystem::path & mapPath,
         bool load, unsigned int chunkSizeX, unsigned int chunkSizeY, unsigned int chunkSizeZ,
-        const MapCell & bgValue);
+        const MapCell & bgValue, const std::string & backend = std::string());
     ~Map();
 
+    const std::string & backend() const;
+    // Names of the backends built into this binary
+    static std::vector<std::string> backends();
+
     const MapCell & get(int x, int y, int z) const;
     void set(int x, int y, int z, const MapCell & cell);
 
+    // Fills 'out' with every cell inside 'box' (the max corner is exclusive), x varying fastest, then y, then z.
+    void getRegion(const Box3D & box, std::vector<const MapCell *> & out) const;
+    // Writes a buffer laid out like the one getRegion() fills, locking every affected chunk only once.
+    void setRegion(const Box3D & box, const std::vector<MapCell> & cells);
+    // Sets every cell inside 'box' to 'cell'.
+    void fill(const Box3D & box, const MapCell & cell);
+
+    // Summaries are updated from the cells each write replaces and answered without touching the chunks; only columns
+    // whose topmost cell was cleared are read back once, from the chunk that was written.
+    ColumnSummary surfaceAt(int x, int y) const;
+    // Fills 'out' with the summaries of w * h columns starting at x, y, x varying fastest
+    void surfaceRegion(int x, int y, int w, int h, std::vector<ColumnSummary> & out) const;
+
+    // Version of the chunk holding x, y, z, which grows with every write made to the chunk. Chunks not written to since
+    // the map was opened are at version 0.
+    uint64_t version(int x, int y, int z) const;
+    // Starts collecting changes from now on
+    ChangeFeed changes();
+
+    // Tells the map where the viewer is, so that chunks far from it are evicted before nearby ones
+    void focus(int x, int y, int z);
+
+    // Queues the chunks intersecting 'box' to be loaded by background threads, higher priorities first, so that
+    // later accesses find them resident. cancelPrefetch() drops whatever has not started loading yet, save for the
+    // chunks queued by pin().
+    void prefetch(const Box3D & box, int priority = 0);
+    void cancelPrefetch();
+
+    // Pins the chunks intersecting 'box' and queues the ones that are not resident to be loaded ahead of prefetches
+    PinHandle pin(const Box3D & box);
+
+    // Compression used for chunks written from now on; chunks already on disk stay readable whatever their codec.
+    ChunkCodec codec() const;
+    int codecLevel() const;
+    void codec(ChunkCodec codec, int level = 0);
+
+    // Resident memory, in megabytes, above which pruning evicts chunks regardless of when they were last used
+    unsigned long int memoryLimit() const;
+    void memoryLimit(unsigned long int megabytes);
+
     const MapCell & background() const;
 
     void prune() const;
-    void save() const;
+    // Writes every modified chunk in the background; the future is ready once they are all on disk
+    std::shared_future<void> save() const;
+    // Like save(), but only freezes the modified chunks before returning, without copying them. Writes made afterwards
+    // are not part of the snapshot and never wait for it to reach the disk.
+    std::shared_future<void> snapshot() const;
+
+  private:
+    // Called after every write with the cells it covered
+    void touched(const Box3D & box);
+    void touched(int x, int y, int z);
+    // Saves the column index, as of writes, and the manifest once chunks is ready. The destructor waits for the result.
+    std::shared_future<void> finishSave(const std::shared_future<void> & chunks, uint64_t writes) const;
 
   private:
     class MapImpl * myImpl;
+    std::shared_ptr<class MapManifest> myManifest;
+    std::unique_ptr<class ColumnIndex> myColumns;
+    std::unique_ptr<class ChangeTracker> myChanges;
+    mutable std::vector<std::shared_future<void>> mySaves;
+    mutable boost::mutex mySavesLock;
   };
 }
 
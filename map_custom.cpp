@@ -22,6 +22,14 @@
 #include "map.hpp"
 #include "map_custom.hpp"
 #include "engine.hpp"
+#include "util.hpp"
+#include "maputils.hpp"
+#include "chunkcodec.hpp"
+#include "regionfile.hpp"
+
+#include <cstdlib>
+#include <limits>
+#include <sstream>
 
 #include <boost/format.hpp>
 
@@ -34,287 +42,1080 @@
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/device/file.hpp>
 #include <boost/iostreams/filter/bzip2.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/stream.hpp>
 #include <boost/lexical_cast.hpp>
 
 namespace ADWIF
 {
-  MapImpl::MapImpl(Map * parent, const std::shared_ptr<class Engine> & engine, const boost::filesystem::path & mapPath, bool load,
-                   unsigned int chunkSizeX, unsigned int chunkSizeY, unsigned int chunkSizeZ, const MapCell & bgValue):
-                   myMap(parent), myEngine(engine), myMapPath(mapPath), myChunkSizeX(chunkSizeX), myChunkSizeY(chunkSizeY),
-                   myChunkSizeZ(chunkSizeZ), myBackgroundValue(0), myClock(), myIndexStream(), myMemThresholdMB(2048),
-                   myDurationThreshold(boost::chrono::minutes(1)), myPruningInterval(boost::chrono::seconds(10)),
-                   myPruningInProgressFlag(false), myPruneThread(), myPruneThreadCond(), myPruneThreadMutex(), myPruneThreadQuitFlag(false)
+  const unsigned int CustomMapImpl::clockMaxAge;
+  const std::size_t CustomMapImpl::pruneSweepLimit;
+
+  namespace
+  {
+    // How stale a chunk's access time may get before a reader refreshes it
+    const boost::chrono::seconds accessResolution(1);
+    // Lock-free reads of a chunk give up after this many attempts torn by writers
+    const unsigned int optimisticReadAttempts = 16;
+  }
+
+  CustomMapImpl::CustomMapImpl(Map * parent, const std::shared_ptr<class Engine> & engine, const boost::filesystem::path & mapPath, bool load,
+    const std::shared_ptr<MapManifest> & manifest, const MapCell & bgValue):
+    myMap(parent), myEngine(engine), myMapPath(mapPath), myManifest(manifest), myChunkSizeX(manifest->chunkSizeX()),
+    myChunkSizeY(manifest->chunkSizeY()), myChunkSizeZ(manifest->chunkSizeZ()), myBackgroundValue(0), myEpochs(), myChunks(myEpochs),
+    myClock(), myMemThresholdMB(2048),
+    myDurationThreshold(boost::chrono::minutes(1)), myPruningInterval(boost::chrono::seconds(10)),
+    myPruningInProgressFlag(false), myPruneThread(), myPruneThreadCond(), myPruneThreadMutex(), myPruneThreadQuitFlag(false),
+    myCodec(defaultChunkCodec()), myCodecLevel(0), myRegionFiles(), myRegionFilesMutex(), myLooseChunkFilesFlag(false),
+    myPrefetcher(), myResident(), myClockHand(), myResidentMutex(), myResidentBytes(0), myEvictingBytes(0), myPendingJobs(0),
+    myFocusX(0), myFocusY(0), myFocusZ(0), myFocusFlag(false)
   {
     if (!load)
     {
       boost::filesystem::remove_all(myMapPath);
       boost::filesystem::create_directory(myMapPath);
-      myIndexStream.open((mapPath / "index").native(),
-                         std::ios_base::out | std::ios_base::trunc);
-      myIndexStream.close();
-    }
-    else
-    {
-      myIndexStream.open((mapPath / "index").native(),
-                         std::ios_base::out | std::ios_base::app);
-      myIndexStream.close();
     }
 
-    myIndexStream.open((mapPath / "index").native(),
-                       std::ios_base::binary | std::ios_base::in | std::ios_base::out);
+    // maps saved before region files existed keep every chunk in a file of its own, named like "x.y.z"
+    myLooseChunkFilesFlag = false;
+    if (load)
+      for (boost::filesystem::directory_iterator i(myMapPath), end; i != end && !myLooseChunkFilesFlag; ++i)
+        myLooseChunkFilesFlag = boost::filesystem::is_regular_file(i->status()) &&
+          split(i->path().filename().string(), '.').size() == 3;
 
-    myBank.reset(new MapBank(myIndexStream));
+    myBank.reset(new MapBank(myMapPath / "index"));
     myBackgroundValue = myBank->put(bgValue);
 
     myPruningInProgressFlag.store(false);
     myPruneThreadQuitFlag.store(false);
-    myPruneThread = boost::thread(boost::bind(&MapImpl::pruneTask, this));
+    myClockHand = myResident.end();
+    myPruneThread = boost::thread(boost::bind(&CustomMapImpl::pruneTask, this));
+
+    myPrefetcher.reset(new ChunkPrefetcher([this](int x, int y, int z)
+    {
+      getChunk(vec3(x, y, z))->lock.unlock_shared();
+    }));
   }
 
-  MapImpl::~MapImpl() {
+  CustomMapImpl::~CustomMapImpl() {
+    myPrefetcher.reset();
+    myPruneThreadQuitFlag.store(true);
+    myPruneThreadCond.notify_all();
+    myPruneThread.join();
+    while (myPendingJobs)
+      boost::this_thread::sleep_for(boost::chrono::milliseconds(1));
+  }
 
+  const MapCell & CustomMapImpl::get(int x, int y, int z) const {
+    const vec3 index = chunkIndex(x, y, z);
+    const vec3 local = localIndex(x, y, z);
+    CellId id;
+    if (!readOptimistic(index, [&](const ChunkCells & cells)
+    {
+      id = cells.get(local.get<0>(), local.get<1>(), local.get<2>());
+    }))
+    {
+      Chunk * chunk = getChunk(index);
+      id = chunk->data.load()->get(local.get<0>(), local.get<1>(), local.get<2>());
+      chunk->lock.unlock_shared();
+    }
+    return myBank->get(id);
   }
 
-  const MapCell & MapImpl::get(int x, int y, int z) const {
-    int chunkX = x / (int)myChunkSizeX, chunkY = y / (int)myChunkSizeY, chunkZ = z / (int)myChunkSizeZ;
-    int localX = ((int)myChunkSizeX + x % (int)myChunkSizeX) % (int)myChunkSizeX,
-        localY = ((int)myChunkSizeY + y % (int)myChunkSizeY) % (int)myChunkSizeY,
-        localZ = ((int)myChunkSizeZ + z % (int)myChunkSizeZ) % (int)myChunkSizeZ;
-    std::shared_ptr<Chunk> chunk = getChunk(vec3(chunkX, chunkY, chunkZ));
-    uint64_t hash = chunk->data[localZ * myChunkSizeY * myChunkSizeX + localY * myChunkSizeX + localX];
-    chunk->lock.unlock_shared();
-    return myBank->get(hash);
+  void CustomMapImpl::set(int x, int y, int z, const MapCell & cell) {
+    CellId id = myBank->put(cell);
+    const vec3 local = localIndex(x, y, z);
+    Chunk * chunk = getChunk(chunkIndex(x, y, z), true);
+    writeCell(chunk, local, id);
+    touchChunk(chunk);
+    chunk->lock.unlock();
   }
 
-  void MapImpl::set(int x, int y, int z, const MapCell & cell) {
-    int chunkX = x / (int)myChunkSizeX, chunkY = y / (int)myChunkSizeY, chunkZ = z / (int)myChunkSizeZ;
-    int localX = ((int)myChunkSizeX + x % (int)myChunkSizeX) % (int)myChunkSizeX,
-        localY = ((int)myChunkSizeY + y % (int)myChunkSizeY) % (int)myChunkSizeY,
-        localZ = ((int)myChunkSizeZ + z % (int)myChunkSizeZ) % (int)myChunkSizeZ;
-    std::shared_ptr<Chunk> chunk = getChunk(vec3(chunkX, chunkY, chunkZ));
-    chunk->data[localZ * myChunkSizeY * myChunkSizeX + localY * myChunkSizeX + localX] = myBank->put(cell);
-    chunk->dirty = true;
-    chunk->lock.unlock_shared();
+  const MapCell & CustomMapImpl::exchange(int x, int y, int z, const MapCell & cell)
+  {
+    CellId id = myBank->put(cell);
+    const vec3 local = localIndex(x, y, z);
+    Chunk * chunk = getChunk(chunkIndex(x, y, z), true);
+    // the chunk is held exclusively, so this is the cell written over
+    const CellId before = chunk->data.load()->get(local.get<0>(), local.get<1>(), local.get<2>());
+    writeCell(chunk, local, id);
+    touchChunk(chunk);
+    chunk->lock.unlock();
+    return myBank->get(before);
+  }
+
+  void CustomMapImpl::getRegion(const Box3D & box, std::vector<const MapCell *> & out) const
+  {
+    std::vector<uint64_t> ids(regionVolume(box));
+
+    // Visit every chunk intersecting the box once, copying whole rows of cell ids
+    forEachRegionSlice(box, myChunkSizeX, myChunkSizeY, myChunkSizeZ, [&](const RegionSlice & slice)
+    {
+      const vec3 index(slice.chunkX, slice.chunkY, slice.chunkZ);
+      auto read = [&](const ChunkCells & cells) { readSlice(cells, box, slice, ids.data()); };
+      if (!readOptimistic(index, read))
+      {
+        Chunk * chunk = getChunk(index);
+        read(*chunk->data.load());
+        chunk->lock.unlock_shared();
+      }
+    });
+
+    resolveCells(*myBank, ids, out);
+  }
+
+  void CustomMapImpl::setRegion(const Box3D & box, const std::vector<MapCell> & cells)
+  {
+    writeRegion(box, cells, nullptr);
+  }
+
+  void CustomMapImpl::fill(const Box3D & box, const MapCell & cell)
+  {
+    fillRegion(box, cell, nullptr);
+  }
+
+  void CustomMapImpl::exchangeRegion(const Box3D & box, const std::vector<MapCell> & cells,
+                                     std::vector<const MapCell *> & replaced)
+  {
+    writeRegion(box, cells, &replaced);
+  }
+
+  void CustomMapImpl::exchangeFill(const Box3D & box, const MapCell & cell, std::vector<const MapCell *> & replaced)
+  {
+    fillRegion(box, cell, &replaced);
+  }
+
+  void CustomMapImpl::readSlice(const ChunkCells & cells, const Box3D & box, const RegionSlice & slice,
+                                uint64_t * ids) const
+  {
+    const vec3 local = localIndex(slice.minX, slice.minY, slice.minZ);
+    for (int z = slice.minZ; z < slice.maxZ; z++)
+      for (int y = slice.minY; y < slice.maxY; y++)
+        cells.readRow(local.get<0>(), local.get<1>() + y - slice.minY, local.get<2>() + z - slice.minZ,
+                      slice.maxX - slice.minX, ids + regionOffset(box, slice.minX, y, z));
   }
 
-  const MapCell & MapImpl::background() const {
+  void CustomMapImpl::writeRegion(const Box3D & box, const std::vector<MapCell> & cells,
+                                  std::vector<const MapCell *> * replaced)
+  {
+    if (cells.size() != regionVolume(box))
+      throw std::invalid_argument("cell count does not match region volume");
+
+    std::vector<uint64_t> ids;
+    internCells(*myBank, cells, ids);
+    std::vector<uint64_t> before(replaced ? ids.size() : 0);
+
+    forEachRegionSlice(box, myChunkSizeX, myChunkSizeY, myChunkSizeZ, [&](const RegionSlice & slice)
+    {
+      const vec3 local = localIndex(slice.minX, slice.minY, slice.minZ);
+      Chunk * chunk = getChunk(vec3(slice.chunkX, slice.chunkY, slice.chunkZ), true);
+      // read while the chunk is held for the write, so these are the cells written over
+      if (replaced)
+        readSlice(*chunk->data.load(), box, slice, before.data());
+      writeCells(chunk, [&](ChunkCells & data, std::vector<std::unique_ptr<PalettedCells>> & retired)
+      {
+        for (int z = slice.minZ; z < slice.maxZ; z++)
+          for (int y = slice.minY; y < slice.maxY; y++)
+            if (!data.writeRowShared(local.get<0>(), local.get<1>() + y - slice.minY, local.get<2>() + z - slice.minZ,
+                                     slice.maxX - slice.minX, ids.data() + regionOffset(box, slice.minX, y, z),
+                                     retired))
+              return false;
+        return true;
+      }, [&](ChunkCells & data)
+      {
+        for (int z = slice.minZ; z < slice.maxZ; z++)
+          for (int y = slice.minY; y < slice.maxY; y++)
+            data.writeRow(local.get<0>(), local.get<1>() + y - slice.minY, local.get<2>() + z - slice.minZ,
+                          slice.maxX - slice.minX, ids.data() + regionOffset(box, slice.minX, y, z));
+      });
+      touchChunk(chunk);
+      chunk->lock.unlock();
+    });
+
+    if (replaced)
+      resolveCells(*myBank, before, *replaced);
+  }
+
+  void CustomMapImpl::fillRegion(const Box3D & box, const MapCell & cell, std::vector<const MapCell *> * replaced)
+  {
+    const CellId id = myBank->put(cell);
+    std::vector<uint64_t> before(replaced ? regionVolume(box) : 0);
+
+    forEachRegionSlice(box, myChunkSizeX, myChunkSizeY, myChunkSizeZ, [&](const RegionSlice & slice)
+    {
+      // Bricks the slice covers entirely collapse to the single value, and so does a chunk covered entirely
+      const vec3 local = localIndex(slice.minX, slice.minY, slice.minZ);
+      const unsigned int maxX = local.get<0>() + slice.maxX - slice.minX;
+      const unsigned int maxY = local.get<1>() + slice.maxY - slice.minY;
+      const unsigned int maxZ = local.get<2>() + slice.maxZ - slice.minZ;
+      Chunk * chunk = getChunk(vec3(slice.chunkX, slice.chunkY, slice.chunkZ), true);
+      if (replaced)
+        readSlice(*chunk->data.load(), box, slice, before.data());
+      if (!local.get<0>() && !local.get<1>() && !local.get<2>() &&
+          maxX == myChunkSizeX && maxY == myChunkSizeY && maxZ == myChunkSizeZ)
+        replaceCells(chunk, new ChunkCells(myChunkSizeX, myChunkSizeY, myChunkSizeZ, id));
+      else
+        writeCells(chunk, [&](ChunkCells & data, std::vector<std::unique_ptr<PalettedCells>> & retired)
+        {
+          return data.fillShared(local.get<0>(), local.get<1>(), local.get<2>(), maxX, maxY, maxZ, id, retired);
+        }, [&](ChunkCells & data)
+        {
+          data.fill(local.get<0>(), local.get<1>(), local.get<2>(), maxX, maxY, maxZ, id);
+        });
+      touchChunk(chunk);
+      chunk->lock.unlock();
+    });
+
+    if (replaced)
+      resolveCells(*myBank, before, *replaced);
+  }
+
+  void CustomMapImpl::focus(int x, int y, int z)
+  {
+    const vec3 index = chunkIndex(x, y, z);
+    myFocusX = index.get<0>();
+    myFocusY = index.get<1>();
+    myFocusZ = index.get<2>();
+    myFocusFlag = true;
+  }
+
+  void CustomMapImpl::prefetch(const Box3D & box, int priority)
+  {
+    forEachRegionSlice(box, myChunkSizeX, myChunkSizeY, myChunkSizeZ, [&](const RegionSlice & slice)
+    {
+      const Chunk * chunk = myChunks.find(packChunkKey(slice.chunkX, slice.chunkY, slice.chunkZ));
+      if (!chunk || !chunk->data.load(boost::memory_order_relaxed))
+        myPrefetcher->push(slice.chunkX, slice.chunkY, slice.chunkZ, priority);
+    });
+  }
+
+  void CustomMapImpl::cancelPrefetch()
+  {
+    myPrefetcher->cancel();
+  }
+
+  void CustomMapImpl::pin(const Box3D & box, std::vector<Chunk *> & chunks)
+  {
+    forEachRegionSlice(box, myChunkSizeX, myChunkSizeY, myChunkSizeZ, [&](const RegionSlice & slice)
+    {
+      Chunk * chunk = chunkEntry(vec3(slice.chunkX, slice.chunkY, slice.chunkZ));
+      chunk->pins++;
+      chunks.push_back(chunk);
+    });
+    prefetch(box, ChunkPrefetcher::pinPriority);
+  }
+
+  void CustomMapImpl::unpin(const std::vector<Chunk *> & chunks)
+  {
+    for (Chunk * chunk : chunks)
+      chunk->pins--;
+  }
+
+  void CustomMapImpl::codec(ChunkCodec codec, int level)
+  {
+    if (!chunkCodecAvailable(codec))
+      throw std::runtime_error("chunk codec '" + chunkCodecStr(codec) + "' is not available in this build");
+    myCodec = codec;
+    myCodecLevel = level;
+  }
+
+  const MapCell & CustomMapImpl::background() const {
     return myBank->get(myBackgroundValue);
   }
 
-  void MapImpl::pruneTask()
+  void CustomMapImpl::pruneTask()
   {
     while (!myPruneThreadQuitFlag)
     {
       boost::unique_lock<boost::mutex> lock(myPruneThreadMutex);
-      myPruneThreadCond.wait_for(lock, myPruningInterval);
+      // come back sooner while over the memory threshold, each round only sweeps part of the resident set
+      if (memoryInUse() > std::size_t(myMemThresholdMB) * 1024 * 1024)
+        myPruneThreadCond.wait_for(lock, boost::chrono::milliseconds(100));
+      else
+        myPruneThreadCond.wait_for(lock, myPruningInterval);
       if (!myPruneThreadQuitFlag)
-        prune(false);
+        prune();
       else
         break;
     }
   }
 
-  void MapImpl::prune(bool pruneAll) const {
+  void CustomMapImpl::prune() const {
     bool isPruning = false;
 
     // Use an atomic bool for locking instead of a Mutex because pruneTask() uses a Mutex for timing.
     while (!myPruningInProgressFlag.compare_exchange_weak(isPruning, true))
+    {
+      isPruning = false;
       boost::this_thread::sleep_for(boost::chrono::microseconds(50));
+    }
 
-    std::vector<std::pair<vec3, std::shared_ptr<Chunk>>> accessTimesSorted;
-
-    accessTimesSorted.assign(myChunks.begin(), myChunks.end());
-
-    accessTimesSorted.erase(std::remove_if(accessTimesSorted.begin(), accessTimesSorted.end(), [](const std::pair<vec3, std::shared_ptr<Chunk>> & item) {
-      return !item.second || !item.second->data;
-    }), accessTimesSorted.end());
-
-    std::sort(accessTimesSorted.begin(), accessTimesSorted.end(),
-              [](const std::pair<vec3, std::shared_ptr<Chunk>> & first,
-                  const std::pair<vec3, std::shared_ptr<Chunk>> & second)
-              {
-                return first.second->lastAccess.load() < second.second->lastAccess.load();
-              });
-
-    const std::size_t itemMem = (myChunkSizeX * myChunkSizeY * myChunkSizeZ * sizeof(uint64_t)) / (1024 * 1024);
-    std::size_t memUse = 0;
-
-    memUse = std::accumulate(myChunks.begin(), myChunks.end(), memUse,
-                            [&](unsigned long int sum,
-                                const std::pair<vec3, std::shared_ptr<Chunk>> second)
-                            {
-                              return sum + (second.second->data ? second.second->size * sizeof(uint64_t) / (1024 * 1024) : 0);
-                            });;
+    const std::size_t memUse = memoryInUse() / (1024 * 1024);
 
     if (memUse > myMemThresholdMB)
       myEngine.lock()->log("Map"), memUse, "MB of memory in use, will attempt to free ", memUse - myMemThresholdMB, "MB";
     else
       myEngine.lock()->log("Map"), memUse, "MB of memory in use";
 
-    unsigned long int freed = 0;
+    std::vector<Chunk *> victims;
+    selectEvictions(victims);
+
+    // Evicted chunks are saved and freed on the engine's threads; nothing here waits for them
+    std::size_t scheduled = 0;
+    for (Chunk * chunk : victims)
+    {
+      const std::size_t memory = chunk->memory.load();
+      myEngine.lock()->log("Map"), "scheduling save operation for ", chunk->pos;
+      scheduled += memory;
+      myEvictingBytes += memory;
+      myPendingJobs++;
+      myEngine.lock()->service().post([this, chunk, memory]()
+      {
+        try
+        {
+          saveChunk(chunk);
+          freeChunk(chunk);
+          myEpochs.reclaim();
+        }
+        catch (std::exception & e)
+        {
+          // keep the chunk resident so its changes are not lost, the next round will retry
+          myEngine.lock()->log("Map"), "could not save ", chunk->pos, ": ", e.what();
+          trackChunk(chunk);
+        }
+        myEvictingBytes -= memory;
+        myPendingJobs--;
+      });
+    }
+
+    if (scheduled)
+      myEngine.lock()->log("Map"), "scheduled ", scheduled / (1024 * 1024), "MB to be freed";
 
-    boost::atomic_uint freeCount(0);
+    myBank->prune();
+    // whatever writers retired since the last round is freed now rather than once a batch has piled up
+    myEpochs.reclaim();
+    myPruningInProgressFlag.store(false);
+  }
 
-    auto freeSaveAndFreeChunk = [&](const std::shared_ptr<Chunk> & chunk)
+  std::shared_future<void> CustomMapImpl::save() const { return snapshot(); }
+
+  std::shared_future<void> CustomMapImpl::snapshot() const
+  {
+    struct SaveBatch
     {
-      saveChunk(chunk);
-      freeChunk(chunk);
-      freeCount--;
+      boost::atomic<std::size_t> remaining;
+      boost::atomic_bool failed;
+      std::promise<void> done;
     };
 
-    auto i = accessTimesSorted.begin();
-    while (i != accessTimesSorted.end())
+    struct Frozen
     {
-      duration_type dur(myClock.now() - i->second->lastAccess.load());
-      if (pruneAll || dur > myDurationThreshold ||
-        (memUse > myMemThresholdMB))
+      Chunk * chunk;
+      ChunkCells * cells;
+      uint64_t sequence;
+    };
+
+    std::shared_ptr<SaveBatch> batch(new SaveBatch);
+    std::vector<Chunk *> dirty;
+    std::vector<Frozen> frozen;
+
+    myChunks.forEach([&](Chunk * chunk)
+    {
+      if (chunk->dirty)
+        dirty.push_back(chunk);
+    });
+
+    // Freezing only hands the current cells to the snapshot, writers copy them the next time they touch the chunk
+    for (Chunk * chunk : dirty)
+    {
+      boost::unique_lock<boost::shared_mutex> guard(chunk->lock);
+      if (!chunk->dirty || !chunk->data)
+        continue;
+      Frozen f = { chunk, chunk->data.load(), ++chunk->sequence };
+      chunk->frozen = f.cells;
+      chunk->dirty = false;
+      chunk->saving++;
+      frozen.push_back(f);
+    }
+
+    myEngine.lock()->log("Map"), "saving ", frozen.size(), " modified chunks";
+
+    // one extra count is held until every job has been posted
+    batch->remaining = frozen.size() + 1;
+    batch->failed = false;
+    std::shared_future<void> result = batch->done.get_future().share();
+
+    auto complete = [this, batch](std::exception_ptr error)
+    {
+      if (error && !batch->failed.exchange(true))
+        batch->done.set_exception(error);
+      if (--batch->remaining == 0 && !batch->failed)
       {
-        if (pruneAll)
-          myEngine.lock()->log("Map"), "scheduling save operation for ", i->second->pos;
-        else if (memUse > myMemThresholdMB)
-          myEngine.lock()->log("Map"), "scheduling save operation for ", i->second->pos, " to free ",
-            i->second->size * sizeof(uint64_t) / (1024 * 1024), "MB of memory";
-        else if (dur > myDurationThreshold)
-          myEngine.lock()->log("Map"), "scheduling save operation for ", i->second->pos, ", last accessed in ", dur;
-
-        freeCount++;
-        myEngine.lock()->service().post(boost::bind<void>(freeSaveAndFreeChunk, i->second));
-
-        if (!pruneAll && myMemThresholdMB)
+        // the cells referenced by the saved chunks have to be on disk as well
+        bool isPruning = false;
+        while (!myPruningInProgressFlag.compare_exchange_weak(isPruning, true))
         {
-          freed += itemMem;
-          if (memUse - freed < myMemThresholdMB * 0.70)
-            break;
+          isPruning = false;
+          boost::this_thread::sleep_for(boost::chrono::microseconds(50));
         }
-        i = accessTimesSorted.erase(i);
+        try
+        {
+          myBank->prune();
+          batch->done.set_value();
+        }
+        catch (...)
+        {
+          batch->done.set_exception(std::current_exception());
+        }
+        myPruningInProgressFlag.store(false);
       }
-      else ++i;
+    };
+
+    for (const Frozen & f : frozen)
+    {
+      myPendingJobs++;
+      myEngine.lock()->service().post([this, f, complete]()
+      {
+        std::exception_ptr error;
+        try
+        {
+          ChunkCells compacted(*f.cells);
+          compacted.compact();
+          storeChunk(f.chunk, compacted, f.sequence);
+        }
+        catch (...)
+        {
+          error = std::current_exception();
+        }
+        releaseSnapshot(f.chunk, f.cells, !error);
+        complete(error);
+        myPendingJobs--;
+      });
     }
 
-    if (freed)
-      myEngine.lock()->log("Map"), "scheduled ", freed, "MB to be freed";
+    complete(std::exception_ptr());
+    return result;
+  }
 
-    while(freeCount);
+  void CustomMapImpl::selectEvictions(std::vector<Chunk *> & victims) const
+  {
+    const std::size_t threshold = std::size_t(myMemThresholdMB) * 1024 * 1024;
+    const time_point now = myClock.now();
+    std::size_t projected = memoryInUse();
+    projected -= std::min(projected, myEvictingBytes.load());
+    const bool overThreshold = projected > threshold;
 
-    myBank->prune(pruneAll);
-    myPruningInProgressFlag.store(false);
-  }
+    boost::lock_guard<boost::mutex> guard(myResidentMutex);
 
-  std::shared_ptr<MapImpl::Chunk> MapImpl::getChunk(const vec3 & index) const {
-    auto chunk = myChunks.find(index);
-    if (chunk != myChunks.end())
+    // Over the threshold, chunks are evicted in CLOCK order until usage drops to 70% of it, otherwise only chunks
+    // that have not been touched for myDurationThreshold go
+    for (std::size_t visits = std::min(myResident.size(), pruneSweepLimit); visits && !myResident.empty(); visits--)
     {
-      chunk->second->lock.lock_shared();
-      chunk->second->lastAccess = myClock.now();
-      if (!chunk->second->data && boost::filesystem::exists(myMapPath / chunk->second->fileName))
-        loadChunk(chunk->second);
-      else if (!chunk->second->data) // a chunk was created but was never edited/saved or file is missing
+      if (myClockHand == myResident.end())
+        myClockHand = myResident.begin();
+
+      Chunk * chunk = *myClockHand;
+      bool evict = false;
+
+      if (chunk->pins.load() || chunk->saving.load() || chunk->referenced.exchange(false))
+        chunk->age = 0;
+      else
+      {
+        chunk->age = std::min(chunk->age + evictionWeight(chunk->pos), clockMaxAge);
+        evict = (overThreshold && projected > threshold * 0.70 && chunk->age >= clockMaxAge) ||
+          duration_type(now - chunk->lastAccess.load()) > myDurationThreshold;
+      }
+
+      if (evict)
       {
-        chunk->second->size = myChunkSizeX * myChunkSizeY * myChunkSizeZ;
-        chunk->second->data = new uint64_t[chunk->second->size];
-        std::fill_n(chunk->second->data, chunk->second->size, myBackgroundValue);
-        chunk->second->dirty = true;
-        myEngine.lock()->log("Map"), "created missing chunk ", chunk->second->pos;
+        projected -= std::min(projected, chunk->memory.load());
+        chunk->resident = false;
+        victims.push_back(chunk);
+        myClockHand = myResident.erase(myClockHand);
       }
-      return chunk->second;
+      else
+        ++myClockHand;
+    }
+  }
+
+  unsigned int CustomMapImpl::evictionWeight(const vec3 & pos) const
+  {
+    if (!myFocusFlag)
+      return 2;
+    const int distance = std::max(std::abs(pos.get<0>() - myFocusX.load()), std::max(std::abs(pos.get<1>() - myFocusY.load()),
+                                  std::abs(pos.get<2>() - myFocusZ.load())));
+    if (distance <= focusRadius)
+      return 1;
+    else if (distance <= focusRadius * 2)
+      return 2;
+    return clockMaxAge;
+  }
+
+  CustomMapImpl::Chunk * CustomMapImpl::chunkEntry(const vec3 & index) const {
+    const uint64_t key = packChunkKey(index.get<0>(), index.get<1>(), index.get<2>());
+    Chunk * chunk = myChunks.find(key);
+    if (!chunk)
+    {
+      Chunk * newChunk = new Chunk;
+      newChunk->pos = index;
+      newChunk->data = nullptr;
+      newChunk->version = 0;
+      newChunk->memory = 0;
+      newChunk->referenced = false;
+      newChunk->pins = 0;
+      newChunk->resident = false;
+      newChunk->age = 0;
+      newChunk->dirty = false;
+      newChunk->frozen = nullptr;
+      newChunk->saving = 0;
+      newChunk->sequence = 0;
+      newChunk->stored = 0;
+      newChunk->lastAccess = myClock.now();
+      newChunk->fileName = getChunkName(index);
+      // another thread may have inserted the same chunk in the meantime, in which case theirs is used
+      chunk = myChunks.insert(key, newChunk);
+    }
+    return chunk;
+  }
+
+  CustomMapImpl::Chunk * CustomMapImpl::getChunk(const vec3 & index, bool exclusive) const {
+    Chunk * chunk = chunkEntry(index);
+    noteAccess(chunk);
+
+    if (exclusive)
+    {
+      chunk->lock.lock();
+      if (!chunk->data)
+        loadChunk(chunk);
     }
     else
     {
-      std::shared_ptr<Chunk> chunk(new Chunk);
       chunk->lock.lock_shared();
-      chunk->pos = index;
-      chunk->fileName = getChunkName(index);
-      chunk->lastAccess = myClock.now();
-      if (boost::filesystem::exists(myMapPath / chunk->fileName))
-        loadChunk(chunk);
-      else
+      if (!chunk->data)
+      {
+        chunk->lock.unlock_shared();
+        chunk->lock.lock();
+        if (!chunk->data)
+          loadChunk(chunk);
+        chunk->lock.unlock_and_lock_shared();
+      }
+    }
+
+    return chunk;
+  }
+
+  template <class Fn>
+  bool CustomMapImpl::readOptimistic(const vec3 & index, Fn read) const
+  {
+    // the guard keeps cells replaced while they are being read from being destroyed
+    EpochManager::Guard guard(myEpochs);
+    Chunk * chunk = myChunks.find(packChunkKey(index.get<0>(), index.get<1>(), index.get<2>()));
+    if (!chunk)
+      return false;
+
+    for (unsigned int attempt = 0; attempt < optimisticReadAttempts; attempt++)
+    {
+      const uint64_t version = chunk->version.load(boost::memory_order_acquire);
+      if (version & 1)
+      {
+        boost::this_thread::yield();
+        continue;
+      }
+      const ChunkCells * data = chunk->data.load(boost::memory_order_acquire);
+      if (!data)
+        return false;
+      read(*data);
+      boost::atomic_thread_fence(boost::memory_order_acquire);
+      if (chunk->version.load(boost::memory_order_relaxed) == version)
       {
-        chunk->size = myChunkSizeX * myChunkSizeY * myChunkSizeZ;
-        chunk->data = new uint64_t[chunk->size];
-        std::fill_n(chunk->data, chunk->size, myBackgroundValue);
-        chunk->dirty = true;
-        myEngine.lock()->log("Map"), "created ", chunk->pos;
+        noteAccess(chunk);
+        return true;
       }
-      return myChunks[index] = chunk;
     }
+
+    return false;
+  }
+
+  void CustomMapImpl::noteAccess(Chunk * chunk) const
+  {
+    // only store when the values change, so that readers of a hot chunk do not keep invalidating its cache line
+    const time_point now = myClock.now();
+    if (now - chunk->lastAccess.load(boost::memory_order_relaxed) > accessResolution)
+      chunk->lastAccess.store(now, boost::memory_order_relaxed);
+    if (!chunk->referenced.load(boost::memory_order_relaxed))
+      chunk->referenced.store(true, boost::memory_order_relaxed);
   }
 
-  std::string MapImpl::getChunkName(const vec3 & v) const
+  vec3 CustomMapImpl::chunkIndex(int x, int y, int z) const
+  {
+    return vec3(floorDiv(x, myChunkSizeX), floorDiv(y, myChunkSizeY), floorDiv(z, myChunkSizeZ));
+  }
+
+  vec3 CustomMapImpl::localIndex(int x, int y, int z) const
+  {
+    return vec3(floorMod(x, myChunkSizeX), floorMod(y, myChunkSizeY), floorMod(z, myChunkSizeZ));
+  }
+
+  vec3 CustomMapImpl::regionIndex(const vec3 & chunk) const
+  {
+    return vec3(floorDiv(chunk.get<0>(), regionSizeX), floorDiv(chunk.get<1>(), regionSizeY),
+                floorDiv(chunk.get<2>(), regionSizeZ));
+  }
+
+  vec3 CustomMapImpl::regionLocalIndex(const vec3 & chunk) const
+  {
+    return vec3(floorMod(chunk.get<0>(), regionSizeX), floorMod(chunk.get<1>(), regionSizeY),
+                floorMod(chunk.get<2>(), regionSizeZ));
+  }
+
+  std::shared_ptr<RegionFile> CustomMapImpl::regionFile(const vec3 & chunk) const
+  {
+    const vec3 index = regionIndex(chunk);
+    auto i = myRegionFiles.find(index);
+    if (i != myRegionFiles.end())
+      return i->second;
+
+    // opening a region file creates it, so make sure only one thread does that
+    boost::lock_guard<boost::mutex> guard(myRegionFilesMutex);
+    i = myRegionFiles.find(index);
+    if (i != myRegionFiles.end())
+      return i->second;
+
+    const std::string name = boost::str(boost::format("%d.%d.%d.region") % index.get<0>() % index.get<1>() % index.get<2>());
+    std::shared_ptr<RegionFile> region(new RegionFile(myMapPath / name, regionSizeX, regionSizeY, regionSizeZ));
+    myRegionFiles.insert(std::make_pair(index, region));
+    return region;
+  }
+
+  std::string CustomMapImpl::getChunkName(const vec3 & v) const
   {
     return boost::str(boost::format("%d.%d.%d") % v.get<0>() % v.get<1>() % v.get<2>());
   }
 
-  void MapImpl::loadChunk(const std::shared_ptr< MapImpl::Chunk > & chunk) const
+  void CustomMapImpl::loadChunk(Chunk * chunk) const
   {
-    // This expects the chunk to be lock_shared() before loading
-    chunk->lock.lock_upgrade();
-    if (boost::filesystem::exists(myMapPath / chunk->fileName))
+    // This expects the chunk to be locked exclusively before loading. The cells are only published once complete.
+    std::unique_ptr<ChunkCells> data(new ChunkCells(myChunkSizeX, myChunkSizeY, myChunkSizeZ, myBackgroundValue));
+
+    std::vector<char> record;
+    const vec3 local = regionLocalIndex(chunk->pos);
+    // chunks the manifest does not know were never written, there is no need to open their region file
+    const bool stored = myManifest->mayExist(chunk->pos.get<0>(), chunk->pos.get<1>(), chunk->pos.get<2>());
+    if (stored && regionFile(chunk->pos)->read(local.get<0>(), local.get<1>(), local.get<2>(), record))
     {
       myEngine.lock()->log("Map"), "loading ", chunk->pos;
-      boost::iostreams::file_source fs((myMapPath / chunk->fileName).native());
+      boost::iostreams::stream<boost::iostreams::array_source> is(record.data(), record.size());
+      decodeChunk(chunk, *data, is);
+      chunk->dirty = false;
+      myEngine.lock()->log("Map"), "loaded ", chunk->pos;
+    }
+    else if (stored && myLooseChunkFilesFlag && boost::filesystem::exists(myMapPath / chunk->fileName))
+    {
+      // chunks saved before region files existed are migrated the next time they are saved
+      myEngine.lock()->log("Map"), "loading ", chunk->pos, " from ", chunk->fileName;
+      std::ifstream fs((myMapPath / chunk->fileName).native(), std::ios_base::binary);
+      decodeChunk(chunk, *data, fs);
+      chunk->dirty = true;
+      myEngine.lock()->log("Map"), "loaded ", chunk->pos;
+    }
+    else
+    {
+      // a chunk without a record is all background and stays that way on disk until something is written to it
+      chunk->dirty = false;
+      myEngine.lock()->log("Map"), "created ", chunk->pos;
+    }
+    replaceCells(chunk, data.release());
+    accountChunk(chunk);
+    trackChunk(chunk);
+  }
+
+  void CustomMapImpl::trackChunk(Chunk * chunk) const
+  {
+    boost::lock_guard<boost::mutex> guard(myResidentMutex);
+    if (!chunk->resident)
+    {
+      // chunks go just behind the hand so they get a full revolution before being considered
+      chunk->resident = true;
+      chunk->age = 0;
+      chunk->residentEntry = myResident.insert(myClockHand, chunk);
+    }
+  }
+
+  void CustomMapImpl::decodeChunk(Chunk * chunk, ChunkCells & cells, std::istream & is) const
+  {
+    const uint64_t size = uint64_t(myChunkSizeX) * myChunkSizeY * myChunkSizeZ;
+    std::vector<char> payload;
+    uint8_t format;
+    // a cell takes at most a word and its palette entry, brick and chunk headers at most as much again
+    if (readChunkData(is, payload, format, size * 4 * sizeof(uint64_t)))
+    {
+      if (format == ChunkFormatCellIds)
+        cells.deserialise(payload.data(), payload.size());
+      else if (format == ChunkFormatBricks)
+      {
+        cells.deserialise(payload.data(), payload.size());
+        if (cells.sizeX() != myChunkSizeX || cells.sizeY() != myChunkSizeY || cells.sizeZ() != myChunkSizeZ)
+          throw std::runtime_error("chunk " + chunk->fileName + " does not match the map's chunk size");
+        std::vector<uint64_t> hashes(size);
+        for (unsigned int z = 0; z < myChunkSizeZ; z++)
+          for (unsigned int y = 0; y < myChunkSizeY; y++)
+            cells.readRow(0, y, z, myChunkSizeX, hashes.data() + (uint64_t(z) * myChunkSizeY + y) * myChunkSizeX);
+        loadHashedChunk(cells, hashes.data());
+      }
+      else if (format == ChunkFormatPalette)
+      {
+        PalettedCells palette;
+        palette.deserialise(payload.data(), payload.size());
+        if (palette.size() != size)
+          throw std::runtime_error("chunk " + chunk->fileName + " does not match the map's chunk size");
+        std::vector<uint64_t> hashes(size);
+        palette.read(0, size, hashes.data());
+        loadHashedChunk(cells, hashes.data());
+      }
+      else if (format == ChunkFormatDense && payload.size() == size * sizeof(uint64_t))
+        loadHashedChunk(cells, reinterpret_cast<const uint64_t *>(payload.data()));
+      else
+        throw std::runtime_error("unsupported format in chunk " + chunk->fileName);
+      if (cells.sizeX() != myChunkSizeX || cells.sizeY() != myChunkSizeY || cells.sizeZ() != myChunkSizeZ)
+        throw std::runtime_error("chunk " + chunk->fileName + " does not match the map's chunk size");
+    }
+    else
+    {
+      // chunks saved before the chunk header existed are bzip2 compressed archives
+      std::vector<uint64_t> hashes(size);
       boost::iostreams::filtering_istream os;
       os.push(boost::iostreams::bzip2_decompressor());
-      os.push(fs);
+      os.push(is);
       boost::archive::binary_iarchive ia(os);
-      if (!chunk->data)
-      {
-        chunk->size = myChunkSizeX * myChunkSizeY * myChunkSizeZ;
-        chunk->data = new uint64_t[chunk->size];
-      }
-      ia.load_binary((void*)chunk->data, chunk->size * sizeof(uint64_t));
-      chunk->dirty = false;
-      myEngine.lock()->log("Map"), "loaded ", chunk->pos;
+      ia.load_binary((void*)hashes.data(), size * sizeof(uint64_t));
+      loadHashedChunk(cells, hashes.data());
     }
-    chunk->lock.unlock_upgrade_and_lock_shared();
   }
 
-  void MapImpl::saveChunk(const std::shared_ptr< MapImpl::Chunk > & chunk) const
+  void CustomMapImpl::saveChunk(Chunk * chunk) const
   {
     boost::unique_lock<boost::shared_mutex> guard(chunk->lock);
     myEngine.lock()->log("Map"), "saving ", chunk->pos;
     if (chunk->dirty && chunk->data)
     {
-      boost::iostreams::file_sink fs((myMapPath / chunk->fileName).native());
-      boost::iostreams::filtering_ostream os;
-      os.push(boost::iostreams::bzip2_compressor());
-      os.push(fs);
-      boost::archive::binary_oarchive oa(os);
-      oa.save_binary((void*)chunk->data, chunk->size * sizeof(uint64_t));
+      std::unique_ptr<ChunkCells> compacted(new ChunkCells(*chunk->data.load()));
+      compacted->compact();
+      replaceCells(chunk, compacted.release());
+      accountChunk(chunk);
+      storeChunk(chunk, *chunk->data.load(), ++chunk->sequence);
       chunk->dirty = false;
-      myEngine.lock()->log("Map"), "saved ", chunk->pos;
     }
     duration_type dur(myClock.now() - chunk->lastAccess.load());
-    if (chunk->data && dur > myDurationThreshold)
+    if (chunk->data.load() && !chunk->pins && !chunk->saving && dur > myDurationThreshold)
+      unloadChunk(chunk);
+  }
+
+  void CustomMapImpl::storeChunk(Chunk * chunk, const ChunkCells & cells, uint64_t sequence) const
+  {
+    boost::lock_guard<boost::mutex> guard(chunk->storeMutex);
+    if (sequence <= chunk->stored)
+      return;
+    // a chunk on disk must never refer to cells that are not
+    myBank->prune();
+    const std::shared_ptr<RegionFile> region = regionFile(chunk->pos);
+    const vec3 local = regionLocalIndex(chunk->pos);
+    if (cells.uniform() && cells.uniformValue() == myBackgroundValue)
+    {
+      region->erase(local.get<0>(), local.get<1>(), local.get<2>());
+      myBank->setReferences(chunk->pos.get<0>(), chunk->pos.get<1>(), chunk->pos.get<2>(), std::vector<CellId>());
+    }
+    else
     {
-      delete[] chunk->data;
-      chunk->data = nullptr;
-      myEngine.lock()->log("Map"), "unloaded ", chunk->pos;
+      std::vector<uint64_t> values;
+      cells.values(values);
+      const std::vector<CellId> ids(values.begin(), values.end());
+      myBank->addReferences(chunk->pos.get<0>(), chunk->pos.get<1>(), chunk->pos.get<2>(), ids);
+      std::vector<char> payload;
+      cells.serialise(payload);
+      std::ostringstream os;
+      writeChunkData(os, payload.data(), payload.size(), ChunkFormatCellIds, myCodec, myCodecLevel);
+      const std::string record = os.str();
+      myManifest->insert(chunk->pos.get<0>(), chunk->pos.get<1>(), chunk->pos.get<2>());
+      region->write(local.get<0>(), local.get<1>(), local.get<2>(), record.data(), record.size());
+      myBank->setReferences(chunk->pos.get<0>(), chunk->pos.get<1>(), chunk->pos.get<2>(), ids);
     }
+    if (myLooseChunkFilesFlag && boost::filesystem::exists(myMapPath / chunk->fileName))
+      boost::filesystem::remove(myMapPath / chunk->fileName);
+    chunk->stored = sequence;
+    myEngine.lock()->log("Map"), "saved ", chunk->pos;
   }
 
-  void MapImpl::freeChunk(const std::shared_ptr< MapImpl::Chunk > & chunk) const
+  void CustomMapImpl::releaseSnapshot(Chunk * chunk, ChunkCells * cells, bool stored) const
   {
     boost::unique_lock<boost::shared_mutex> guard(chunk->lock);
-    if (chunk->data)
-      delete[] chunk->data;
-    chunk->data = nullptr;
+    // cells that are still the chunk's own just become writable again, cells replaced since then were left to us
+    if (chunk->frozen == cells)
+      chunk->frozen = nullptr;
+    else if (chunk->data.load() != cells)
+      myEpochs.retire([cells]() { delete cells; }, cells->memoryUsage());
+    if (!stored)
+      chunk->dirty = true;
+    chunk->saving--;
+  }
+
+  void CustomMapImpl::freeChunk(Chunk * chunk) const
+  {
+    boost::unique_lock<boost::shared_mutex> guard(chunk->lock);
+    // the chunk may have been pinned, snapshotted or written to after it was chosen for eviction and saved, a write
+    // that landed in between is only on disk once the chunk has been saved again
+    if (chunk->pins || chunk->saving || chunk->dirty)
+      trackChunk(chunk);
+    else
+      unloadChunk(chunk);
+  }
+
+  void CustomMapImpl::unloadChunk(Chunk * chunk) const
+  {
+    if (!chunk->data.load())
+      return;
+    replaceCells(chunk, nullptr);
+    accountChunk(chunk);
+
+    {
+      boost::lock_guard<boost::mutex> guard(myResidentMutex);
+      if (chunk->resident)
+      {
+        if (myClockHand == chunk->residentEntry)
+          ++myClockHand;
+        myResident.erase(chunk->residentEntry);
+        chunk->resident = false;
+      }
+    }
+
     myEngine.lock()->log("Map"), "unloaded ", chunk->pos;
+    chunkUnloaded(chunk->pos.get<0>(), chunk->pos.get<1>(), chunk->pos.get<2>());
+  }
+
+  std::size_t CustomMapImpl::memoryInUse() const
+  {
+    // replaced cells are still held until no reader can see them
+    return myResidentBytes.load() + myEpochs.retiredBytes() + attachedMemory();
   }
 
-  Map::Map(const std::shared_ptr<class Engine> & engine, const boost::filesystem::path & mapPath, bool load, unsigned int chunkSizeX,
-          unsigned int chunkSizeY, unsigned int chunkSizeZ, const MapCell & bgValue): myImpl(nullptr)
-          {
-            myImpl = new MapImpl(this, engine, mapPath, load,
-                                  chunkSizeX, chunkSizeY, chunkSizeZ, bgValue);
-          }
+  void CustomMapImpl::accountChunk(Chunk * chunk) const
+  {
+    const ChunkCells * data = chunk->data.load();
+    const std::size_t memory = data ? data->memoryUsage() : 0;
+    myResidentBytes += memory - chunk->memory.exchange(memory);
+  }
+
+  void CustomMapImpl::loadHashedChunk(ChunkCells & cells, const uint64_t * hashes) const
+  {
+    const uint64_t size = uint64_t(myChunkSizeX) * myChunkSizeY * myChunkSizeZ;
+    std::vector<uint64_t> ids(size);
+    for (uint64_t i = 0; i < size; i++)
+      ids[i] = i && hashes[i] == hashes[i - 1] ? ids[i - 1] : myBank->find(hashes[i]);
+    for (unsigned int z = 0; z < myChunkSizeZ; z++)
+      for (unsigned int y = 0; y < myChunkSizeY; y++)
+        cells.writeRow(0, y, z, myChunkSizeX, ids.data() + (uint64_t(z) * myChunkSizeY + y) * myChunkSizeX);
+    cells.compact();
+  }
 
-  Map::~Map() { delete myImpl; }
+  void CustomMapImpl::writeCell(Chunk * chunk, const vec3 & local, CellId id) const
+  {
+    ChunkCells * data = chunk->data.load();
+    std::unique_ptr<PalettedCells> retired;
+    bool written = false;
+    // frozen cells belong to a snapshot being written, so they are copied below instead
+    if (data != chunk->frozen)
+    {
+      chunk->version.fetch_add(1, boost::memory_order_acq_rel);
+      written = data->setShared(local.get<0>(), local.get<1>(), local.get<2>(), id, retired);
+      chunk->version.fetch_add(1, boost::memory_order_release);
+    }
 
-  const MapCell & Map::get(int x, int y, int z) const { return myImpl->get(x,y,z); }
-  void Map::set(int x, int y, int z, const MapCell & cell) { myImpl->set(x, y, z, cell); }
-  const MapCell & Map::background() const { return myImpl->background(); }
-  void Map::save() const { myImpl->prune(true); }
-  void Map::prune() const { myImpl->prune(false); }
+    if (retired)
+    {
+      PalettedCells * brick = retired.release();
+      myEpochs.retire([brick]() { delete brick; }, brick->memoryUsage());
+    }
 
+    if (!written)
+    {
+      std::unique_ptr<ChunkCells> copy(new ChunkCells(*data));
+      copy->set(local.get<0>(), local.get<1>(), local.get<2>(), id);
+      replaceCells(chunk, copy.release());
+    }
+  }
 
+  template <class Shared, class Plain>
+  void CustomMapImpl::writeCells(Chunk * chunk, Shared shared, Plain plain) const
+  {
+    ChunkCells * data = chunk->data.load();
+    std::vector<std::unique_ptr<PalettedCells>> retired;
+    bool written = false;
+    if (data != chunk->frozen)
+    {
+      chunk->version.fetch_add(1, boost::memory_order_acq_rel);
+      written = shared(*data, retired);
+      chunk->version.fetch_add(1, boost::memory_order_release);
+    }
+
+    if (!retired.empty())
+    {
+      std::size_t bytes = 0;
+      for (const std::unique_ptr<PalettedCells> & brick : retired)
+        bytes += brick->memoryUsage();
+      auto * bricks = new std::vector<std::unique_ptr<PalettedCells>>(std::move(retired));
+      myEpochs.retire([bricks]() { delete bricks; }, bytes);
+    }
+
+    // only a chunk that would have to be split, which is a single value and cheap to copy, or one a snapshot is
+    // writing is copied whole
+    if (!written)
+    {
+      std::unique_ptr<ChunkCells> copy(new ChunkCells(*data));
+      plain(*copy);
+      replaceCells(chunk, copy.release());
+    }
+  }
+
+  void CustomMapImpl::replaceCells(Chunk * chunk, ChunkCells * cells) const
+  {
+    chunk->version.fetch_add(1, boost::memory_order_acq_rel);
+    ChunkCells * previous = chunk->data.exchange(cells, boost::memory_order_acq_rel);
+    chunk->version.fetch_add(1, boost::memory_order_release);
+    // frozen cells are left to the snapshot writing them, which retires them once it is done
+    if (previous && previous == chunk->frozen)
+      chunk->frozen = nullptr;
+    else if (previous)
+      myEpochs.retire([previous]() { delete previous; }, previous->memoryUsage());
+  }
+
+  void CustomMapImpl::touchChunk(Chunk * chunk) const
+  {
+    chunk->dirty = true;
+    accountChunk(chunk);
+  }
+
+
+  void CustomMapImpl::enumerateChunks(const std::function<void (int x, int y, int z)> & fn) const
+  {
+    for (boost::filesystem::directory_iterator i(myMapPath), end; i != end; ++i)
+    {
+      if (!boost::filesystem::is_regular_file(i->status()))
+        continue;
+      const std::string name = i->path().filename().string();
+      std::vector<std::string> parts = split(name, '.');
+      int x, y, z;
+      try
+      {
+        if (parts.size() < 3)
+          continue;
+        x = boost::lexical_cast<int>(parts[0]);
+        y = boost::lexical_cast<int>(parts[1]);
+        z = boost::lexical_cast<int>(parts[2]);
+      }
+      catch (boost::bad_lexical_cast &)
+      {
+        continue;
+      }
+
+      if (parts.size() == 3)
+        fn(x, y, z);
+      else if (parts.size() == 4 && parts[3] == "region")
+      {
+        const vec3 origin(x * regionSizeX, y * regionSizeY, z * regionSizeZ);
+        const std::shared_ptr<RegionFile> region = regionFile(origin);
+        for (int lz = 0; lz < regionSizeZ; lz++)
+          for (int ly = 0; ly < regionSizeY; ly++)
+            for (int lx = 0; lx < regionSizeX; lx++)
+              if (region->contains(lx, ly, lz))
+                fn(origin.get<0>() + lx, origin.get<1>() + ly, origin.get<2>() + lz);
+      }
+    }
+  }
+
+  ChunkCodec CustomMapImpl::codec() const { return myCodec; }
+  int CustomMapImpl::codecLevel() const { return myCodecLevel; }
+  unsigned long int CustomMapImpl::memoryLimit() const { return myMemThresholdMB; }
+  void CustomMapImpl::memoryLimit(unsigned long int megabytes) { myMemThresholdMB = megabytes; }
+
+  struct CustomMapImpl::Cursor : public MapCursor
+  {
+    Cursor(CustomMapImpl * impl): impl(impl), chunk(nullptr), index(), exclusive(false) { }
+
+    const MapCell & get(int x, int y, int z)
+    {
+      seek(x, y, z, false);
+      const vec3 local = impl->localIndex(x, y, z);
+      return impl->myBank->get(chunk->data.load()->get(local.get<0>(), local.get<1>(), local.get<2>()));
+    }
+
+    void set(int x, int y, int z, const MapCell & cell)
+    {
+      CellId id = impl->myBank->put(cell);
+      seek(x, y, z, true);
+      impl->writeCell(chunk, impl->localIndex(x, y, z), id);
+      impl->touchChunk(chunk);
+    }
+
+    const MapCell & exchange(int x, int y, int z, const MapCell & cell)
+    {
+      CellId id = impl->myBank->put(cell);
+      seek(x, y, z, true);
+      const vec3 local = impl->localIndex(x, y, z);
+      const CellId before = chunk->data.load()->get(local.get<0>(), local.get<1>(), local.get<2>());
+      impl->writeCell(chunk, local, id);
+      impl->touchChunk(chunk);
+      return impl->myBank->get(before);
+    }
+
+    void seek(int x, int y, int z, bool write)
+    {
+      vec3 target = impl->chunkIndex(x, y, z);
+      if (chunk && target == index && (exclusive || !write))
+        return;
+      release();
+      chunk = impl->getChunk(target, write);
+      index = target;
+      exclusive = write;
+    }
+
+    void release()
+    {
+      if (!chunk)
+        return;
+      if (exclusive)
+        chunk->lock.unlock();
+      else
+        chunk->lock.unlock_shared();
+      chunk = nullptr;
+    }
+
+    CustomMapImpl * impl;
+    Chunk * chunk;
+    vec3 index;
+    bool exclusive;
+  };
+
+  struct CustomMapImpl::Pin : public MapPin
+  {
+    Pin(CustomMapImpl * impl): impl(impl), chunks() { }
+    ~Pin() { impl->unpin(chunks); }
+
+    CustomMapImpl * impl;
+    std::vector<Chunk *> chunks;
+  };
+
+  MapCursor * CustomMapImpl::cursor() { return new Cursor(this); }
+
+  MapPin * CustomMapImpl::pin(const Box3D & box)
+  {
+    std::unique_ptr<Pin> pin(new Pin(this));
+    this->pin(box, pin->chunks);
+    return pin.release();
+  }
+
+  static MapImpl::Registration registration("Custom", [](Map * parent, const std::shared_ptr<class Engine> & engine,
+    const boost::filesystem::path & mapPath, bool load, const std::shared_ptr<MapManifest> & manifest,
+    const MapCell & bgValue) -> MapImpl *
+  {
+    return new CustomMapImpl(parent, engine, mapPath, load, manifest, bgValue);
+  });
 }
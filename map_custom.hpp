@@ -22,8 +22,13 @@
 #ifndef MAP_CUSTOM_H
 #define MAP_CUSTOM_H
 
-#include "map.hpp"
+#include "mapimpl.hpp"
 #include "mapbank.hpp"
+#include "chunkcodec.hpp"
+#include "mapchunk.hpp"
+#include "chunkprefetcher.hpp"
+#include "chunkdirectory.hpp"
+#include "epochmanager.hpp"
 
 #include <boost/multi_array.hpp>
 #include <boost/tuple/tuple.hpp>
@@ -33,6 +38,8 @@
 #include <boost/thread/shared_mutex.hpp>
 #include <tbb/concurrent_unordered_map.h>
 #include <fstream>
+#include <future>
+#include <list>
 
 #include <boost/geometry/geometry.hpp>
 #include <boost/geometry/geometries/point.hpp>
@@ -59,65 +66,186 @@ namespace tbb {
 std::ostream & operator<< (std::ostream & os, const vec3 & v)
 {
   os << v.get<0>() << "x" << v.get<1>() << "x" << v.get<2>();
+  return os;
 }
 
 namespace ADWIF
 {
-  class MapImpl
-  {
-    friend class Map;
+  struct RegionSlice;
 
+  class CustomMapImpl : public MapImpl
+  {
     using clock_type = boost::chrono::steady_clock;
     using time_point = clock_type::time_point;
     using duration_type = clock_type::duration;
 
+    // Payload formats written inside chunk records
+    enum ChunkFormat : uint8_t
+    {
+      // the first three hold cell hashes, as written before the bank handed out ids
+      ChunkFormatDense = 1, // the raw array of cell hashes
+      ChunkFormatPalette = 2, // PalettedCells::serialise() of the whole chunk
+      ChunkFormatBricks = 3, // ChunkCells::serialise()
+      ChunkFormatCellIds = 4, // ChunkCells::serialise() of cell ids
+    };
+
     struct Chunk
     {
+      ~Chunk() { delete data.load(); }
+
       vec3 pos;
-      uint64_t * data;
-      uint64_t size;
+      // Replaced cell data is retired through myEpochs. Writers hold the lock exclusively and make the version odd
+      // while they modify the chunk, so that readers which skip the lock can tell their read was torn.
+      boost::atomic<ChunkCells *> data;
+      boost::atomic<uint64_t> version;
+      boost::atomic<std::size_t> memory;
+      boost::atomic_bool referenced;
+      // number of PinHandles covering the chunk, pinned chunks are never evicted
+      boost::atomic_uint pins;
+      // eviction state, guarded by myResidentMutex
+      bool resident;
+      unsigned int age;
+      std::list<Chunk *>::iterator residentEntry;
       boost::atomic<time_point> lastAccess;
       boost::atomic_bool dirty;
+      // cells a snapshot is still writing out, never modified in place while they are; guarded by lock
+      ChunkCells * frozen;
+      // number of snapshots of the chunk not yet on disk, such chunks are not evicted
+      boost::atomic_uint saving;
+      // every version written to disk is numbered so that an older one never overwrites a newer one; sequence is
+      // guarded by lock and stored by storeMutex
+      uint64_t sequence;
+      uint64_t stored;
+      boost::mutex storeMutex;
       std::string fileName;
       mutable boost::shared_mutex lock;
     };
 
+    static const int regionSizeX = 32;
+    static const int regionSizeY = 32;
+    static const int regionSizeZ = 4;
+
+    // Resident chunks sit on a CLOCK ring. Every pass of the hand over an unreferenced chunk ages it by a weight
+    // that grows with its distance from the focus, and chunks that reach clockMaxAge are evicted first.
+    static const unsigned int clockMaxAge = 4;
+    static const int focusRadius = 2;
+    // Number of chunks a single prune() visits at most
+    static const std::size_t pruneSweepLimit = 1024;
+
+    struct Cursor;
+    struct Pin;
+
   public:
-    MapImpl(Map * parent, const std::shared_ptr<class Engine> & engine, const boost::filesystem::path & mapPath,
-            bool load, unsigned int chunkSizeX, unsigned int chunkSizeY, unsigned int chunkSizeZ,
-            const MapCell & bgValue = MapCell());
-    ~MapImpl();
+    CustomMapImpl(Map * parent, const std::shared_ptr<class Engine> & engine, const boost::filesystem::path & mapPath,
+                  bool load, const std::shared_ptr<MapManifest> & manifest, const MapCell & bgValue = MapCell());
+    ~CustomMapImpl();
 
     const MapCell & get(int x, int y, int z) const;
     void set(int x, int y, int z, const MapCell & cell);
 
+    void getRegion(const Box3D & box, std::vector<const MapCell *> & out) const;
+    void setRegion(const Box3D & box, const std::vector<MapCell> & cells);
+    void fill(const Box3D & box, const MapCell & cell);
+
+    const MapCell & exchange(int x, int y, int z, const MapCell & cell);
+    void exchangeRegion(const Box3D & box, const std::vector<MapCell> & cells, std::vector<const MapCell *> & replaced);
+    void exchangeFill(const Box3D & box, const MapCell & cell, std::vector<const MapCell *> & replaced);
+
+    void focus(int x, int y, int z);
+
+    void prefetch(const Box3D & box, int priority);
+    void cancelPrefetch();
+
+    MapCursor * cursor();
+    MapPin * pin(const Box3D & box);
+
+    ChunkCodec codec() const;
+    int codecLevel() const;
+    void codec(ChunkCodec codec, int level);
+
+    unsigned long int memoryLimit() const;
+    void memoryLimit(unsigned long int megabytes);
+
     const MapCell & background() const;
 
-    void prune(bool pruneAll = false) const;
+    // Schedules a round of evictions and returns without waiting for them
+    void prune() const;
+    std::shared_future<void> save() const;
+    std::shared_future<void> snapshot() const;
+
+    void enumerateChunks(const std::function<void (int x, int y, int z)> & fn) const;
 
   private:
-    std::shared_ptr<Chunk> getChunk(const vec3 & index) const;
+    void pin(const Box3D & box, std::vector<Chunk *> & chunks);
+    void unpin(const std::vector<Chunk *> & chunks);
+
+    vec3 chunkIndex(int x, int y, int z) const;
+    vec3 localIndex(int x, int y, int z) const;
+
+    // Returns the entry for a chunk, creating it if needed, without loading it
+    Chunk * chunkEntry(const vec3 & index) const;
+    // Returns the chunk with its data resident and its lock held, shared unless exclusive is requested
+    Chunk * getChunk(const vec3 & index, bool exclusive = false) const;
+    // Calls read() with the chunk's cells without taking its lock, retrying while writers interfere. Returns false
+    // when the chunk is not resident or the read kept failing, and the caller has to go through getChunk() instead.
+    template <class Fn> bool readOptimistic(const vec3 & index, Fn read) const;
+    void noteAccess(Chunk * chunk) const;
     std::string getChunkName(const vec3 & v) const;
+    // Copies the ids of the slice's cells into 'ids', which holds those of 'box' in getRegion() order
+    void readSlice(const ChunkCells & cells, const Box3D & box, const RegionSlice & slice, uint64_t * ids) const;
+    // Both hand back the cells they write over in 'replaced' unless it is null
+    void writeRegion(const Box3D & box, const std::vector<MapCell> & cells, std::vector<const MapCell *> * replaced);
+    void fillRegion(const Box3D & box, const MapCell & cell, std::vector<const MapCell *> * replaced);
 
-    void loadChunk(const std::shared_ptr<Chunk> & chunk) const;
-    void saveChunk(const std::shared_ptr<Chunk> & chunk) const;
-    void freeChunk(const std::shared_ptr<Chunk> & chunk) const;
+    // Chunks are stored in region files holding regionSizeX * regionSizeY * regionSizeZ chunks each
+    vec3 regionIndex(const vec3 & chunk) const;
+    vec3 regionLocalIndex(const vec3 & chunk) const;
+    std::shared_ptr<class RegionFile> regionFile(const vec3 & chunk) const;
+
+    void loadChunk(Chunk * chunk) const;
+    void decodeChunk(Chunk * chunk, ChunkCells & cells, std::istream & is) const;
+    void saveChunk(Chunk * chunk) const;
+    // Writes a version of the chunk's cells to its region file, unless a newer version was written already
+    void storeChunk(Chunk * chunk, const ChunkCells & cells, uint64_t sequence) const;
+    // Called once a snapshot of the chunk is on disk or failed to get there
+    void releaseSnapshot(Chunk * chunk, ChunkCells * cells, bool stored) const;
+    void freeChunk(Chunk * chunk) const;
+    // Both expect the chunk to be locked exclusively
+    void unloadChunk(Chunk * chunk) const;
+    void accountChunk(Chunk * chunk) const;
+    // Resident chunks, retired cells not yet freed and what the map attached, in bytes
+    std::size_t memoryInUse() const;
+    // Puts a resident chunk back on the CLOCK ring
+    void trackChunk(Chunk * chunk) const;
+    // Fills the cells from an array of cell hashes, looking up the id of each
+    void loadHashedChunk(ChunkCells & cells, const uint64_t * hashes) const;
+    // These expect the chunk to be locked exclusively
+    void writeCell(Chunk * chunk, const vec3 & local, CellId id) const;
+    // Writes through the chunk's cells with 'shared', a ChunkCells::writeRowShared() or fillShared() style write,
+    // or with 'plain' to a copy of them when that fails or the cells are frozen. Expects the chunk locked exclusively.
+    template <class Shared, class Plain> void writeCells(Chunk * chunk, Shared shared, Plain plain) const;
+    void replaceCells(Chunk * chunk, ChunkCells * cells) const;
+    // Called with the chunk locked exclusively after its cells were modified
+    void touchChunk(Chunk * chunk) const;
 
     void pruneTask();
+    void selectEvictions(std::vector<Chunk *> & victims) const;
+    unsigned int evictionWeight(const vec3 & pos) const;
 
   private:
 
     Map * myMap;
     std::weak_ptr<class Engine> myEngine;
     boost::filesystem::path myMapPath;
+    std::shared_ptr<MapManifest> myManifest;
     unsigned int myChunkSizeX, myChunkSizeY, myChunkSizeZ;
-    uint64_t myBackgroundValue;
+    CellId myBackgroundValue;
     std::shared_ptr<MapBank> myBank;
-    mutable tbb::interface5::concurrent_unordered_map<vec3, std::shared_ptr<Chunk>> myChunks;
+    mutable EpochManager myEpochs;
+    mutable ChunkDirectory<Chunk> myChunks;
     clock_type myClock;
-    std::fstream myIndexStream;
 
-    unsigned long int myMemThresholdMB;
+    boost::atomic<unsigned long int> myMemThresholdMB;
     duration_type myDurationThreshold;
     duration_type myPruningInterval;
     mutable boost::atomic_bool myPruningInProgressFlag;
@@ -125,7 +253,20 @@ namespace ADWIF
     boost::condition_variable myPruneThreadCond;
     mutable boost::mutex myPruneThreadMutex;
     boost::atomic_bool myPruneThreadQuitFlag;
-
+    ChunkCodec myCodec;
+    int myCodecLevel;
+    mutable tbb::interface5::concurrent_unordered_map<vec3, std::shared_ptr<class RegionFile>> myRegionFiles;
+    mutable boost::mutex myRegionFilesMutex;
+    bool myLooseChunkFilesFlag;
+    std::unique_ptr<ChunkPrefetcher> myPrefetcher;
+    mutable std::list<Chunk *> myResident;
+    mutable std::list<Chunk *>::iterator myClockHand;
+    mutable boost::mutex myResidentMutex;
+    mutable boost::atomic<std::size_t> myResidentBytes;
+    mutable boost::atomic<std::size_t> myEvictingBytes;
+    mutable boost::atomic_uint myPendingJobs;
+    boost::atomic_int myFocusX, myFocusY, myFocusZ;
+    boost::atomic_bool myFocusFlag;
   };
 }
 
@@ -23,109 +23,334 @@
 #include "map_field3d.hpp"
 #include "map.hpp"
 #include "mapbank.hpp"
+#include "util.hpp"
+#include "maputils.hpp"
 
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/format.hpp>
 
+#include <algorithm>
 #include <fstream>
+#include <future>
 #include <memory>
 #include <climits>
+#include <limits>
 
 namespace ADWIF
 {
-  bool MapImpl::myInitialisedFlag;
+  namespace
+  {
+    // Frees the blocks of a field that hold a single value, these are stored as that value alone
+    void compactBlocks(FieldType & field)
+    {
+      const F3D::V3i res = field.blockRes();
+      const F3D::Box3i & window = field.dataWindow();
+      const int size = field.blockSize();
+      for (int bk = 0; bk < res.z; bk++)
+        for (int bj = 0; bj < res.y; bj++)
+          for (int bi = 0; bi < res.x; bi++)
+          {
+            if (!field.blockIsAllocated(bi, bj, bk))
+              continue;
+            const int minX = bi * size, maxX = std::min((bi + 1) * size, window.max.x + 1);
+            const int minY = bj * size, maxY = std::min((bj + 1) * size, window.max.y + 1);
+            const int minZ = bk * size, maxZ = std::min((bk + 1) * size, window.max.z + 1);
+            const uint64_t value = field.fastValue(minX, minY, minZ);
+            bool uniform = true;
+            for (int z = minZ; z < maxZ && uniform; z++)
+              for (int y = minY; y < maxY && uniform; y++)
+                for (int x = minX; x < maxX && uniform; x++)
+                  uniform = field.fastValue(x, y, z) == value;
+            if (uniform)
+              field.setBlockEmptyValue(bi, bj, bk, value);
+          }
+    }
+
+    // The ids of every cell a field holds
+    void collectIds(const FieldType & field, std::vector<CellId> & ids)
+    {
+      const F3D::V3i res = field.blockRes();
+      const F3D::Box3i & window = field.dataWindow();
+      const int size = field.blockSize();
+      for (int bk = 0; bk < res.z; bk++)
+        for (int bj = 0; bj < res.y; bj++)
+          for (int bi = 0; bi < res.x; bi++)
+          {
+            if (!field.blockIsAllocated(bi, bj, bk))
+            {
+              ids.push_back(field.getBlockEmptyValue(bi, bj, bk));
+              continue;
+            }
+            for (int z = bk * size; z < std::min((bk + 1) * size, window.max.z + 1); z++)
+              for (int y = bj * size; y < std::min((bj + 1) * size, window.max.y + 1); y++)
+                for (int x = bi * size; x < std::min((bi + 1) * size, window.max.x + 1); x++)
+                  if (ids.empty() || ids.back() != field.fastValue(x, y, z))
+                    ids.push_back(field.fastValue(x, y, z));
+          }
+    }
+
+    // Replaces the cell hashes held by fields saved before cells had ids with the ids of their cells
+    void translateHashes(FieldType & field, const MapBank & bank)
+    {
+      const F3D::V3i res = field.blockRes();
+      const F3D::Box3i & window = field.dataWindow();
+      const int size = field.blockSize();
+      for (int bk = 0; bk < res.z; bk++)
+        for (int bj = 0; bj < res.y; bj++)
+          for (int bi = 0; bi < res.x; bi++)
+          {
+            if (!field.blockIsAllocated(bi, bj, bk))
+            {
+              field.setBlockEmptyValue(bi, bj, bk, bank.find(field.getBlockEmptyValue(bi, bj, bk)));
+              continue;
+            }
+            for (int z = bk * size; z < std::min((bk + 1) * size, window.max.z + 1); z++)
+              for (int y = bj * size; y < std::min((bj + 1) * size, window.max.y + 1); y++)
+                for (int x = bi * size; x < std::min((bi + 1) * size, window.max.x + 1); x++)
+                  field.fastLValue(x, y, z) = bank.find(field.fastValue(x, y, z));
+          }
+    }
+  }
 
-  MapImpl::MapImpl(Map * parent, const std::shared_ptr<Engine> & engine, const boost::filesystem::path & mapPath,
-                   bool load, unsigned int chunkSizeX, unsigned int chunkSizeY, unsigned int chunkSizeZ,
-                   const MapCell & bgValue):
-    myMap(parent), myEngine(engine), myMapPath(mapPath), myIndexStream(), myBank(), myChunkSize(chunkSizeX, chunkSizeY, chunkSizeZ),
+  bool Field3DMapImpl::myInitialisedFlag;
+
+  Field3DMapImpl::Field3DMapImpl(Map * parent, const std::shared_ptr<Engine> & engine, const boost::filesystem::path & mapPath,
+                                 bool load, const std::shared_ptr<MapManifest> & manifest, const MapCell & bgValue):
+    myMap(parent), myEngine(engine), myMapPath(mapPath), myManifest(manifest), myBank(),
+    myChunkSize(manifest->chunkSizeX(), manifest->chunkSizeY(), manifest->chunkSizeZ()), myBlockOrder(4),
     myBackgroundValue(0), myChunks(), myLock(), myClock(), myMemThresholdMB(2048), myDurationThreshold(boost::chrono::minutes(1)),
     myPruningInterval(boost::chrono::seconds(10)), myPruningInProgressFlag(false), myPruneThread(), myPruneThreadCond(),
-    myPruneThreadMutex(), myPruneThreadQuitFlag(false)
+    myPruneThreadMutex(), myPruneThreadQuitFlag(false), myCodec(ChunkCodec::None), myCodecLevel(0), myPrefetcher()
   {
     if (!myInitialisedFlag)
     {
       F3D::initIO();
-      F3D::SparseFileManager::singleton().setLimitMemUse(true);
-      F3D::SparseFileManager::singleton().setMaxMemUse(1024);
       myInitialisedFlag = true;
     }
+    // the manager is shared by every map, the last one opened sets its limit
+    memoryLimit(myMemThresholdMB);
 
     if (!load)
     {
       boost::filesystem::remove_all(myMapPath);
       boost::filesystem::create_directory(myMapPath);
-      myIndexStream.open((mapPath / "index").native(),
-                         std::ios_base::out | std::ios_base::trunc);
-      myIndexStream.close();
-    }
-    else
-    {
-      myIndexStream.open((mapPath / "index").native(),
-                         std::ios_base::out | std::ios_base::app);
-      myIndexStream.close();
     }
 
-    myIndexStream.open((mapPath / "index").native(),
-                       std::ios_base::binary | std::ios_base::in | std::ios_base::out);
-
-    myBank.reset(new MapBank(myIndexStream));
+    myBank.reset(new MapBank(myMapPath / "index"));
     myBackgroundValue = myBank->put(bgValue);
 
     myPruningInProgressFlag.store(false);
     myPruneThreadQuitFlag.store(false);
-    myPruneThread = boost::thread(boost::bind(&MapImpl::pruneTask, this));
+    myPruneThread = boost::thread(boost::bind(&Field3DMapImpl::pruneTask, this));
+
+    myPrefetcher.reset(new ChunkPrefetcher([this](int x, int y, int z)
+    {
+      std::shared_ptr<Chunk> chunk = getChunk(Vec3Type(x, y, z));
+      boost::upgrade_lock<boost::shared_mutex> guard(chunk->lock);
+      if (!chunk->field)
+        loadChunk(chunk, guard);
+    }));
   }
 
-  MapImpl::~MapImpl() { }
+  Field3DMapImpl::~Field3DMapImpl()
+  {
+    {
+      boost::lock_guard<boost::mutex> guard(mySavesLock);
+      for (const std::shared_future<void> & save : mySaves)
+        save.wait();
+    }
+    myPrefetcher.reset();
+    myPruneThreadQuitFlag.store(true);
+    myPruneThreadCond.notify_all();
+    myPruneThread.join();
+  }
 
-  const MapCell & MapImpl::get(int x, int y, int z) const
+  const MapCell & Field3DMapImpl::get(int x, int y, int z) const
   {
-    std::shared_ptr<Chunk> chunk = getChunk(x, y, z);
+    std::shared_ptr<Chunk> chunk = getChunk(chunkIndex(x, y, z));
     boost::upgrade_lock<boost::shared_mutex> guard(chunk->lock);
     if(!chunk->field)
       loadChunk(chunk, guard);
     const MapCell & value = myBank->get(
-      chunk->field->fastValue((x%myChunkSize.x+myChunkSize.x)%myChunkSize.x,
-                              (y%myChunkSize.y+myChunkSize.y)%myChunkSize.y,
-                              (z%myChunkSize.z+myChunkSize.z)%myChunkSize.z));
+      chunk->field->fastValue(floorMod(x, myChunkSize.x), floorMod(y, myChunkSize.y), floorMod(z, myChunkSize.z)));
     return value;
   }
 
-  void MapImpl::set(int x, int y, int z, const MapCell & cell)
+  void Field3DMapImpl::set(int x, int y, int z, const MapCell & cell)
   {
     if (!myPruneThread.joinable())
       myPruneThread.start_thread();
-    uint64_t hash = myBank->put(cell);
-    std::shared_ptr<Chunk> chunk = getChunk(x, y, z);
+    CellId id = myBank->put(cell);
+    std::shared_ptr<Chunk> chunk = getChunk(chunkIndex(x, y, z));
     boost::upgrade_lock<boost::shared_mutex> guard(chunk->lock);
     if(!chunk->field)
       loadChunk(chunk, guard);
     boost::upgrade_to_unique_lock<boost::shared_mutex> lock(guard);
-    chunk->field->fastLValue((x%myChunkSize.x+myChunkSize.x)%myChunkSize.x,
-                             (y%myChunkSize.y+myChunkSize.y)%myChunkSize.y,
-                             (z%myChunkSize.z+myChunkSize.z)%myChunkSize.z) = hash;
+    if (chunk->fileBacked)
+      detachChunk(chunk);
+    chunk->field->fastLValue(floorMod(x, myChunkSize.x), floorMod(y, myChunkSize.y), floorMod(z, myChunkSize.z)) = id;
     chunk->dirty = true;
 //     if (!myChunks.empty() && (myAccessCounter++ % myAccessTolerance == 0))
 //       prune(false);
   }
 
-  const MapCell & MapImpl::background() const
+  void Field3DMapImpl::getRegion(const Box3D & box, std::vector<const MapCell *> & out) const
+  {
+    std::vector<CellId> ids(regionVolume(box));
+
+    forEachRegionSlice(box, myChunkSize.x, myChunkSize.y, myChunkSize.z, [&](const RegionSlice & slice)
+    {
+      std::shared_ptr<Chunk> chunk = getChunk(Vec3Type(slice.chunkX, slice.chunkY, slice.chunkZ));
+      boost::upgrade_lock<boost::shared_mutex> guard(chunk->lock);
+      if(!chunk->field)
+        loadChunk(chunk, guard);
+      const int offX = slice.chunkX * myChunkSize.x, offY = slice.chunkY * myChunkSize.y, offZ = slice.chunkZ * myChunkSize.z;
+      for (int z = slice.minZ; z < slice.maxZ; z++)
+        for (int y = slice.minY; y < slice.maxY; y++)
+        {
+          auto dst = ids.begin() + regionOffset(box, slice.minX, y, z);
+          for (int x = slice.minX; x < slice.maxX; x++)
+            *dst++ = chunk->field->fastValue(x - offX, y - offY, z - offZ);
+        }
+    });
+
+    resolveCells(*myBank, ids, out);
+  }
+
+  void Field3DMapImpl::setRegion(const Box3D & box, const std::vector<MapCell> & cells)
+  {
+    if (cells.size() != regionVolume(box))
+      throw std::invalid_argument("cell count does not match region volume");
+
+    std::vector<CellId> ids;
+    internCells(*myBank, cells, ids);
+
+    forEachRegionSlice(box, myChunkSize.x, myChunkSize.y, myChunkSize.z, [&](const RegionSlice & slice)
+    {
+      std::shared_ptr<Chunk> chunk = getChunk(Vec3Type(slice.chunkX, slice.chunkY, slice.chunkZ));
+      boost::upgrade_lock<boost::shared_mutex> guard(chunk->lock);
+      if(!chunk->field)
+        loadChunk(chunk, guard);
+      boost::upgrade_to_unique_lock<boost::shared_mutex> lock(guard);
+      if (chunk->fileBacked)
+        detachChunk(chunk);
+      const int offX = slice.chunkX * myChunkSize.x, offY = slice.chunkY * myChunkSize.y, offZ = slice.chunkZ * myChunkSize.z;
+      for (int z = slice.minZ; z < slice.maxZ; z++)
+        for (int y = slice.minY; y < slice.maxY; y++)
+        {
+          auto src = ids.begin() + regionOffset(box, slice.minX, y, z);
+          for (int x = slice.minX; x < slice.maxX; x++)
+            chunk->field->fastLValue(x - offX, y - offY, z - offZ) = *src++;
+        }
+      chunk->dirty = true;
+    });
+  }
+
+  void Field3DMapImpl::fill(const Box3D & box, const MapCell & cell)
+  {
+    const CellId id = myBank->put(cell);
+
+    forEachRegionSlice(box, myChunkSize.x, myChunkSize.y, myChunkSize.z, [&](const RegionSlice & slice)
+    {
+      std::shared_ptr<Chunk> chunk = getChunk(Vec3Type(slice.chunkX, slice.chunkY, slice.chunkZ));
+      boost::upgrade_lock<boost::shared_mutex> guard(chunk->lock);
+      if(!chunk->field)
+        loadChunk(chunk, guard);
+      boost::upgrade_to_unique_lock<boost::shared_mutex> lock(guard);
+      if (chunk->fileBacked)
+        detachChunk(chunk);
+      FieldType & field = *chunk->field;
+      const int offX = slice.chunkX * myChunkSize.x, offY = slice.chunkY * myChunkSize.y, offZ = slice.chunkZ * myChunkSize.z;
+      const int minX = slice.minX - offX, maxX = slice.maxX - offX;
+      const int minY = slice.minY - offY, maxY = slice.maxY - offY;
+      const int minZ = slice.minZ - offZ, maxZ = slice.maxZ - offZ;
+      const int size = field.blockSize();
+      // blocks the slice covers entirely are set to the value without allocating them, the rest voxel by voxel
+      for (int bk = minZ / size; bk <= (maxZ - 1) / size; bk++)
+        for (int bj = minY / size; bj <= (maxY - 1) / size; bj++)
+          for (int bi = minX / size; bi <= (maxX - 1) / size; bi++)
+          {
+            const int x0 = std::max(bi * size, minX), x1 = std::min((bi + 1) * size, maxX);
+            const int y0 = std::max(bj * size, minY), y1 = std::min((bj + 1) * size, maxY);
+            const int z0 = std::max(bk * size, minZ), z1 = std::min((bk + 1) * size, maxZ);
+            if (x0 == bi * size && x1 == std::min((bi + 1) * size, myChunkSize.x) &&
+                y0 == bj * size && y1 == std::min((bj + 1) * size, myChunkSize.y) &&
+                z0 == bk * size && z1 == std::min((bk + 1) * size, myChunkSize.z))
+              field.setBlockEmptyValue(bi, bj, bk, id);
+            else
+              for (int z = z0; z < z1; z++)
+                for (int y = y0; y < y1; y++)
+                  for (int x = x0; x < x1; x++)
+                    field.fastLValue(x, y, z) = id;
+          }
+      chunk->dirty = true;
+    });
+  }
+
+  void Field3DMapImpl::prefetch(const Box3D & box, int priority)
+  {
+    forEachRegionSlice(box, myChunkSize.x, myChunkSize.y, myChunkSize.z, [&](const RegionSlice & slice)
+    {
+      myPrefetcher->push(slice.chunkX, slice.chunkY, slice.chunkZ, priority);
+    });
+  }
+
+  void Field3DMapImpl::cancelPrefetch()
+  {
+    myPrefetcher->cancel();
+  }
+
+  void Field3DMapImpl::pin(const Box3D & box, std::vector<std::shared_ptr<Chunk>> & chunks)
+  {
+    forEachRegionSlice(box, myChunkSize.x, myChunkSize.y, myChunkSize.z, [&](const RegionSlice & slice)
+    {
+      std::shared_ptr<Chunk> chunk = getChunk(Vec3Type(slice.chunkX, slice.chunkY, slice.chunkZ));
+      chunk->pins++;
+      chunks.push_back(chunk);
+    });
+    prefetch(box, ChunkPrefetcher::pinPriority);
+  }
+
+  void Field3DMapImpl::unpin(const std::vector<std::shared_ptr<Chunk>> & chunks)
+  {
+    for (const std::shared_ptr<Chunk> & chunk : chunks)
+      chunk->pins--;
+  }
+
+  void Field3DMapImpl::memoryLimit(unsigned long int megabytes)
+  {
+    // blocks paged in from disk are held to the limit by Field3D, written chunks by the pruning pass
+    myMemThresholdMB = megabytes;
+    F3D::SparseFileManager::singleton().setLimitMemUse(megabytes != 0);
+    F3D::SparseFileManager::singleton().setMaxMemUse(megabytes);
+  }
+
+  void Field3DMapImpl::codec(ChunkCodec codec, int level)
+  {
+    // Field3D writes HDF5 files which carry their own compression settings
+    myEngine.lock()->log("Map"), "the Field3D backend ignores the chunk codec setting";
+    myCodec = codec;
+    myCodecLevel = level;
+  }
+
+  const MapCell & Field3DMapImpl::background() const
   {
     return myBank->get(myBackgroundValue);
   }
 
-  std::string MapImpl::getChunkName(const Vec3Type & v) const
+  std::string Field3DMapImpl::getChunkName(const Vec3Type & v) const
   {
     return boost::str(boost::format("%i.%i.%i") % v.x % v.y % v.z);
   }
 
-  std::shared_ptr<MapImpl::Chunk> & MapImpl::getChunk(int x, int y, int z) const
+  Vec3Type Field3DMapImpl::chunkIndex(int x, int y, int z) const
   {
-    Vec3Type vec(x, y, z);
-    vec /= myChunkSize;
+    return Vec3Type(floorDiv(x, myChunkSize.x), floorDiv(y, myChunkSize.y), floorDiv(z, myChunkSize.z));
+  }
 
+  std::shared_ptr<Field3DMapImpl::Chunk> & Field3DMapImpl::getChunk(const Vec3Type & vec) const
+  {
     boost::recursive_mutex::scoped_lock guard(myLock);
 
     if (myChunks.find(vec) != myChunks.end())
@@ -139,41 +364,89 @@ namespace ADWIF
       newChunk.reset(new Chunk);
       newChunk->pos = vec;
       newChunk->fileName = getChunkName(vec);
+      newChunk->fileBacked = false;
       newChunk->dirty = false;
+      newChunk->pins = 0;
       newChunk->lastAccess = myClock.now();
       return myChunks[vec] = newChunk;
     }
   }
 
-  void MapImpl::loadChunk(std::shared_ptr<Chunk> & chunk, boost::upgrade_lock<boost::shared_mutex> & guard) const
+  void Field3DMapImpl::loadChunk(std::shared_ptr<Chunk> & chunk, boost::upgrade_lock<boost::shared_mutex> & guard) const
   {
     boost::upgrade_to_unique_lock<boost::shared_mutex> lock(guard);
     boost::filesystem::path path = myMapPath / chunk->fileName;
-    if (boost::filesystem::exists(path) &&
+    // chunks the manifest does not know were never written, which saves looking for their file
+    if (myManifest->mayExist(chunk->pos.x, chunk->pos.y, chunk->pos.z) &&
+      boost::filesystem::exists(path) &&
       boost::filesystem::file_size(path))
     {
       myEngine.lock()->log("Map"), "loading ", chunk->pos;
+      chunk->dirty = false;
       F3D::Field3DInputFile in;
       in.open(path.native());
-      FieldType::Vec vec = in.readScalarLayersAs<F3D::DenseField, uint64_t>();
+      // only the block layout is read here, blocks are read as they are accessed
+      FieldType::Vec vec = in.readScalarLayersAs<F3D::SparseField, uint64_t>();
       chunk->field = vec.back();
+      chunk->fileBacked = F3D::SparseFileManager::singleton().doLimitMemUse();
+      if (!chunk->field->metadata().intMetadata("cellIds", 0))
+      {
+        // chunks saved before cells had ids hold their hashes, they are translated in memory and saved as ids
+        detachChunk(chunk);
+        translateHashes(*chunk->field, *myBank);
+        chunk->dirty = true;
+      }
       myEngine.lock()->log("Map"), "loaded ", chunk->pos;
     }
     else
     {
-      chunk->field = new FieldType;
-      chunk->field->setSize(myChunkSize);
-      chunk->field->clear(myBackgroundValue);
-      chunk->field->name = chunk->fileName;
-      chunk->field->attribute = "terrain";
+      chunk->field = createField(chunk->fileName);
+      chunk->dirty = false;
+      chunk->fileBacked = false;
       myEngine.lock()->log("Map"), "created ", chunk->pos;
     }
     chunk->lastAccess = myClock.now();
-    chunk->dirty = false;
   }
 
 
-  void MapImpl::saveChunk(std::shared_ptr<Chunk> & chunk) const
+  FieldType::Ptr Field3DMapImpl::createField(const std::string & name) const
+  {
+    FieldType::Ptr field(new FieldType);
+    field->setBlockOrder(myBlockOrder);
+    field->setSize(myChunkSize);
+    field->clear(myBackgroundValue);
+    field->name = name;
+    field->attribute = "terrain";
+    field->metadata().setIntMetadata("cellIds", 1);
+    return field;
+  }
+
+  void Field3DMapImpl::detachChunk(const std::shared_ptr<Chunk> & chunk) const
+  {
+    const FieldType & source = *chunk->field;
+    FieldType::Ptr field = createField(chunk->fileName);
+    const F3D::V3i res = source.blockRes();
+    const int size = source.blockSize();
+    // uniform blocks are carried over as they are, only allocated ones are read in
+    for (int bk = 0; bk < res.z; bk++)
+      for (int bj = 0; bj < res.y; bj++)
+        for (int bi = 0; bi < res.x; bi++)
+        {
+          if (!source.blockIsAllocated(bi, bj, bk))
+          {
+            field->setBlockEmptyValue(bi, bj, bk, source.getBlockEmptyValue(bi, bj, bk));
+            continue;
+          }
+          for (int z = bk * size; z < std::min((bk + 1) * size, myChunkSize.z); z++)
+            for (int y = bj * size; y < std::min((bj + 1) * size, myChunkSize.y); y++)
+              for (int x = bi * size; x < std::min((bi + 1) * size, myChunkSize.x); x++)
+                field->fastLValue(x, y, z) = source.fastValue(x, y, z);
+        }
+    chunk->field = field;
+    chunk->fileBacked = false;
+  }
+
+  void Field3DMapImpl::saveChunk(std::shared_ptr<Chunk> & chunk) const
   {
     boost::upgrade_lock<boost::shared_mutex> guard(chunk->lock);
     boost::upgrade_to_unique_lock<boost::shared_mutex> lock(guard);
@@ -183,31 +456,47 @@ namespace ADWIF
     {
       myEngine.lock()->log("Map"), "saving ", chunk->pos;
       boost::filesystem::path path = myMapPath / chunk->fileName;
+      boost::filesystem::path tempPath = path.native() + ".tmp";
+      compactBlocks(*chunk->field);
+      // a chunk on disk must never refer to cells that are not
+      myBank->prune();
+      std::vector<CellId> ids;
+      collectIds(*chunk->field, ids);
+      myBank->addReferences(chunk->pos.x, chunk->pos.y, chunk->pos.z, ids);
+      myManifest->insert(chunk->pos.x, chunk->pos.y, chunk->pos.z);
       F3D::Field3DOutputFile of;
-      of.create(path.native());
+      of.create(tempPath.native());
       of.writeScalarLayer<uint64_t>(chunk->field);
       of.close();
-    } else
+      // fields paged from the old file may still be reading from it, replacing it leaves them the old contents
+      boost::filesystem::rename(tempPath, path);
+      myBank->setReferences(chunk->pos.x, chunk->pos.y, chunk->pos.z, ids);
+    }
+    if (!chunk->pins)
+    {
       myEngine.lock()->log("Map"), "unloading ", chunk->pos;
-    chunk->field.reset();
+      chunk->field.reset();
+      chunk->fileBacked = false;
+      chunkUnloaded(chunk->pos.x, chunk->pos.y, chunk->pos.z);
+    }
     chunk->dirty = false;
     myEngine.lock()->log("Map"), "saved ", chunk->pos;
   }
 
-  void MapImpl::pruneTask()
+  void Field3DMapImpl::pruneTask()
   {
     while (!myPruneThreadQuitFlag)
     {
       boost::unique_lock<boost::mutex> lock(myPruneThreadMutex);
       myPruneThreadCond.wait_for(lock, myPruningInterval);
       if (!myPruneThreadQuitFlag)
-        prune(false);
+        pruneChunks(false);
       else
         break;
     }
   }
 
-  void MapImpl::prune(bool pruneAll) const
+  void Field3DMapImpl::pruneChunks(bool pruneAll) const
   {
     bool isPruning = false;
 
@@ -242,6 +531,7 @@ namespace ADWIF
 
     std::unordered_map<Vec3Type, std::size_t> memoryMap;
 
+    // blocks of file backed chunks count against the SparseFileManager's limit instead
     if (!pruneAll && myMemThresholdMB)
     {
       std::transform(accessTimesSorted.begin(), accessTimesSorted.end(),
@@ -250,7 +540,8 @@ namespace ADWIF
                        boost::upgrade_lock<boost::shared_mutex> guard(pair.second->lock);
                        boost::upgrade_to_unique_lock<boost::shared_mutex> lock(guard);
                        return std::make_pair(pair.first,
-                                             pair.second->field ? pair.second->field->memSize() : 0);
+                                             pair.second->field && !pair.second->fileBacked ?
+                                               pair.second->field->memSize() : 0);
                      });
 
       memUse = std::accumulate(memoryMap.begin(), memoryMap.end(), memUse,
@@ -259,6 +550,7 @@ namespace ADWIF
                                {
                                  return sum + second.second;
                                });
+      memUse += attachedMemory();
     }
 
     memUse /= (1024 * 1024);
@@ -277,6 +569,12 @@ namespace ADWIF
       {
         boost::upgrade_lock<boost::shared_mutex> guard(i->second->lock);
         boost::upgrade_to_unique_lock<boost::shared_mutex> lock(guard);
+        // pinned chunks are only saved, and stay loaded
+        if (i->second->pins && !(pruneAll && i->second->dirty))
+        {
+          ++i;
+          continue;
+        }
         duration_type dur(myClock.now() - i->second->lastAccess.load());
         if (pruneAll || dur > myDurationThreshold ||
           (memUse > myMemThresholdMB))
@@ -291,12 +589,14 @@ namespace ADWIF
             else if (dur > myDurationThreshold)
               myEngine.lock()->log("Map"), "scheduling save operation for ", i->second->pos, ", last accessed in ", dur;
 
-            myEngine.lock()->service().post(boost::bind(&MapImpl::saveChunk, this, i->second));
+            myEngine.lock()->service().post(boost::bind(&Field3DMapImpl::saveChunk, this, i->second));
           }
           else
           {
             myEngine.lock()->log("Map"), "unloading ", i->second->pos;
             i->second->field.reset();
+            i->second->fileBacked = false;
+            chunkUnloaded(i->second->pos.x, i->second->pos.y, i->second->pos.z);
           }
           posted++;
           if (!pruneAll && myMemThresholdMB)
@@ -312,22 +612,131 @@ namespace ADWIF
     }
     if (freed)
       myEngine.lock()->log("Map"), "scheduled ", freed, "MB to be freed";
-    myBank->prune(pruneAll);
+    myBank->prune();
     myPruningInProgressFlag.store(false);
   }
 
-  Map::Map(const std::shared_ptr<class Engine> & engine, const boost::filesystem::path & mapPath, bool load, unsigned int chunkSizeX,
-           unsigned int chunkSizeY, unsigned int chunkSizeZ, const MapCell & bgValue): myImpl(nullptr)
+  void Field3DMapImpl::enumerateChunks(const std::function<void (int x, int y, int z)> & fn) const
   {
-    myImpl = new MapImpl(this, engine, mapPath, load,
-                        chunkSizeX, chunkSizeY, chunkSizeZ, bgValue);
+    // every chunk has a file of its own named after its position
+    for (boost::filesystem::directory_iterator i(myMapPath), end; i != end; ++i)
+    {
+      std::vector<std::string> parts = split(i->path().filename().string(), '.');
+      if (parts.size() != 3 || !boost::filesystem::is_regular_file(i->status()))
+        continue;
+      try
+      {
+        fn(boost::lexical_cast<int>(parts[0]), boost::lexical_cast<int>(parts[1]), boost::lexical_cast<int>(parts[2]));
+      }
+      catch (boost::bad_lexical_cast &) { }
+    }
   }
 
-  Map::~Map() { delete myImpl; }
+  ChunkCodec Field3DMapImpl::codec() const { return myCodec; }
+  int Field3DMapImpl::codecLevel() const { return myCodecLevel; }
+  unsigned long int Field3DMapImpl::memoryLimit() const { return myMemThresholdMB; }
+
+  // this backend evicts by last access time alone
+  void Field3DMapImpl::focus(int x, int y, int z) { }
+
+  void Field3DMapImpl::prune() const { pruneChunks(false); }
 
-  const MapCell & Map::get(int x, int y, int z) const { return myImpl->get(x,y,z); }
-  void Map::set(int x, int y, int z, const MapCell & cell) { myImpl->set(x, y, z, cell);}
-  const MapCell & Map::background() const { return myImpl->background(); }
-  void Map::save() const { myImpl->prune(true); }
-  void Map::prune() const { myImpl->prune(false); }
+  std::shared_future<void> Field3DMapImpl::save() const
+  {
+    // pruning here waits for its own saves, so run it off the calling thread
+    std::shared_future<void> result = std::async(std::launch::async, [this]() { pruneChunks(true); }).share();
+    boost::lock_guard<boost::mutex> guard(mySavesLock);
+    mySaves.erase(std::remove_if(mySaves.begin(), mySaves.end(), [](const std::shared_future<void> & save)
+    {
+      return save.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }), mySaves.end());
+    mySaves.push_back(result);
+    return result;
+  }
+
+  struct Field3DMapImpl::Cursor : public MapCursor
+  {
+    Cursor(Field3DMapImpl * impl): impl(impl), chunk(), index(), exclusive(false) { }
+
+    const MapCell & get(int x, int y, int z)
+    {
+      seek(x, y, z, false);
+      const Vec3Type & size = impl->myChunkSize;
+      return impl->myBank->get(chunk->field->fastValue(floorMod(x, size.x), floorMod(y, size.y), floorMod(z, size.z)));
+    }
+
+    void set(int x, int y, int z, const MapCell & cell)
+    {
+      CellId id = impl->myBank->put(cell);
+      seek(x, y, z, true);
+      const Vec3Type & size = impl->myChunkSize;
+      chunk->field->fastLValue(floorMod(x, size.x), floorMod(y, size.y), floorMod(z, size.z)) = id;
+      chunk->dirty = true;
+    }
+
+    void seek(int x, int y, int z, bool write)
+    {
+      Vec3Type target = impl->chunkIndex(x, y, z);
+      if (chunk && target == index && (exclusive || !write))
+        return;
+      release();
+      chunk = impl->getChunk(target);
+      // loadChunk() upgrades the lock itself, the lock is then kept past the guard's lifetime
+      boost::upgrade_lock<boost::shared_mutex> guard(chunk->lock);
+      if (!chunk->field)
+        impl->loadChunk(chunk, guard);
+      guard.release();
+      if (write)
+      {
+        chunk->lock.unlock_upgrade_and_lock();
+        if (chunk->fileBacked)
+          impl->detachChunk(chunk);
+      }
+      else
+        chunk->lock.unlock_upgrade_and_lock_shared();
+      index = target;
+      exclusive = write;
+    }
+
+    void release()
+    {
+      if (!chunk)
+        return;
+      if (exclusive)
+        chunk->lock.unlock();
+      else
+        chunk->lock.unlock_shared();
+      chunk.reset();
+    }
+
+    Field3DMapImpl * impl;
+    std::shared_ptr<Chunk> chunk;
+    Vec3Type index;
+    bool exclusive;
+  };
+
+  struct Field3DMapImpl::Pin : public MapPin
+  {
+    Pin(Field3DMapImpl * impl): impl(impl), chunks() { }
+    ~Pin() { impl->unpin(chunks); }
+
+    Field3DMapImpl * impl;
+    std::vector<std::shared_ptr<Chunk>> chunks;
+  };
+
+  MapCursor * Field3DMapImpl::cursor() { return new Cursor(this); }
+
+  MapPin * Field3DMapImpl::pin(const Box3D & box)
+  {
+    std::unique_ptr<Pin> pin(new Pin(this));
+    this->pin(box, pin->chunks);
+    return pin.release();
+  }
+
+  static MapImpl::Registration registration("Field3D", [](Map * parent, const std::shared_ptr<class Engine> & engine,
+    const boost::filesystem::path & mapPath, bool load, const std::shared_ptr<MapManifest> & manifest,
+    const MapCell & bgValue) -> MapImpl *
+  {
+    return new Field3DMapImpl(parent, engine, mapPath, load, manifest, bgValue);
+  });
 }
@@ -23,10 +23,10 @@
 #define MAP_FIELD3D_H
 
 #include "mapcell.hpp"
-#include "map.hpp"
+#include "mapimpl.hpp"
 #include "mapbank.hpp"
+#include "chunkprefetcher.hpp"
 
-#include <Field3D/DenseField.h>
 #include <Field3D/SparseField.h>
 #include <Field3D/SparseFile.h>
 #include <Field3D/Field3DFile.h>
@@ -39,6 +39,8 @@
 #include <boost/functional/hash/hash.hpp>
 
 #include <memory>
+#include <future>
+#include <vector>
 #include <fstream>
 #include <unordered_map>
 
@@ -83,12 +85,11 @@ namespace std
 
 namespace ADWIF
 {
-  typedef F3D::DenseField<uint64_t> FieldType;
+  // fields hold cell ids in the 64 bit layers their files have always had
+  typedef F3D::SparseField<uint64_t> FieldType;
 
-  class MapImpl
+  class Field3DMapImpl : public MapImpl
   {
-    friend class Map;
-
     using clock_type = boost::chrono::steady_clock;
     using time_point = clock_type::time_point;
     using duration_type = clock_type::duration;
@@ -97,30 +98,69 @@ namespace ADWIF
     {
       F3D::V3i pos;
       FieldType::Ptr field;
+      // fields read back from disk page their blocks through the SparseFileManager and cannot be written to
+      bool fileBacked;
       boost::atomic<time_point> lastAccess;
       boost::atomic_bool dirty;
+      // number of PinHandles covering the chunk, pinned chunks are never pruned
+      boost::atomic_uint pins;
       std::string fileName;
       mutable boost::shared_mutex lock;
     };
 
+    struct Cursor;
+    struct Pin;
+
   public:
-    MapImpl(Map * parent, const std::shared_ptr<class Engine> & engine, const boost::filesystem::path & mapPath,
-            bool load, unsigned int chunkSizeX, unsigned int chunkSizeY, unsigned int chunkSizeZ,
-            const MapCell & bgValue = MapCell());
-    ~MapImpl();
+    Field3DMapImpl(Map * parent, const std::shared_ptr<class Engine> & engine, const boost::filesystem::path & mapPath,
+                   bool load, const std::shared_ptr<MapManifest> & manifest, const MapCell & bgValue = MapCell());
+    ~Field3DMapImpl();
 
     const MapCell & get(int x, int y, int z) const;
     void set(int x, int y, int z, const MapCell & cell);
 
+    void getRegion(const Box3D & box, std::vector<const MapCell *> & out) const;
+    void setRegion(const Box3D & box, const std::vector<MapCell> & cells);
+    void fill(const Box3D & box, const MapCell & cell);
+
+    void focus(int x, int y, int z);
+
+    void prefetch(const Box3D & box, int priority);
+    void cancelPrefetch();
+
+    MapCursor * cursor();
+    MapPin * pin(const Box3D & box);
+
+    ChunkCodec codec() const;
+    int codecLevel() const;
+    void codec(ChunkCodec codec, int level);
+
+    unsigned long int memoryLimit() const;
+    void memoryLimit(unsigned long int megabytes);
+
     const MapCell & background() const;
 
-    void prune(bool pruneAll = false) const;
+    void prune() const;
+    std::shared_future<void> save() const;
+
+    void enumerateChunks(const std::function<void (int x, int y, int z)> & fn) const;
 
   private:
+    void pin(const Box3D & box, std::vector<std::shared_ptr<Chunk>> & chunks);
+    void unpin(const std::vector<std::shared_ptr<Chunk>> & chunks);
+
+    void pruneChunks(bool pruneAll) const;
+
+    Vec3Type chunkIndex(int x, int y, int z) const;
+
     std::string getChunkName(const Vec3Type & v) const;
-    std::shared_ptr<Chunk> & getChunk(int x, int y, int z) const;
+    std::shared_ptr<Chunk> & getChunk(const Vec3Type & index) const;
+
+    FieldType::Ptr createField(const std::string & name) const;
 
     void loadChunk(std::shared_ptr<Chunk> & chunk, boost::upgrade_lock<boost::shared_mutex> & guard) const;
+    // Replaces a file backed field with a writable copy, expects the chunk to be locked exclusively
+    void detachChunk(const std::shared_ptr<Chunk> & chunk) const;
     void saveChunk(std::shared_ptr<Chunk> & chunk) const;
 
     void pruneTask();
@@ -131,14 +171,15 @@ namespace ADWIF
     Map * myMap;
     std::weak_ptr<class Engine> myEngine;
     boost::filesystem::path myMapPath;
+    std::shared_ptr<MapManifest> myManifest;
     mutable GridMap myChunks;
-    std::fstream myIndexStream;
     std::shared_ptr<MapBank> myBank;
     F3D::V3i myChunkSize;
-    uint64_t myBackgroundValue;
+    int myBlockOrder;
+    CellId myBackgroundValue;
     mutable boost::recursive_mutex myLock;
     clock_type myClock;
-    unsigned long int myMemThresholdMB;
+    boost::atomic<unsigned long int> myMemThresholdMB;
     duration_type myDurationThreshold;
     duration_type myPruningInterval;
     mutable boost::atomic_bool myPruningInProgressFlag;
@@ -146,6 +187,12 @@ namespace ADWIF
     boost::condition_variable myPruneThreadCond;
     boost::mutex myPruneThreadMutex;
     boost::atomic_bool myPruneThreadQuitFlag;
+    ChunkCodec myCodec;
+    int myCodecLevel;
+    std::unique_ptr<ChunkPrefetcher> myPrefetcher;
+    // saves still running on their own threads, which the destructor waits for
+    mutable std::vector<std::shared_future<void>> mySaves;
+    mutable boost::mutex mySavesLock;
 
     static bool myInitialisedFlag;
   };
@@ -20,14 +20,21 @@
 #include "map.hpp"
 #include "map_openvdb.hpp"
 #include "engine.hpp"
+#include "util.hpp"
+#include "maputils.hpp"
+#include "chunkcodec.hpp"
 
 #include <algorithm>
-#include <numeric>
+#include <future>
+#include <limits>
+#include <fstream>
+#include <sstream>
 
 #include <boost/filesystem.hpp>
 #include <boost/iostreams/device/file.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/filter/bzip2.hpp>
+#include <boost/iostreams/device/array.hpp>
 #include <boost/iostreams/copy.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/thread.hpp>
@@ -39,167 +46,284 @@ namespace iostreams = boost::iostreams;
 
 namespace ADWIF
 {
-  MapImpl::MapImpl(ADWIF::Map * parent, const std::shared_ptr<class Engine> & engine,
-                   const boost::filesystem::path & mapPath,
-                   bool load, unsigned int chunkSizeX, unsigned int chunkSizeY, unsigned int chunkSizeZ,
-                   const ADWIF::MapCell & bgValue):
-    myMap(parent), myEngine(engine), myChunks(), myBank(), myChunkSize(chunkSizeX, chunkSizeY, chunkSizeZ),
+  namespace
+  {
+    // Formats of the chunk header, chunks saved before it existed hold cell hashes too
+    const uint8_t ChunkFormatHashes = 1;
+    const uint8_t ChunkFormatCellIds = 2;
+
+    int leafAligned(int size)
+    {
+      const int leafDim = TreeType::LeafNodeType::DIM;
+      return (size + leafDim - 1) / leafDim * leafDim;
+    }
+
+    // Copies the active values of a chunk file's grid into the map's grid, converting each to a cell id
+    template <class SourceGrid, class Convert>
+    void copyChunk(const SourceGrid & source, const ovdb::Coord & origin, GridType & grid,
+                   GridType::Accessor & accessor, Convert toId)
+    {
+      for (typename SourceGrid::ValueOnCIter i = source.cbeginValueOn(); i; ++i)
+      {
+        if (i.isVoxelValue())
+          accessor.setValue(i.getCoord() + origin, toId(*i));
+        else
+        {
+          ovdb::CoordBBox tile;
+          i.getBoundingBox(tile);
+          grid.fill(ovdb::CoordBBox(tile.min() + origin, tile.max() + origin), toId(*i), true);
+        }
+      }
+    }
+  }
+
+  OpenVDBMapImpl::OpenVDBMapImpl(ADWIF::Map * parent, const std::shared_ptr<class Engine> & engine,
+                                 const boost::filesystem::path & mapPath,
+                                 bool load, const std::shared_ptr<MapManifest> & manifest,
+                                 const ADWIF::MapCell & bgValue):
+    myMap(parent), myManifest(manifest), myEngine(engine), myChunks(),
+    myGrid(GridType::create()), myWriteAccessors(), myReadAccessors(), myTreeLock(),
+    myBank(), myChunkSize(manifest->chunkSizeX(), manifest->chunkSizeY(), manifest->chunkSizeZ()),
+    myChunkStride(leafAligned(myChunkSize.x()), leafAligned(myChunkSize.y()), leafAligned(myChunkSize.z())),
     myAccessTolerance(200000), myBackgroundValue(0), myMapPath(mapPath), myClock(),
     myAccessCounter(0), myMemThresholdMB(2048), myDurationThreshold(boost::chrono::minutes(1)),
-    myPruningInterval(boost::chrono::seconds(10)),myLock(), myPruningInProgressFlag(), myIndexStream()/*, myPruneTimer(myService)*/
+    myPruningInterval(boost::chrono::seconds(10)), myPruningInProgressFlag(),
+    myCodec(defaultChunkCodec()), myCodecLevel(0), myPrefetcher()/*, myPruneTimer(myService)*/
   {
     if (!myInitialisedFlag)
     {
       ovdb::initialize();
       GridType::registerGrid();
+      LegacyGridType::registerGrid();
       myInitialisedFlag = true;
     }
 
-    if (load)
-    {
-      myIndexStream.open((mapPath / "index").native(),
-                         std::ios_base::out | std::ios_base::app);
-      myIndexStream.close();
-    }
-    else
+    if (!load)
     {
       boost::filesystem::remove_all(myMapPath);
       boost::filesystem::create_directory(myMapPath);
-      myIndexStream.open((mapPath / "index").native(),
-                         std::ios_base::out | std::ios_base::trunc);
-      myIndexStream.close();
     }
 
-    myIndexStream.open((mapPath / "index").native(),
-                       std::ios_base::binary |
-                       std::ios_base::in |
-                       std::ios_base::out);
-
-    myBank.reset(new MapBank(myIndexStream));
+    myBank.reset(new MapBank(myMapPath / "index"));
     myBackgroundValue = myBank->put(bgValue);
+    // the background cell's id is only known once the bank is open
+    myGrid = GridType::create(myBackgroundValue);
+    myGrid->setName("map");
 
     myPruningInProgressFlag.store(false);
     myPruneThreadQuitFlag.store(false);
-    myPruneThread = boost::thread(boost::bind(&MapImpl::pruneTask, this));
+    myPruneThread = boost::thread(boost::bind(&OpenVDBMapImpl::pruneTask, this));
+
+    myPrefetcher.reset(new ChunkPrefetcher([this](int x, int y, int z)
+    {
+      acquireChunk(Vec3Type(x, y, z))->lock.unlock_shared();
+    }));
   }
 
-  MapImpl::~MapImpl()
+  OpenVDBMapImpl::~OpenVDBMapImpl()
   {
+    {
+      boost::lock_guard<boost::mutex> guard(mySavesLock);
+      for (const std::shared_future<void> & save : mySaves)
+        save.wait();
+    }
+    myPrefetcher.reset();
     myPruneThreadQuitFlag.store(true);
     myPruneThreadCond.notify_all();
     myPruneThread.join();
   }
 
-  const MapCell & MapImpl::get(int x, int y, int z) const
+  template <class Fn> void OpenVDBMapImpl::writeCells(const ovdb::CoordBBox & bounds, Fn fn) const
   {
-    std::shared_ptr<Chunk> chunk = getChunk(x, y, z);
-    boost::upgrade_lock<boost::shared_mutex> guard(chunk->lock);
-    if(!chunk->accessor)
+    bool grow = false;
     {
-      boost::upgrade_to_unique_lock<boost::shared_mutex> lock(guard);
-      loadChunk(chunk);
+      // the leaves of a chunk are its own, so other chunks can be read and written meanwhile
+      boost::shared_lock<boost::shared_mutex> guard(myTreeLock);
+      GridType::Accessor & accessor = writeAccessor();
+      for (int z = bounds.min().z(); z <= bounds.max().z(); z++)
+        for (int y = bounds.min().y(); y <= bounds.max().y(); y++)
+          for (int x = bounds.min().x(); x <= bounds.max().x(); x++)
+          {
+            const ovdb::Coord xyz(x, y, z);
+            const CellId id = fn(xyz);
+            if (TreeType::LeafNodeType * leaf = accessor.probeLeaf(xyz))
+            {
+              if (id == myBackgroundValue)
+                leaf->setValueOff(xyz, id);
+              else
+                leaf->setValueOn(xyz, id);
+            }
+            else
+            {
+              // the cell lies in a tile, which only needs a leaf if the cell differs from it
+              CellId tile;
+              if (accessor.probeValue(xyz, tile) == (id == myBackgroundValue) || tile != id)
+                grow = true;
+            }
+          }
     }
-//     if (myAccessCounter++ % myAccessTolerance == 0)
-//       prune(false);
-    const MapCell & value = myBank->get(chunk->accessor->getValue(
-      ovdb::Coord(x % myChunkSize.x(), y % myChunkSize.y(), z % myChunkSize.z())));
-    return value;
+    if (!grow)
+      return;
+    // adding leaves changes nodes every other accessor may be passing through
+    boost::unique_lock<boost::shared_mutex> guard(myTreeLock);
+    GridType::Accessor & accessor = writeAccessor();
+    for (int z = bounds.min().z(); z <= bounds.max().z(); z++)
+      for (int y = bounds.min().y(); y <= bounds.max().y(); y++)
+        for (int x = bounds.min().x(); x <= bounds.max().x(); x++)
+        {
+          const ovdb::Coord xyz(x, y, z);
+          const CellId id = fn(xyz);
+          if (id == myBackgroundValue)
+            accessor.setValueOff(xyz, id);
+          else
+            accessor.setValue(xyz, id);
+        }
   }
 
-  void MapImpl::set(int x, int y, int z, const MapCell & cell)
+  const MapCell & OpenVDBMapImpl::get(int x, int y, int z) const
   {
-    if (!myPruneThread.joinable())
-      myPruneThread.start_thread();
-
-    uint64_t hash = myBank->put(cell);
-
-    std::shared_ptr<Chunk> chunk = getChunk(x, y, z);
-    boost::unique_lock<boost::shared_mutex> guard(chunk->lock);
-    if(!chunk->accessor)
+    const Vec3Type index = chunkIndex(x, y, z);
+    std::shared_ptr<Chunk> chunk = acquireChunk(index);
+    CellId id;
     {
-      loadChunk(chunk);
+      boost::shared_lock<boost::shared_mutex> guard(myTreeLock);
+      id = readAccessor().getValue(ovdb::Coord(x, y, z) + gridOffset(index));
     }
-//     boost::upgrade_to_unique_lock<boost::shared_mutex> lock(guard);
-    if (hash == myBackgroundValue)
-      chunk->accessor->setValueOff(
-        ovdb::Coord(x % myChunkSize.x(), y % myChunkSize.y(), z % myChunkSize.z()), hash);
-    else
-      chunk->accessor->setValue(
-        ovdb::Coord(x % myChunkSize.x(), y % myChunkSize.y(), z % myChunkSize.z()), hash);
+    chunk->lock.unlock_shared();
+    return myBank->get(id);
+  }
 
+  void OpenVDBMapImpl::set(int x, int y, int z, const MapCell & cell)
+  {
+    CellId id = myBank->put(cell);
+
+    const Vec3Type index = chunkIndex(x, y, z);
+    std::shared_ptr<Chunk> chunk = acquireChunk(index, true);
+    const ovdb::Coord xyz = ovdb::Coord(x, y, z) + gridOffset(index);
+    writeCells(ovdb::CoordBBox(xyz, xyz), [id](const ovdb::Coord &) { return id; });
     chunk->dirty = true;
+    chunk->lock.unlock();
+  }
 
-//     if (!myChunks.empty() && (myAccessCounter++ % myAccessTolerance == 0))
-//       prune(false);
+  void OpenVDBMapImpl::getRegion(const Box3D & box, std::vector<const MapCell *> & out) const
+  {
+    std::vector<CellId> ids(regionVolume(box));
+
+    forEachRegionSlice(box, myChunkSize.x(), myChunkSize.y(), myChunkSize.z(), [&](const RegionSlice & slice)
+    {
+      const Vec3Type index(slice.chunkX, slice.chunkY, slice.chunkZ);
+      const ovdb::Coord offset = gridOffset(index);
+      std::shared_ptr<Chunk> chunk = acquireChunk(index);
+      {
+        boost::shared_lock<boost::shared_mutex> guard(myTreeLock);
+        GridType::ConstAccessor & accessor = readAccessor();
+        for (int z = slice.minZ; z < slice.maxZ; z++)
+          for (int y = slice.minY; y < slice.maxY; y++)
+          {
+            auto dst = ids.begin() + regionOffset(box, slice.minX, y, z);
+            for (int x = slice.minX; x < slice.maxX; x++)
+              *dst++ = accessor.getValue(ovdb::Coord(x, y, z) + offset);
+          }
+      }
+      chunk->lock.unlock_shared();
+    });
+
+    resolveCells(*myBank, ids, out);
   }
 
-  void MapImpl::pruneTask()
+  void OpenVDBMapImpl::setRegion(const Box3D & box, const std::vector<MapCell> & cells)
+  {
+    if (cells.size() != regionVolume(box))
+      throw std::invalid_argument("cell count does not match region volume");
+
+    std::vector<CellId> ids;
+    internCells(*myBank, cells, ids);
+
+    forEachRegionSlice(box, myChunkSize.x(), myChunkSize.y(), myChunkSize.z(), [&](const RegionSlice & slice)
+    {
+      const Vec3Type index(slice.chunkX, slice.chunkY, slice.chunkZ);
+      const ovdb::Coord offset = gridOffset(index);
+      std::shared_ptr<Chunk> chunk = acquireChunk(index, true);
+      writeCells(ovdb::CoordBBox(ovdb::Coord(slice.minX, slice.minY, slice.minZ) + offset,
+                                 ovdb::Coord(slice.maxX - 1, slice.maxY - 1, slice.maxZ - 1) + offset),
+                 [&](const ovdb::Coord & xyz)
+      {
+        return ids[regionOffset(box, xyz.x() - offset.x(), xyz.y() - offset.y(), xyz.z() - offset.z())];
+      });
+      chunk->dirty = true;
+      chunk->lock.unlock();
+    });
+  }
+
+  void OpenVDBMapImpl::fill(const Box3D & box, const MapCell & cell)
+  {
+    const CellId id = myBank->put(cell);
+
+    forEachRegionSlice(box, myChunkSize.x(), myChunkSize.y(), myChunkSize.z(), [&](const RegionSlice & slice)
+    {
+      const Vec3Type index(slice.chunkX, slice.chunkY, slice.chunkZ);
+      const ovdb::Coord offset = gridOffset(index);
+      std::shared_ptr<Chunk> chunk = acquireChunk(index);
+      {
+        boost::unique_lock<boost::shared_mutex> guard(myTreeLock);
+        // The tree fills whole tiles where it can instead of allocating voxels, which may free nodes other
+        // accessors still have cached
+        myGrid->fill(ovdb::CoordBBox(ovdb::Coord(slice.minX, slice.minY, slice.minZ) + offset,
+                                     ovdb::Coord(slice.maxX - 1, slice.maxY - 1, slice.maxZ - 1) + offset),
+                     id, id != myBackgroundValue);
+        myGrid->tree().clearAllAccessors();
+      }
+      chunk->dirty = true;
+      chunk->lock.unlock_shared();
+    });
+  }
+
+  void OpenVDBMapImpl::pruneTask()
   {
     while (!myPruneThreadQuitFlag)
     {
       boost::unique_lock<boost::mutex> lock(myPruneThreadMutex);
       myPruneThreadCond.wait_for(lock, myPruningInterval);
       if (!myPruneThreadQuitFlag)
-        prune(false);
+        pruneChunks(false);
       else
         break;
     }
   }
 
-  void MapImpl::prune(bool pruneAll) const
+  void OpenVDBMapImpl::pruneChunks(bool pruneAll) const
   {
     bool isPruning = false;
 
     while (!myPruningInProgressFlag.compare_exchange_weak(isPruning, true))
-      boost::this_thread::sleep_for(boost::chrono::microseconds(50));
-
-    std::vector<std::pair<Vec3Type, std::shared_ptr<Chunk>>> accessTimesSorted;
     {
-      boost::recursive_mutex::scoped_lock guard(myLock);
-      accessTimesSorted.assign(myChunks.begin(), myChunks.end());
+      isPruning = false;
+      boost::this_thread::sleep_for(boost::chrono::microseconds(50));
     }
 
-    accessTimesSorted.erase(std::remove_if(accessTimesSorted.begin(), accessTimesSorted.end(),
-                            [&](const std::pair<Vec3Type, std::shared_ptr<Chunk>> pair)
-                            {
-                              //if (!pair.second || !pair.second->grid)
-                              //  myEngine.lock()->log(), "discarding (empty): ", pair.second->pos;
-                              return !pair.second || !pair.second->grid;
-                            }), accessTimesSorted.end());
+    std::vector<std::shared_ptr<Chunk>> accessTimesSorted;
+    // chunks added meanwhile are either visited or not, and loaded too recently to be pruned anyway
+    for (auto & entry : myChunks)
+      if (entry.second->loaded)
+        accessTimesSorted.push_back(entry.second);
 
+    std::sort(accessTimesSorted.begin(), accessTimesSorted.end(),
+              [](const std::shared_ptr<Chunk> & first, const std::shared_ptr<Chunk> & second)
     {
-      boost::recursive_mutex::scoped_lock guard(myLock);
-      std::sort(accessTimesSorted.begin(), accessTimesSorted.end(),
-                [](const std::pair<Vec3Type, std::shared_ptr<Chunk>> & first,
-                  const std::pair<Vec3Type, std::shared_ptr<Chunk>> & second)
-      {
-        return first.second->lastAccess.load() < second.second->lastAccess.load();
-      });
-    }
+      return first->lastAccess.load() < second->lastAccess.load();
+    });
 
     std::size_t memUse = 0;
-
-    std::map<Vec3Type, std::size_t> memoryMap;
-
-    if (!pruneAll && myMemThresholdMB)
     {
-      std::transform(accessTimesSorted.begin(), accessTimesSorted.end(),
-                     std::inserter(memoryMap, memoryMap.begin()),
-                     [](const std::pair<Vec3Type, std::shared_ptr<Chunk>> pair) {
-                       boost::unique_lock<boost::shared_mutex> guard(pair.second->lock);
-                        return std::make_pair(pair.first,
-                                              pair.second->grid ? pair.second->grid->memUsage() : 0);
-                     });
-
-      memUse = std::accumulate(memoryMap.begin(), memoryMap.end(), memUse,
-                               [](unsigned long int sum,
-                                  const std::pair<Vec3Type, std::size_t> second)
-                              {
-                                 return sum + second.second;
-                              });
+      // nodes left behind by chunks unloaded since the last round only hold background values
+      boost::unique_lock<boost::shared_mutex> guard(myTreeLock);
+      myGrid->tree().pruneInactive();
+      myGrid->tree().clearAllAccessors();
+      memUse = (myGrid->memUsage() + attachedMemory()) / (1024 * 1024);
     }
 
-    memUse /= (1024 * 1024);
+    // the grid is shared, so every chunk is assumed to take an equal part of it
+    const std::size_t chunkMem = accessTimesSorted.empty() ? 0 : memUse / accessTimesSorted.size();
 
     if (memUse > myMemThresholdMB)
       myEngine.lock()->log("Map"), memUse, "MB of memory in use, will attempt to free ", memUse - myMemThresholdMB, "MB";
@@ -207,154 +331,412 @@ namespace ADWIF
       myEngine.lock()->log("Map"), memUse, "MB of memory in use";
 
     unsigned long int freed = 0;
-    unsigned int posted = 0;
 
+    for (const std::shared_ptr<Chunk> & chunk : accessTimesSorted)
     {
-      auto i = accessTimesSorted.begin();
-      while (i != accessTimesSorted.end())
+      // pinned chunks are only saved, and stay loaded
+      if (chunk->pins && !(pruneAll && chunk->dirty))
+        continue;
+      duration_type dur(myClock.now() - chunk->lastAccess.load());
+      if (!pruneAll && dur <= myDurationThreshold &&
+          (!myMemThresholdMB || memUse <= myMemThresholdMB || memUse - freed < myMemThresholdMB * 0.70))
+        continue;
+      if (pruneAll)
+        saveChunk(chunk);
+      else
       {
-        boost::unique_lock<boost::shared_mutex> guard(i->second->lock);
-        duration_type dur(myClock.now() - i->second->lastAccess.load());
-        if (pruneAll || dur > myDurationThreshold ||
-            (memUse > myMemThresholdMB))
-        {
-          if (i->second->dirty)
-          {
-            if (pruneAll)
-              myEngine.lock()->log("Map"), "scheduling save operation for ", i->second->pos;
-            else if (memUse > myMemThresholdMB)
-              myEngine.lock()->log("Map"), "scheduling save operation for ", i->second->pos, " to free",
-                memoryMap.find(i->first)->second / (1024 * 1024), "MB of memory";
-            else if (dur > myDurationThreshold)
-              myEngine.lock()->log("Map"), "scheduling save operation for ", i->second->pos, ", last accessed in ", dur;
-
-            myEngine.lock()->service().post(boost::bind(&MapImpl::saveChunk, this, i->second));
-          }
-          else
-          {
-            myEngine.lock()->log("Map"), "unloading ", i->second->pos;
-            i->second->grid.reset();
-            i->second->accessor.reset();
-          }
-          posted++;
-          if (!pruneAll && myMemThresholdMB)
-          {
-            freed += memoryMap.find(i->first)->second / (1024 * 1024);
-            if (memUse - freed < myMemThresholdMB * 0.70)
-              break;
-          }
-          i = accessTimesSorted.erase(i);
-        }
-        else ++i;
+        myEngine.lock()->log("Map"), "scheduling save operation for ", chunk->pos;
+        myEngine.lock()->service().post(boost::bind(&OpenVDBMapImpl::saveChunk, this, chunk));
+        freed += chunkMem;
       }
     }
+
     if (freed)
       myEngine.lock()->log("Map"), "scheduled ", freed, "MB to be freed";
-    myBank->prune(pruneAll);
+    myBank->prune();
     myPruningInProgressFlag.store(false);
   }
 
-  std::string MapImpl::getChunkName(const Vec3Type & v) const
+  std::string OpenVDBMapImpl::getChunkName(const Vec3Type & v) const
   {
     return boost::str(boost::format("%i.%i.%i") % v.x() % v.y() % v.z());
   }
 
-  std::shared_ptr<MapImpl::Chunk> & MapImpl::getChunk(int x, int y, int z) const
+  Vec3Type OpenVDBMapImpl::chunkIndex(int x, int y, int z) const
+  {
+    return Vec3Type(floorDiv(x, myChunkSize.x()), floorDiv(y, myChunkSize.y()), floorDiv(z, myChunkSize.z()));
+  }
+
+  ovdb::CoordBBox OpenVDBMapImpl::chunkBounds(const Vec3Type & index) const
   {
-    Vec3Type vec(x, y, z);
-    vec /= myChunkSize;
+    const ovdb::Coord origin(index.x() * myChunkStride.x(), index.y() * myChunkStride.y(),
+                             index.z() * myChunkStride.z());
+    return ovdb::CoordBBox(origin, origin + ovdb::Coord(myChunkSize.x() - 1, myChunkSize.y() - 1, myChunkSize.z() - 1));
+  }
 
-    boost::recursive_mutex::scoped_lock guard(myLock);
+  ovdb::Coord OpenVDBMapImpl::gridOffset(const Vec3Type & index) const
+  {
+    return ovdb::Coord(index.x() * (myChunkStride.x() - myChunkSize.x()),
+                       index.y() * (myChunkStride.y() - myChunkSize.y()),
+                       index.z() * (myChunkStride.z() - myChunkSize.z()));
+  }
 
-    if (myChunks.find(vec) != myChunks.end())
+  std::shared_ptr<OpenVDBMapImpl::Chunk> OpenVDBMapImpl::getChunk(const Vec3Type & vec) const
+  {
+    GridMap::iterator i = myChunks.find(vec);
+    if (i == myChunks.end())
     {
-      myChunks[vec]->lastAccess = myClock.now();
-      return myChunks[vec];
+      std::shared_ptr<Chunk> chunk(new Chunk);
+      chunk->pos = vec;
+      chunk->fileName = getChunkName(vec);
+      chunk->loaded = false;
+      chunk->dirty = false;
+      chunk->pins = 0;
+      // should another thread have added the chunk first, its entry is kept and this one dropped
+      i = myChunks.insert(std::make_pair(vec, chunk)).first;
     }
-    else
+    i->second->lastAccess = myClock.now();
+    return i->second;
+  }
+
+  std::shared_ptr<OpenVDBMapImpl::Chunk> OpenVDBMapImpl::acquireChunk(const Vec3Type & index, bool exclusive) const
+  {
+    std::shared_ptr<Chunk> chunk = getChunk(index);
+    if (exclusive)
+    {
+      chunk->lock.lock();
+      if (!chunk->loaded)
+        loadChunk(chunk);
+      return chunk;
+    }
+    chunk->lock.lock_shared();
+    if (!chunk->loaded)
     {
-      std::shared_ptr<Chunk> newChunk;
-      newChunk.reset(new Chunk);
-      newChunk->pos = vec;
-      newChunk->fileName = getChunkName(vec);
-      newChunk->dirty = false;
-      newChunk->lastAccess = myClock.now();
-      return myChunks[vec] = newChunk;
+      chunk->lock.unlock_shared();
+      chunk->lock.lock();
+      if (!chunk->loaded)
+        loadChunk(chunk);
+      chunk->lock.unlock_and_lock_shared();
     }
+    return chunk;
   }
 
-  void MapImpl::loadChunk(std::shared_ptr<Chunk> & chunk) const
+  GridType::ConstAccessor & OpenVDBMapImpl::readAccessor() const
+  {
+    // accessors register with the tree, which releases them should it go away before their thread does
+    GridType::ConstAccessor * accessor = myReadAccessors.get();
+    if (!accessor)
+    {
+      accessor = new GridType::ConstAccessor(myGrid->getConstAccessor());
+      myReadAccessors.reset(accessor);
+    }
+    return *accessor;
+  }
+
+  GridType::Accessor & OpenVDBMapImpl::writeAccessor() const
+  {
+    GridType::Accessor * accessor = myWriteAccessors.get();
+    if (!accessor)
+    {
+      accessor = new GridType::Accessor(myGrid->getAccessor());
+      myWriteAccessors.reset(accessor);
+    }
+    return *accessor;
+  }
+
+  void OpenVDBMapImpl::loadChunk(const std::shared_ptr<Chunk> & chunk) const
   {
     boost::filesystem::path path = myMapPath / chunk->fileName;
-    if (boost::filesystem::exists(path) &&
+    // chunks the manifest does not know were never written, which saves looking for their file
+    if (myManifest->mayExist(chunk->pos.x(), chunk->pos.y(), chunk->pos.z()) &&
+        boost::filesystem::exists(path) &&
         boost::filesystem::file_size(path))
     {
       myEngine.lock()->log("Map"), "loading ", chunk->pos;
-      iostreams::file_source fs(path.native());
-      iostreams::filtering_istream is;
-      is.push(iostreams::bzip2_decompressor());
-      is.push(fs);
-      ovdb::io::Stream ss(is);
-      ss.setCompressionEnabled(false);
-      ovdb::GridPtrVecPtr vc = ss.getGrids();
-      chunk->grid = ovdb::gridPtrCast<GridType>(vc->operator[](0));
+      std::ifstream fs(path.native(), std::ios_base::binary);
+      std::vector<char> payload;
+      uint8_t format = ChunkFormatHashes;
+      ovdb::GridPtrVecPtr vc;
+      // leaves store their values in full along with their masks, the grid's metadata is small and fixed
+      const uint64_t cells = uint64_t(myChunkSize.x()) * myChunkSize.y() * myChunkSize.z();
+      if (readChunkData(fs, payload, format, cells * 4 * sizeof(uint64_t) + 65536))
+      {
+        iostreams::filtering_istream is;
+        is.push(iostreams::array_source(payload.data(), payload.size()));
+        ovdb::io::Stream ss(is);
+        vc = ss.getGrids();
+      }
+      else
+      {
+        // chunks saved before the chunk header existed are bzip2 compressed streams
+        iostreams::filtering_istream is;
+        is.push(iostreams::bzip2_decompressor());
+        is.push(fs);
+        ovdb::io::Stream ss(is);
+        ss.setCompressionEnabled(false);
+        vc = ss.getGrids();
+      }
+      // chunk files hold the chunk in its own coordinates
+      const ovdb::Coord origin = chunkBounds(chunk->pos).min();
+      boost::unique_lock<boost::shared_mutex> guard(myTreeLock);
+      if (format == ChunkFormatCellIds)
+        copyChunk(*ovdb::gridConstPtrCast<GridType>(vc->operator[](0)), origin, *myGrid, writeAccessor(),
+                  [](CellId id) { return id; });
+      else
+        copyChunk(*ovdb::gridConstPtrCast<LegacyGridType>(vc->operator[](0)), origin, *myGrid, writeAccessor(),
+                  [this](uint64_t hash) { return myBank->find(hash); });
+      myGrid->tree().clearAllAccessors();
       myEngine.lock()->log("Map"), "loaded ", chunk->pos;
     }
     else
-    {
-      GridType::Ptr grid = GridType::create(myBackgroundValue);
-      grid->setName(chunk->fileName);
-      chunk->grid = grid;
       myEngine.lock()->log("Map"), "created ", chunk->pos;
-    }
-    chunk->accessor.reset(new GridType::Accessor(chunk->grid->getAccessor()));
     chunk->lastAccess = myClock.now();
     chunk->dirty = false;
+    chunk->loaded = true;
   }
 
-  void MapImpl::saveChunk(std::shared_ptr<Chunk> & chunk) const
+  void OpenVDBMapImpl::unloadChunk(const std::shared_ptr<Chunk> & chunk) const
+  {
+    myEngine.lock()->log("Map"), "unloading ", chunk->pos;
+    {
+      // what is left of partially covered nodes is pruned with the next round
+      boost::unique_lock<boost::shared_mutex> guard(myTreeLock);
+      myGrid->fill(chunkBounds(chunk->pos), myBackgroundValue, false);
+      myGrid->tree().clearAllAccessors();
+    }
+    chunk->loaded = false;
+    chunkUnloaded(chunk->pos.x(), chunk->pos.y(), chunk->pos.z());
+  }
+
+  void OpenVDBMapImpl::saveChunk(std::shared_ptr<Chunk> chunk) const
   {
     boost::unique_lock<boost::shared_mutex> guard(chunk->lock);
-    if (!chunk->grid)
+    if (!chunk->loaded)
       return;
     if (chunk->dirty)
     {
       myEngine.lock()->log("Map"), "saving ", chunk->pos;
-      boost::filesystem::path path = myMapPath / chunk->fileName;
-      iostreams::file_sink fs(path.native());
-      iostreams::filtering_ostream os;
-      os.push(iostreams::bzip2_compressor());
-      os.push(fs);
-      ovdb::io::Stream ss;
-      ss.setCompressionEnabled(false);
-      ovdb::GridPtrVec vc = { chunk->grid };
-      ovdb::io::Stream(os).write(vc);
-    } else
-      myEngine.lock()->log("Map"), "unloading ", chunk->pos;
-    chunk->accessor.reset();
-    chunk->grid.reset();
-    chunk->dirty = false;
-    myEngine.lock()->log("Map"), "saved ", chunk->pos;
+      const ovdb::CoordBBox bounds = chunkBounds(chunk->pos);
+      const ovdb::Coord origin = bounds.min();
+      GridType::Ptr grid = GridType::create(myBackgroundValue);
+      grid->setName(chunk->fileName);
+      {
+        // the chunk is cut out of the grid one leaf sized block at a time
+        GridType::Accessor out = grid->getAccessor();
+        const int leafDim = TreeType::LeafNodeType::DIM;
+        boost::shared_lock<boost::shared_mutex> treeGuard(myTreeLock);
+        const TreeType & tree = myGrid->tree();
+        for (int z = floorDiv(bounds.min().z(), leafDim) * leafDim; z <= bounds.max().z(); z += leafDim)
+          for (int y = floorDiv(bounds.min().y(), leafDim) * leafDim; y <= bounds.max().y(); y += leafDim)
+            for (int x = floorDiv(bounds.min().x(), leafDim) * leafDim; x <= bounds.max().x(); x += leafDim)
+            {
+              const ovdb::Coord block(x, y, z);
+              if (const TreeType::LeafNodeType * leaf = tree.probeConstLeaf(block))
+              {
+                for (TreeType::LeafNodeType::ValueOnCIter i = leaf->cbeginValueOn(); i; ++i)
+                  if (bounds.isInside(i.getCoord()))
+                    out.setValue(i.getCoord() - origin, *i);
+              }
+              else if (tree.isValueOn(block))
+              {
+                // a tile covers the whole block
+                const ovdb::CoordBBox part(ovdb::Coord::maxComponent(block, bounds.min()),
+                                           ovdb::Coord::minComponent(block + ovdb::Coord(leafDim - 1), bounds.max()));
+                grid->fill(ovdb::CoordBBox(part.min() - origin, part.max() - origin), tree.getValue(block), true);
+                out.clear();
+              }
+            }
+      }
+
+      std::ostringstream buffer;
+      {
+        ovdb::io::Stream ss(buffer);
+        ss.setCompressionEnabled(false);
+        ovdb::GridPtrVec vc = { grid };
+        ss.write(vc);
+      }
+      const std::string payload = buffer.str();
+      // a chunk on disk must never refer to cells that are not
+      myBank->prune();
+      // inactive cells take the map's background when loaded, so only the active ones keep cells alive
+      std::vector<CellId> ids;
+      for (GridType::ValueOnCIter i = grid->cbeginValueOn(); i; ++i)
+        if (ids.empty() || ids.back() != *i)
+          ids.push_back(*i);
+      myBank->addReferences(chunk->pos.x(), chunk->pos.y(), chunk->pos.z(), ids);
+      myManifest->insert(chunk->pos.x(), chunk->pos.y(), chunk->pos.z());
+      {
+        std::ofstream fs((myMapPath / chunk->fileName).native(), std::ios_base::binary | std::ios_base::trunc);
+        writeChunkData(fs, payload.data(), payload.size(), ChunkFormatCellIds, myCodec, myCodecLevel);
+      }
+      myBank->setReferences(chunk->pos.x(), chunk->pos.y(), chunk->pos.z(), ids);
+      chunk->dirty = false;
+      myEngine.lock()->log("Map"), "saved ", chunk->pos;
+    }
+    if (!chunk->pins)
+      unloadChunk(chunk);
+  }
+
+  void OpenVDBMapImpl::prefetch(const Box3D & box, int priority)
+  {
+    forEachRegionSlice(box, myChunkSize.x(), myChunkSize.y(), myChunkSize.z(), [&](const RegionSlice & slice)
+    {
+      myPrefetcher->push(slice.chunkX, slice.chunkY, slice.chunkZ, priority);
+    });
+  }
+
+  void OpenVDBMapImpl::cancelPrefetch()
+  {
+    myPrefetcher->cancel();
+  }
+
+  void OpenVDBMapImpl::pin(const Box3D & box, std::vector<std::shared_ptr<Chunk>> & chunks)
+  {
+    forEachRegionSlice(box, myChunkSize.x(), myChunkSize.y(), myChunkSize.z(), [&](const RegionSlice & slice)
+    {
+      std::shared_ptr<Chunk> chunk = getChunk(Vec3Type(slice.chunkX, slice.chunkY, slice.chunkZ));
+      chunk->pins++;
+      chunks.push_back(chunk);
+    });
+    prefetch(box, ChunkPrefetcher::pinPriority);
+  }
+
+  void OpenVDBMapImpl::unpin(const std::vector<std::shared_ptr<Chunk>> & chunks)
+  {
+    for (const std::shared_ptr<Chunk> & chunk : chunks)
+      chunk->pins--;
+  }
+
+  void OpenVDBMapImpl::codec(ChunkCodec codec, int level)
+  {
+    if (!chunkCodecAvailable(codec))
+      throw std::runtime_error("chunk codec '" + chunkCodecStr(codec) + "' is not available in this build");
+    myCodec = codec;
+    myCodecLevel = level;
   }
 
-  const MapCell & MapImpl::background() const { return myBank->get(myBackgroundValue); }
+  const MapCell & OpenVDBMapImpl::background() const { return myBank->get(myBackgroundValue); }
+
+  std::shared_ptr<MapBank> OpenVDBMapImpl::bank() const { return myBank; }
 
-  std::shared_ptr<MapBank> MapImpl::bank() const { return myBank; }
 
-  Map::Map(const std::shared_ptr<class Engine> & engine, const boost::filesystem::path & mapPath, bool load, unsigned int chunkSizeX,
-           unsigned int chunkSizeY, unsigned int chunkSizeZ, const MapCell & bgValue): myImpl(nullptr)
+  void OpenVDBMapImpl::enumerateChunks(const std::function<void (int x, int y, int z)> & fn) const
   {
-    myImpl = new MapImpl(this, engine, mapPath, load,
-                         chunkSizeX, chunkSizeY, chunkSizeZ, bgValue);
+    // every chunk has a file of its own named after its position
+    for (boost::filesystem::directory_iterator i(myMapPath), end; i != end; ++i)
+    {
+      std::vector<std::string> parts = split(i->path().filename().string(), '.');
+      if (parts.size() != 3 || !boost::filesystem::is_regular_file(i->status()))
+        continue;
+      try
+      {
+        fn(boost::lexical_cast<int>(parts[0]), boost::lexical_cast<int>(parts[1]), boost::lexical_cast<int>(parts[2]));
+      }
+      catch (boost::bad_lexical_cast &) { }
+    }
   }
 
-  Map::~Map() { delete myImpl; }
+  ChunkCodec OpenVDBMapImpl::codec() const { return myCodec; }
+  int OpenVDBMapImpl::codecLevel() const { return myCodecLevel; }
+  unsigned long int OpenVDBMapImpl::memoryLimit() const { return myMemThresholdMB; }
+  void OpenVDBMapImpl::memoryLimit(unsigned long int megabytes) { myMemThresholdMB = megabytes; }
+
+  // this backend evicts by last access time alone
+  void OpenVDBMapImpl::focus(int x, int y, int z) { }
+
+  void OpenVDBMapImpl::prune() const { pruneChunks(false); }
 
-  const MapCell & Map::get(int x, int y, int z) const { return myImpl->get(x,y,z); }
-  void Map::set(int x, int y, int z, const MapCell & cell) { myImpl->set(x, y, z, cell);}
-  const MapCell & Map::background() const { return myImpl->background(); }
-  void Map::prune() const { myImpl->prune(false); }
-  void Map::save() const { myImpl->prune(true); }
+  std::shared_future<void> OpenVDBMapImpl::save() const
+  {
+    // pruning here waits for its own saves, so run it off the calling thread
+    std::shared_future<void> result = std::async(std::launch::async, [this]() { pruneChunks(true); }).share();
+    boost::lock_guard<boost::mutex> guard(mySavesLock);
+    mySaves.erase(std::remove_if(mySaves.begin(), mySaves.end(), [](const std::shared_future<void> & save)
+    {
+      return save.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }), mySaves.end());
+    mySaves.push_back(result);
+    return result;
+  }
 
-  bool MapImpl::myInitialisedFlag = false;
+  struct OpenVDBMapImpl::Cursor : public MapCursor
+  {
+    Cursor(OpenVDBMapImpl * impl): impl(impl), chunk(), index(), offset(), exclusive(false) { }
+
+    const MapCell & get(int x, int y, int z)
+    {
+      seek(x, y, z, false);
+      CellId id;
+      {
+        boost::shared_lock<boost::shared_mutex> guard(impl->myTreeLock);
+        id = impl->readAccessor().getValue(ovdb::Coord(x, y, z) + offset);
+      }
+      return impl->myBank->get(id);
+    }
+
+    void set(int x, int y, int z, const MapCell & cell)
+    {
+      CellId id = impl->myBank->put(cell);
+      seek(x, y, z, true);
+      const ovdb::Coord xyz = ovdb::Coord(x, y, z) + offset;
+      impl->writeCells(ovdb::CoordBBox(xyz, xyz), [id](const ovdb::Coord &) { return id; });
+      chunk->dirty = true;
+    }
+
+    void seek(int x, int y, int z, bool write)
+    {
+      Vec3Type target = impl->chunkIndex(x, y, z);
+      if (chunk && target == index && (exclusive || !write))
+        return;
+      release();
+      chunk = impl->acquireChunk(target, write);
+      index = target;
+      offset = impl->gridOffset(target);
+      exclusive = write;
+    }
+
+    void release()
+    {
+      if (!chunk)
+        return;
+      if (exclusive)
+        chunk->lock.unlock();
+      else
+        chunk->lock.unlock_shared();
+      chunk.reset();
+    }
+
+    OpenVDBMapImpl * impl;
+    std::shared_ptr<Chunk> chunk;
+    Vec3Type index;
+    ovdb::Coord offset;
+    bool exclusive;
+  };
+
+  struct OpenVDBMapImpl::Pin : public MapPin
+  {
+    Pin(OpenVDBMapImpl * impl): impl(impl), chunks() { }
+    ~Pin() { impl->unpin(chunks); }
+
+    OpenVDBMapImpl * impl;
+    std::vector<std::shared_ptr<Chunk>> chunks;
+  };
+
+  MapCursor * OpenVDBMapImpl::cursor() { return new Cursor(this); }
+
+  MapPin * OpenVDBMapImpl::pin(const Box3D & box)
+  {
+    std::unique_ptr<Pin> pin(new Pin(this));
+    this->pin(box, pin->chunks);
+    return pin.release();
+  }
+
+  bool OpenVDBMapImpl::myInitialisedFlag = false;
+
+  static MapImpl::Registration registration("OpenVDB", [](Map * parent, const std::shared_ptr<class Engine> & engine,
+    const boost::filesystem::path & mapPath, bool load, const std::shared_ptr<MapManifest> & manifest,
+    const MapCell & bgValue) -> MapImpl *
+  {
+    return new OpenVDBMapImpl(parent, engine, mapPath, load, manifest, bgValue);
+  });
 }
@@ -20,20 +20,26 @@
 #ifndef MAP_OPENVDB_H
 #define MAP_OPENVDB_H
 
-#include "map.hpp"
+#include "mapimpl.hpp"
 #include "mapbank.hpp"
+#include "chunkprefetcher.hpp"
 
 #include <vector>
 #include <unordered_map>
 #include <algorithm>
+#include <memory>
+#include <future>
 
 #include <openvdb/openvdb.h>
 
+#include <tbb/concurrent_unordered_map.h>
+
 #include <boost/chrono.hpp>
 #include <boost/functional/hash/extensions.hpp>
 #include <boost/functional/hash/hash.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/condition_variable.hpp>
+#include <boost/thread/tss.hpp>
 
 namespace ovdb = openvdb::v2_1;
 
@@ -56,76 +62,140 @@ namespace std
 
 namespace ADWIF
 {
-  typedef ovdb::tree::Tree4<uint64_t, 5, 4, 3>::Type TreeType;
+  typedef ovdb::tree::Tree4<uint32_t, 5, 4, 3>::Type TreeType;
   typedef ovdb::Grid<TreeType> GridType;
+  // chunk files written before cells had ids hold cell hashes
+  typedef ovdb::tree::Tree4<uint64_t, 5, 4, 3>::Type LegacyTreeType;
+  typedef ovdb::Grid<LegacyTreeType> LegacyGridType;
 
-  class MapImpl
+  class OpenVDBMapImpl : public MapImpl
   {
-    friend class Map;
-
     using clock_type = boost::chrono::steady_clock;
     using time_point = clock_type::time_point;
     using duration_type = clock_type::duration;
 
+    // Chunks are only the unit of paging, their cells live in the map's single grid while they are loaded. Each one
+    // starts a whole number of leaves after the last, so no two chunks share a leaf.
     struct Chunk
     {
       Vec3Type pos;
-      GridType::Ptr grid;
-      std::shared_ptr<GridType::Accessor> accessor;
+      boost::atomic_bool loaded;
       boost::atomic<time_point> lastAccess;
       boost::atomic_bool dirty;
+      // number of PinHandles covering the chunk, pinned chunks are never pruned
+      boost::atomic_uint pins;
       std::string fileName;
+      // held shared while the chunk's cells are read and exclusively while they are written, loaded, saved or unloaded
       mutable boost::shared_mutex lock;
     };
 
+    struct Cursor;
+    struct Pin;
+
   public:
-    MapImpl(Map * parent, const std::shared_ptr<class Engine> & engine, const boost::filesystem::path & mapPath,
-            bool load, unsigned int chunkSizeX, unsigned int chunkSizeY, unsigned int chunkSizeZ,
-            const MapCell & bgValue = MapCell());
-    ~MapImpl();
+    OpenVDBMapImpl(Map * parent, const std::shared_ptr<class Engine> & engine, const boost::filesystem::path & mapPath,
+                   bool load, const std::shared_ptr<MapManifest> & manifest, const MapCell & bgValue = MapCell());
+    ~OpenVDBMapImpl();
 
     const MapCell & get(int x, int y, int z) const;
     void set(int x, int y, int z, const MapCell & cell);
 
+    void getRegion(const Box3D & box, std::vector<const MapCell *> & out) const;
+    void setRegion(const Box3D & box, const std::vector<MapCell> & cells);
+    void fill(const Box3D & box, const MapCell & cell);
+
+    void focus(int x, int y, int z);
+
+    void prefetch(const Box3D & box, int priority);
+    void cancelPrefetch();
+
+    MapCursor * cursor();
+    MapPin * pin(const Box3D & box);
+
+    ChunkCodec codec() const;
+    int codecLevel() const;
+    void codec(ChunkCodec codec, int level);
+
+    unsigned long int memoryLimit() const;
+    void memoryLimit(unsigned long int megabytes);
+
     const MapCell & background() const;
     std::shared_ptr<MapBank> bank() const;
 
-    void prune(bool pruneAll = false) const;
+    void prune() const;
+    std::shared_future<void> save() const;
+
+    void enumerateChunks(const std::function<void (int x, int y, int z)> & fn) const;
 
   private:
-    std::string getChunkName(const Vec3Type & v) const;
-    std::shared_ptr<Chunk> & getChunk(int x, int y, int z) const;
+    void pin(const Box3D & box, std::vector<std::shared_ptr<Chunk>> & chunks);
+    void unpin(const std::vector<std::shared_ptr<Chunk>> & chunks);
 
-    void loadChunk(std::shared_ptr<Chunk> & chunk) const;
-    void saveChunk(std::shared_ptr<Chunk> & chunk) const;
+    void pruneChunks(bool pruneAll) const;
+
+    Vec3Type chunkIndex(int x, int y, int z) const;
+    // The chunk's cells in grid coordinates, and what takes a map position there
+    ovdb::CoordBBox chunkBounds(const Vec3Type & index) const;
+    ovdb::Coord gridOffset(const Vec3Type & index) const;
+
+    std::string getChunkName(const Vec3Type & v) const;
+    std::shared_ptr<Chunk> getChunk(const Vec3Type & index) const;
+    // Returns the chunk loaded and locked, exclusively for writers
+    std::shared_ptr<Chunk> acquireChunk(const Vec3Type & index, bool exclusive = false) const;
+    // The calling thread's accessors, only to be used with myTreeLock held
+    GridType::ConstAccessor & readAccessor() const;
+    GridType::Accessor & writeAccessor() const;
+    // Sets every cell in bounds, given in grid coordinates, to the id fn returns for it. Expects the chunk holding
+    // them to be locked exclusively.
+    template <class Fn> void writeCells(const ovdb::CoordBBox & bounds, Fn fn) const;
+
+    // Both expect the chunk to be locked exclusively
+    void loadChunk(const std::shared_ptr<Chunk> & chunk) const;
+    void unloadChunk(const std::shared_ptr<Chunk> & chunk) const;
+    void saveChunk(std::shared_ptr<Chunk> chunk) const;
 
     void pruneTask();
 
   private:
 
 
-    typedef std::unordered_map<Vec3Type, std::shared_ptr<Chunk>> GridMap;
+    // looked up on every access, so without a lock
+    typedef tbb::concurrent_unordered_map<Vec3Type, std::shared_ptr<Chunk>, std::hash<Vec3Type>> GridMap;
 
     class Map * const myMap;
+    std::shared_ptr<MapManifest> myManifest;
     mutable GridMap myChunks;
+    // Every loaded chunk, each thread goes through accessors of its own. Readers hold myTreeLock shared. Writers
+    // hold their chunk exclusively and myTreeLock shared while they only change the chunk's existing leaves, which
+    // lets chunks be written in parallel, and take myTreeLock exclusively to add leaves or tiles.
+    GridType::Ptr myGrid;
+    mutable boost::thread_specific_ptr<GridType::Accessor> myWriteAccessors;
+    mutable boost::thread_specific_ptr<GridType::ConstAccessor> myReadAccessors;
+    mutable boost::shared_mutex myTreeLock;
     std::shared_ptr<MapBank> myBank;
     Vec3Type myChunkSize;
+    // myChunkSize rounded up to whole leaves
+    Vec3Type myChunkStride;
     unsigned long int myAccessTolerance;
-    uint64_t myBackgroundValue;
+    CellId myBackgroundValue;
     boost::filesystem::path myMapPath;
     clock_type myClock;
     mutable unsigned long int myAccessCounter;
-    unsigned long int myMemThresholdMB;
+    boost::atomic<unsigned long int> myMemThresholdMB;
     duration_type myDurationThreshold;
     duration_type myPruningInterval;
     std::weak_ptr<class Engine> myEngine;
-    mutable boost::recursive_mutex myLock;
     mutable boost::atomic_bool myPruningInProgressFlag;
     boost::thread myPruneThread;
     boost::condition_variable myPruneThreadCond;
     boost::mutex myPruneThreadMutex;
     boost::atomic_bool myPruneThreadQuitFlag;
-    std::fstream myIndexStream;
+    ChunkCodec myCodec;
+    int myCodecLevel;
+    std::unique_ptr<ChunkPrefetcher> myPrefetcher;
+    // saves still running on their own threads, which the destructor waits for
+    mutable std::vector<std::shared_future<void>> mySaves;
+    mutable boost::mutex mySavesLock;
 //     boost::asio::basic_waitable_timer<clock_type> myPruneTimer;
 
     static bool myInitialisedFlag;
@@ -17,136 +17,678 @@
  *  POSSIBILITY OF SUCH DAMAGE.
  */
 
-
 #include <boost/serialization/serialization.hpp>
 #include <boost/serialization/vector.hpp>
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/archive/binary_oarchive.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/stream.hpp>
 #include <boost/lexical_cast.hpp>
-#include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/locks.hpp>
 
 #include "mapbank.hpp"
 #include "fileutils.hpp"
 
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+
 namespace ADWIF
 {
-  MapBank::MapBank(std::iostream & stream) : myStream(stream), myCache(), myAccessTimes()
+  namespace
   {
-    if (!stream.good())
-      throw std::runtime_error("bad stream state initializing map bank");
+    const char bankMagic[4] = { 'A', 'D', 'W', 'B' };
+    const uint8_t bankVersion = 1;
+    const std::size_t bankHeaderSize = sizeof(bankMagic) + sizeof(uint8_t);
+    const std::size_t recordHeaderSize = sizeof(CellId) + sizeof(uint64_t) + sizeof(uint32_t);
+    // banks written before the header existed hold (hash, size, payload) records whose ids are their positions
+    const std::size_t legacyRecordHeaderSize = sizeof(uint64_t) + sizeof(uint32_t);
+    // new records are collected in memory and written out whenever this much has been gathered
+    const std::size_t batchSize = 4 * 1024 * 1024;
+    // the index is only rewritten once at least this share of its cells is no longer referred to
+    const double compactionThreshold = 0.25;
+
+    const char tableMagic[4] = { 'A', 'D', 'W', 'T' };
+    const uint8_t tableVersion = 1;
+    // magic, version and three reserved bytes, then the length of the index the table covers and its entry count
+    const std::size_t tableHeaderSize = sizeof(tableMagic) + 4 + sizeof(uint64_t) * 2;
+
+    struct TableEntry
+    {
+      uint64_t hash;
+      uint64_t location;
+    };
+
+    const char referencesMagic[4] = { 'A', 'D', 'W', 'R' };
+    const std::size_t referenceHeaderSize = sizeof(uint8_t) + sizeof(int32_t) * 3 + sizeof(uint32_t);
+
+    enum ReferenceRecord : uint8_t
+    {
+      ReferencesAdded = 0,
+      ReferencesSet = 1
+    };
+
+    void sortIds(std::vector<CellId> & ids)
+    {
+      std::sort(ids.begin(), ids.end());
+      ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    }
+
+    void writeTableHeader(std::ostream & os, uint64_t indexed, uint64_t count)
+    {
+      os.write(tableMagic, sizeof(tableMagic));
+      const char version[4] = { (char)tableVersion, 0, 0, 0 };
+      os.write(version, sizeof(version));
+      write<uint64_t>(os, indexed);
+      write<uint64_t>(os, count);
+    }
+
+    // Copies a whole record out of a mapping of the index, returning false if the mapping ends before it does
+    bool copyRecord(const boost::iostreams::mapped_file_source & mapping, uint64_t offset, std::vector<char> & out)
+    {
+      if (!mapping.is_open() || offset + recordHeaderSize > mapping.size())
+        return false;
+      uint32_t size;
+      std::memcpy(&size, mapping.data() + offset + sizeof(CellId) + sizeof(uint64_t), sizeof(size));
+      if (offset + recordHeaderSize + size > mapping.size())
+        return false;
+      out.assign(mapping.data() + offset, mapping.data() + offset + recordHeaderSize + size);
+      return true;
+    }
   }
 
-  const MapCell & MapBank::get(uint64_t hash)
+  MapBank::MapBank(const boost::filesystem::path & path) : myPath(path), myStream(), myCells(), myIds(), myFreeIds(),
+    myUnstoredIds(), myMutex(), myStoreMutex(), myTablePath(path.native() + ".table"), myTableStream(),
+    myIndexedLength(0), myTableCount(0), myMapping(), myRecordsLock(), myLoadMutex(),
+    myReferencesPath(path.native() + ".refs"), myReferencesStream(), myChunkReferences(), myReferenceCounts(),
+    myReferenceRecords(0), myReferencesMutex()
   {
-//     boost::upgrade_lock<boost::shared_mutex> guard(myMutex);
-    auto cell = myCache.find(hash);
-    if (cell == myCache.end())
+    // references can only be counted for banks that have kept track of them from the start
+    if (!boost::filesystem::exists(myPath) || !boost::filesystem::file_size(myPath))
+    {
+      std::ofstream references(myReferencesPath.native(), std::ios_base::binary | std::ios_base::trunc);
+      references.write(referencesMagic, sizeof(referencesMagic));
+    }
     {
-//       boost::upgrade_to_unique_lock<boost::shared_mutex> lock(guard);
-      myCache[hash] = loadCell(hash);
+      std::ofstream create(myPath.native(), std::ios_base::binary | std::ios_base::app);
     }
-    if (myAccessTimes[hash] != myClock.now())
+    myStream.open(myPath.native(), std::ios_base::binary | std::ios_base::in | std::ios_base::out);
+    if (!myStream.good())
+      throw std::runtime_error("could not open map bank " + myPath.string());
+    loadRecords();
+
+    if (boost::filesystem::exists(myReferencesPath))
     {
-//       boost::upgrade_to_unique_lock<boost::shared_mutex> lock(guard);
-      myAccessTimes[hash] = myClock.now();
+      loadReferences();
+      compact();
+      // the journal gains records with every save, so it is cut back to one record per chunk now and then
+      if (myReferenceRecords > myChunkReferences.size() * 2)
+        rewriteReferences();
+      else
+        myReferencesStream.open(myReferencesPath.native(), std::ios_base::binary | std::ios_base::app);
     }
-    if (myCache.size() > 1024 * 1024)
-      prune();
-    return myCache[hash];
   }
 
-  void MapBank::prune(bool pruneAll)
+  MapBank::~MapBank()
+  {
+    myMapping.close();
+    myTableStream.close();
+    myStream.close();
+  }
+
+  CellId MapBank::put(const MapCell & cell)
   {
-//     boost::unique_lock<boost::shared_mutex> guard(myMutex);
-    std::unordered_map<uint64_t, MapCell> toStore;
-    auto i = myAccessTimes.begin();
-    while (i != myAccessTimes.end())
+    CellId id;
+    if (lookup(cell, id))
+      return id;
+
+    boost::lock_guard<boost::mutex> guard(myMutex);
+    if (lookup(cell, id))
+      return id;
+    if (!myFreeIds.empty())
     {
-      if (pruneAll || myClock.now() - i->second > std::chrono::minutes(2))
+      id = myFreeIds.back();
+      myFreeIds.pop_back();
+    }
+    else
+    {
+      if (myCells.size() >= std::numeric_limits<CellId>::max())
+        throw std::runtime_error("map bank " + myPath.string() + " is full");
+      id = myCells.push_back(Slot()) - myCells.begin();
+    }
+    Slot & slot = myCells[id];
+    slot.cell = cell;
+    slot.hash = cell.hash();
+    slot.loaded.store(true, boost::memory_order_release);
+    myUnstoredIds.push_back(id);
+    // published only once the cell is in place
+    myIds.insert(std::make_pair(cell.hash(), id));
+    return id;
+  }
+
+  CellId MapBank::find(uint64_t hash) const
+  {
+    auto i = myIds.find(hash);
+    if (i == myIds.end())
+      throw std::runtime_error("could not find cell " + boost::lexical_cast<std::string>(hash));
+    return i->second;
+  }
+
+  std::size_t MapBank::size() const
+  {
+    boost::lock_guard<boost::mutex> guard(myMutex);
+    return myCells.size() - myFreeIds.size();
+  }
+
+  bool MapBank::lookup(const MapCell & cell, CellId & id) const
+  {
+    // hashes only narrow the search, a different cell with the same hash must not be mistaken for this one
+    auto range = myIds.equal_range(cell.hash());
+    for (auto i = range.first; i != range.second; ++i)
+      if (get(i->second) == cell)
       {
-        auto item = myCache.find(i->first);
-        toStore.insert({item->first, item->second});
-        myCache.unsafe_erase(myCache.find(i->first));
-        i = myAccessTimes.unsafe_erase(i);
-      } else ++i;
+        id = i->second;
+        return true;
+      }
+    return false;
+  }
+
+  void MapBank::prune()
+  {
+    boost::lock_guard<boost::mutex> guard(myStoreMutex);
+    std::vector<CellId> ids;
+    {
+      boost::lock_guard<boost::mutex> lock(myMutex);
+      ids.swap(myUnstoredIds);
+    }
+    if (ids.empty())
+      return;
+    try
+    {
+      appendRecords(ids);
+      writeTableEntries(ids);
+    }
+    catch (...)
+    {
+      // tried again with the next call, a cell that ends up in the file twice is only read back once
+      boost::lock_guard<boost::mutex> lock(myMutex);
+      myUnstoredIds.insert(myUnstoredIds.begin(), ids.begin(), ids.end());
+      throw;
+    }
+  }
+
+  void MapBank::addReferences(int x, int y, int z, std::vector<CellId> ids)
+  {
+    sortIds(ids);
+    boost::lock_guard<boost::mutex> guard(myReferencesMutex);
+    if (!myReferencesStream.is_open())
+      return;
+    logReferences(ChunkKey(x, y, z), ids, false);
+    applyReferences(ChunkKey(x, y, z), ids, false);
+  }
+
+  void MapBank::setReferences(int x, int y, int z, std::vector<CellId> ids)
+  {
+    sortIds(ids);
+    boost::lock_guard<boost::mutex> guard(myReferencesMutex);
+    if (!myReferencesStream.is_open())
+      return;
+    logReferences(ChunkKey(x, y, z), ids, true);
+    applyReferences(ChunkKey(x, y, z), ids, true);
+  }
+
+  uint32_t MapBank::references(CellId id) const
+  {
+    boost::lock_guard<boost::mutex> guard(myReferencesMutex);
+    return id < myReferenceCounts.size() ? myReferenceCounts[id] : 0;
+  }
+
+  const MapCell & MapBank::load(CellId id) const
+  {
+    std::vector<char> record;
+    readRecord(id, record);
+    CellId recordId;
+    uint64_t hash;
+    uint32_t size;
+    std::memcpy(&recordId, record.data(), sizeof(recordId));
+    std::memcpy(&hash, record.data() + sizeof(recordId), sizeof(hash));
+    std::memcpy(&size, record.data() + sizeof(recordId) + sizeof(hash), sizeof(size));
+    if (recordId != id)
+      throw std::runtime_error("map bank table of " + myPath.string() + " does not match its index");
+
+    boost::iostreams::stream<boost::iostreams::array_source> is(record.data() + recordHeaderSize, size);
+    MapCell cell;
+    {
+      boost::archive::binary_iarchive ia(is, boost::archive::no_header);
+      ia & cell;
+    }
+    if (cell.calcHash() != hash)
+      throw std::runtime_error("invalid cell hash " + boost::lexical_cast<std::string>(hash));
+
+    // threads that read the same cell at once keep the first copy
+    boost::lock_guard<boost::mutex> guard(myLoadMutex);
+    Slot & slot = myCells[id];
+    if (!slot.loaded.load(boost::memory_order_relaxed))
+    {
+      slot.cell = std::move(cell);
+      slot.loaded.store(true, boost::memory_order_release);
+    }
+    return slot.cell;
+  }
+
+  void MapBank::readRecord(CellId id, std::vector<char> & out) const
+  {
+    {
+      boost::shared_lock<boost::shared_mutex> guard(myRecordsLock);
+      const uint64_t location = myCells[id].location;
+      if (!location)
+        throw std::runtime_error("cell " + boost::lexical_cast<std::string>(id) + " is not stored");
+      if (copyRecord(myMapping, location - 1, out))
+        return;
+    }
+
+    // records written since the index was mapped lie past the end of the mapping
+    boost::unique_lock<boost::shared_mutex> guard(myRecordsLock);
+    const uint64_t location = myCells[id].location;
+    if (!copyRecord(myMapping, location - 1, out))
+    {
+      myMapping.close();
+      myMapping.open(myPath.native());
+      if (!copyRecord(myMapping, location - 1, out))
+        throw std::runtime_error("could not read cell " + boost::lexical_cast<std::string>(id) + " from map bank " +
+          myPath.string());
+    }
+  }
+
+  void MapBank::loadRecords()
+  {
+    const uint64_t fileSize = boost::filesystem::file_size(myPath);
+
+    myStream.clear();
+    myStream.seekg(0, std::ios_base::beg);
+    char magic[sizeof(bankMagic)];
+    uint8_t version = 0;
+    if (!myStream.read(magic, sizeof(magic)) || std::memcmp(magic, bankMagic, sizeof(magic)) != 0 ||
+        !read<uint8_t>(myStream, version))
+    {
+      loadLegacyRecords();
+      return;
     }
+    if (version > bankVersion)
+      throw std::runtime_error("unsupported map bank version " + boost::lexical_cast<std::string>((int)version));
+
+    // only the records written after the table was last brought up to date are read, and only their headers
+    const bool tabled = loadTable(fileSize);
+    const uint64_t from = tabled ? myIndexedLength : bankHeaderSize;
+    const uint64_t offset = indexRecords(from, fileSize);
+
+    // drop what is left of a record an interrupted write did not finish, appending after it would lose every
+    // record that follows
+    if (offset < fileSize)
+    {
+      myStream.close();
+      boost::filesystem::resize_file(myPath, offset);
+      myStream.open(myPath.native(), std::ios_base::binary | std::ios_base::in | std::ios_base::out);
+    }
+
+    // free ids are handed out lowest first
+    for (CellId id = myCells.size(); id > 0; id--)
+      if (!myCells[id - 1].location)
+        myFreeIds.push_back(id - 1);
+    for (CellId id = 0; id < myCells.size(); id++)
+      if (myCells[id].location)
+        myIds.insert(std::make_pair(myCells[id].hash, id));
+
+    myIndexedLength = offset;
+    if (!tabled || offset != from)
+      writeTable();
+    else
+      myTableStream.open(myTablePath.native(), std::ios_base::binary | std::ios_base::in | std::ios_base::out);
+  }
+
+  void MapBank::loadLegacyRecords()
+  {
+    const uint64_t fileSize = boost::filesystem::file_size(myPath);
+    std::vector<char> payload;
+    uint64_t offset = 0;
+
     myStream.clear();
     myStream.seekg(0, std::ios_base::beg);
-    while (!toStore.empty())
+    while (offset + legacyRecordHeaderSize <= fileSize)
     {
-      uint64_t fhash;
+      const CellId id = myCells.size();
+      uint64_t hash;
       uint32_t size;
-      if (read<uint64_t>(myStream, fhash) && read<uint32_t>(myStream, size))
-      {
-        myStream.seekg(size, std::ios_base::cur);
-        toStore.erase(fhash);
-      }
-      else
+      if (!read<uint64_t>(myStream, hash) || !read<uint32_t>(myStream, size) ||
+          offset + legacyRecordHeaderSize + size > fileSize)
         break;
+      payload.resize(size);
+      myStream.read(payload.data(), size);
+      boost::iostreams::stream<boost::iostreams::array_source> is(payload.data(), payload.size());
+      MapCell cell;
+      boost::archive::binary_iarchive ia(is, boost::archive::no_header);
+      ia & cell;
+      if (cell.calcHash() != hash)
+        throw std::runtime_error("invalid cell hash " + boost::lexical_cast<std::string>(hash));
+      // banks written before cells had ids may hold a cell more than once, its first record gives its id
+      CellId existing;
+      if (!lookup(cell, existing))
+        myIds.insert(std::make_pair(hash, id));
+      Slot slot;
+      slot.cell = std::move(cell);
+      slot.hash = hash;
+      slot.loaded.store(true);
+      myCells.push_back(slot);
+      offset += legacyRecordHeaderSize + size;
     }
-    for (auto const & i : toStore)
+    myStream.clear();
+
+    // the records are written out again in the current format, which also drops a torn one at the end
+    rewriteRecords();
+  }
+
+  bool MapBank::loadTable(uint64_t fileSize)
+  {
+    std::ifstream is(myTablePath.native(), std::ios_base::binary);
+    char magic[sizeof(tableMagic)];
+    char version[4];
+    uint64_t indexed, count;
+    if (!is.read(magic, sizeof(magic)) || std::memcmp(magic, tableMagic, sizeof(magic)) != 0 ||
+        !is.read(version, sizeof(version)) || version[0] != tableVersion || !read<uint64_t>(is, indexed) ||
+        !read<uint64_t>(is, count) || indexed < bankHeaderSize || indexed > fileSize ||
+        count > std::numeric_limits<CellId>::max() ||
+        boost::filesystem::file_size(myTablePath) != tableHeaderSize + count * sizeof(TableEntry))
+      return false;
+
+    std::vector<TableEntry> entries(count);
+    if (!is.read(reinterpret_cast<char *>(entries.data()), count * sizeof(TableEntry)))
+      return false;
+    for (const TableEntry & entry : entries)
+      if (entry.location && (entry.location - 1 < bankHeaderSize || entry.location - 1 + recordHeaderSize > indexed))
+        return false;
+
+    myCells.grow_to_at_least(count);
+    for (CellId id = 0; id < count; id++)
     {
-      myStream.clear();
-      write<uint64_t>(myStream, i.first);
-      std::streampos sizePos = myStream.tellp();
-      write<uint32_t>(myStream, -1);
-      std::streampos start = myStream.tellp();
-      boost::archive::binary_oarchive io(myStream, boost::archive::no_header);
-      io & i.second;
-      std::streampos endpos = myStream.tellp();
-      std::streamsize size = endpos - start;
-      myStream.seekp(sizePos, std::ios_base::beg);
-      write<uint32_t>(myStream, (uint32_t)size);
-      myStream.seekp(endpos, std::ios_base::beg);
+      myCells[id].hash = entries[id].hash;
+      myCells[id].location = entries[id].location;
     }
+    myIndexedLength = indexed;
+    myTableCount = count;
+    return true;
   }
 
-  MapCell MapBank::loadCell(uint64_t hash)
+  uint64_t MapBank::indexRecords(uint64_t offset, uint64_t fileSize)
   {
-    boost::unique_lock<boost::shared_mutex> guard(myMutex);
     myStream.clear();
-    myStream.seekg(0, std::ios_base::beg);
-
-    while (myStream.good())
+    myStream.seekg(offset, std::ios_base::beg);
+    while (offset + recordHeaderSize <= fileSize)
     {
-      uint64_t fhash;
+      CellId id;
+      uint64_t hash;
       uint32_t size;
+      if (!read<CellId>(myStream, id) || !read<uint64_t>(myStream, hash) || !read<uint32_t>(myStream, size) ||
+          offset + recordHeaderSize + size > fileSize)
+        break;
+      myCells.grow_to_at_least((std::size_t)id + 1);
+      // a record written again after a failed write, or for an id handed out again, supersedes the earlier one
+      myCells[id].hash = hash;
+      myCells[id].location = offset + 1;
+      offset += recordHeaderSize + size;
+      myStream.seekg(offset, std::ios_base::beg);
+    }
+    myStream.clear();
+    return offset;
+  }
+
+  void MapBank::appendRecords(const std::vector<CellId> & ids)
+  {
+    std::string batch;
+    // ids of the records in the batch and where they start in it
+    std::vector<std::pair<CellId, std::size_t>> batched;
+    myStream.clear();
+    myStream.seekp(0, std::ios_base::end);
+    uint64_t base = myStream.tellp();
 
-      if (!read<uint64_t>(myStream, fhash) || !read<uint32_t>(myStream, size))
+    auto flush = [&]()
+    {
+      myStream.write(batch.data(), batch.size());
+      myStream.flush();
+      if (!myStream)
+        throw std::runtime_error("could not write to map bank " + myPath.string());
       {
-        myStream.clear();
-        myStream.seekg(0, std::ios_base::beg);
-        break;
+        // cells are only looked up in the file once their records are in it
+        boost::unique_lock<boost::shared_mutex> guard(myRecordsLock);
+        for (auto & record : batched)
+          myCells[record.first].location = base + record.second + 1;
       }
+      base += batch.size();
+      batch.clear();
+      batched.clear();
+    };
 
-      if (fhash == hash)
+    {
+      boost::iostreams::stream<boost::iostreams::back_insert_device<std::string>> os(batch);
+      std::vector<char> record;
+      for (CellId id : ids)
       {
-        MapCell cell;
-        boost::archive::binary_iarchive ia(myStream, boost::archive::no_header);
-        ia & cell;
-        if (cell.calcHash() != fhash)
-          throw std::runtime_error("invalid cell hash " + boost::lexical_cast<std::string>(hash));
-        myStream.seekg(0, std::ios_base::beg);
-        return std::move(cell);
+        const Slot & slot = myCells[id];
+        const std::size_t start = batch.size();
+        batched.push_back(std::make_pair(id, start));
+        // cells that were never read back are copied over as they are
+        if (!slot.loaded.load(boost::memory_order_acquire))
+        {
+          readRecord(id, record);
+          batch.append(record.data(), record.size());
+        }
+        else
+        {
+          batch.append(recordHeaderSize, 0);
+          {
+            boost::archive::binary_oarchive oa(os, boost::archive::no_header);
+            oa & slot.cell;
+          }
+          os.flush();
+          const uint32_t size = batch.size() - start - recordHeaderSize;
+          std::memcpy(&batch[start], &id, sizeof(id));
+          std::memcpy(&batch[start + sizeof(id)], &slot.hash, sizeof(slot.hash));
+          std::memcpy(&batch[start + sizeof(id) + sizeof(slot.hash)], &size, sizeof(size));
+        }
+        if (batch.size() >= batchSize)
+          flush();
       }
-      else
-        myStream.seekg(size, std::ios_base::cur);
     }
 
-    throw std::runtime_error("stream error finding cell " + boost::lexical_cast<std::string>(hash));
-    return MapCell();
+    if (!batch.empty())
+      flush();
   }
 
-  uint64_t MapBank::put(const MapCell & cell)
+  void MapBank::rewriteRecords()
   {
-    uint64_t hash = cell.hash();
-//     boost::upgrade_lock<boost::shared_mutex> guard(myMutex);
-    if (myCache.find(hash) == myCache.end())
+    std::vector<bool> free(myCells.size(), false);
+    for (CellId id : myFreeIds)
+      free[id] = true;
+    std::vector<CellId> ids;
+    for (CellId id = 0; id < myCells.size(); id++)
+      if (!free[id])
+        ids.push_back(id);
+
+    // the new index replaces the old one only once it is complete
+    const boost::filesystem::path temp = myPath.native() + ".tmp";
+    myStream.close();
+    {
+      std::ofstream os(temp.native(), std::ios_base::binary | std::ios_base::trunc);
+      os.write(bankMagic, sizeof(bankMagic));
+      write<uint8_t>(os, bankVersion);
+    }
+    myStream.open(temp.native(), std::ios_base::binary | std::ios_base::in | std::ios_base::out);
+    // records that are copied over are read through a mapping of the whole old index
+    myMapping.close();
+    appendRecords(ids);
+    myIndexedLength = myStream.tellp();
+    myStream.close();
+    myMapping.close();
+    boost::filesystem::rename(temp, myPath);
+    myStream.open(myPath.native(), std::ios_base::binary | std::ios_base::in | std::ios_base::out);
+    if (!myStream.good())
+      throw std::runtime_error("could not open map bank " + myPath.string());
+    writeTable();
+  }
+
+  void MapBank::writeTable()
+  {
+    // a table cut short by an interrupted write no longer matches its header and is built again
+    myTableStream.close();
+    myTableStream.open(myTablePath.native(), std::ios_base::binary | std::ios_base::in | std::ios_base::out |
+      std::ios_base::trunc);
+    myTableCount = myCells.size();
+    writeTableHeader(myTableStream, myIndexedLength, myTableCount);
+    std::vector<TableEntry> entries(myTableCount);
+    for (CellId id = 0; id < myTableCount; id++)
+    {
+      entries[id].hash = myCells[id].hash;
+      entries[id].location = myCells[id].location;
+    }
+    myTableStream.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(TableEntry));
+    myTableStream.flush();
+    if (!myTableStream)
+      throw std::runtime_error("could not write map bank table " + myTablePath.string());
+  }
+
+  void MapBank::writeTableEntries(const std::vector<CellId> & ids)
+  {
+    myTableStream.clear();
+    for (CellId id : ids)
+    {
+      const TableEntry entry = { myCells[id].hash, myCells[id].location };
+      myTableStream.seekp(tableHeaderSize + (uint64_t)id * sizeof(TableEntry), std::ios_base::beg);
+      myTableStream.write(reinterpret_cast<const char *>(&entry), sizeof(entry));
+      myTableCount = std::max<uint64_t>(myTableCount, (uint64_t)id + 1);
+    }
+    // the header goes last, so the table only covers the new records once their entries are in it
+    myIndexedLength = myStream.tellp();
+    myTableStream.seekp(0, std::ios_base::beg);
+    writeTableHeader(myTableStream, myIndexedLength, myTableCount);
+    myTableStream.flush();
+    if (!myTableStream)
+      throw std::runtime_error("could not write map bank table " + myTablePath.string());
+  }
+
+  void MapBank::loadReferences()
+  {
+    const uint64_t fileSize = boost::filesystem::file_size(myReferencesPath);
+    std::ifstream is(myReferencesPath.native(), std::ios_base::binary);
+    char magic[sizeof(referencesMagic)];
+    if (!is.read(magic, sizeof(magic)) || std::memcmp(magic, referencesMagic, sizeof(magic)) != 0)
+      throw std::runtime_error("invalid map bank references " + myReferencesPath.string());
+
+    uint64_t offset = sizeof(magic);
+    std::vector<CellId> ids;
+    while (offset + referenceHeaderSize <= fileSize)
+    {
+      uint8_t kind;
+      int32_t x, y, z;
+      uint32_t count;
+      if (!read<uint8_t>(is, kind) || !read<int32_t>(is, x) || !read<int32_t>(is, y) || !read<int32_t>(is, z) ||
+          !read<uint32_t>(is, count) || offset + referenceHeaderSize + count * sizeof(CellId) > fileSize)
+        break;
+      ids.resize(count);
+      if (!is.read(reinterpret_cast<char *>(ids.data()), count * sizeof(CellId)))
+        break;
+      applyReferences(ChunkKey(x, y, z), ids, kind == ReferencesSet);
+      offset += referenceHeaderSize + count * sizeof(CellId);
+      myReferenceRecords++;
+    }
+    is.close();
+
+    // a torn record is one whose chunk was never saved either
+    if (offset < fileSize)
+      boost::filesystem::resize_file(myReferencesPath, offset);
+  }
+
+  void MapBank::applyReferences(const ChunkKey & key, std::vector<CellId> & ids, bool replace)
+  {
+    std::vector<CellId> & held = myChunkReferences[key];
+    std::vector<CellId> added, removed;
+    std::set_difference(ids.begin(), ids.end(), held.begin(), held.end(), std::back_inserter(added));
+    if (replace)
+      std::set_difference(held.begin(), held.end(), ids.begin(), ids.end(), std::back_inserter(removed));
+    for (CellId id : added)
+    {
+      if (id >= myReferenceCounts.size())
+        myReferenceCounts.resize(id + 1, 0);
+      myReferenceCounts[id]++;
+    }
+    for (CellId id : removed)
+      myReferenceCounts[id]--;
+
+    if (replace)
+      held.swap(ids);
+    else
+      held.insert(held.end(), added.begin(), added.end());
+    sortIds(held);
+    if (held.empty())
+      myChunkReferences.erase(key);
+  }
+
+  void MapBank::logReferences(const ChunkKey & key, const std::vector<CellId> & ids, bool replace)
+  {
+    write<uint8_t>(myReferencesStream, replace ? ReferencesSet : ReferencesAdded);
+    write<int32_t>(myReferencesStream, std::get<0>(key));
+    write<int32_t>(myReferencesStream, std::get<1>(key));
+    write<int32_t>(myReferencesStream, std::get<2>(key));
+    write<uint32_t>(myReferencesStream, ids.size());
+    myReferencesStream.write(reinterpret_cast<const char *>(ids.data()), ids.size() * sizeof(CellId));
+    myReferencesStream.flush();
+    if (!myReferencesStream)
+      throw std::runtime_error("could not write to map bank references " + myReferencesPath.string());
+    myReferenceRecords++;
+  }
+
+  void MapBank::rewriteReferences()
+  {
+    const boost::filesystem::path temp = myReferencesPath.native() + ".tmp";
+    myReferencesStream.close();
+    myReferencesStream.open(temp.native(), std::ios_base::binary | std::ios_base::trunc);
+    myReferencesStream.write(referencesMagic, sizeof(referencesMagic));
+    myReferenceRecords = 0;
+    for (auto & entry : myChunkReferences)
+      logReferences(entry.first, entry.second, true);
+    myReferencesStream.close();
+    boost::filesystem::rename(temp, myReferencesPath);
+    myReferencesStream.open(myReferencesPath.native(), std::ios_base::binary | std::ios_base::app);
+  }
+
+  void MapBank::compact()
+  {
+    std::vector<bool> free(myCells.size(), false);
+    for (CellId id : myFreeIds)
+      free[id] = true;
+    std::vector<CellId> dead;
+    for (CellId id = 0; id < myCells.size(); id++)
+      if (!free[id] && (id >= myReferenceCounts.size() || !myReferenceCounts[id]))
+        dead.push_back(id);
+    if (dead.empty() || dead.size() < (myCells.size() - myFreeIds.size()) * compactionThreshold)
+      return;
+
+    // nothing else can hold the bank yet, so cells can be dropped without any of the concurrent containers' care
+    for (CellId id : dead)
     {
-//       boost::upgrade_to_unique_lock<boost::shared_mutex> lock(guard);
-      myAccessTimes[hash] = myClock.now();
-      myCache[hash] = cell;
+      auto range = myIds.equal_range(myCells[id].hash);
+      for (auto i = range.first; i != range.second; ++i)
+        if (i->second == id)
+        {
+          myIds.unsafe_erase(i);
+          break;
+        }
+      myCells[id] = Slot();
+      myFreeIds.push_back(id);
     }
-    return hash;
+    std::sort(myFreeIds.begin(), myFreeIds.end(), std::greater<CellId>());
+    rewriteRecords();
   }
 }
@@ -23,36 +23,144 @@
 #include "mapcell.hpp"
 
 #include <algorithm>
-#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <tuple>
 #include <unordered_map>
+#include <vector>
 
+#include <boost/atomic.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/thread/shared_mutex.hpp>
 #include <tbb/concurrent_unordered_map.h>
+#include <tbb/concurrent_vector.h>
 
 namespace ADWIF
 {
+  // Dense identifier of a cell variant within a map's bank
+  typedef uint32_t CellId;
+
+  // Interns every cell variant of a map and hands out dense ids for them. A cell keeps its id for as long as it is in
+  // the bank, so looking a cell up is an index into the cell vector. The bank is kept in the index file as
+  // (id, hash, size, payload) records. A table of the hash and record offset of every id, kept next to it in
+  // "<index>.table", is all that is read when the map is opened; a cell is read from a memory mapping of the index
+  // the first time it is asked for, from any number of threads at once, and stays resident from then on.
+  //
+  // Chunks report the ids they were saved with, which gives every cell a count of the chunks on disk that refer to
+  // it. Cells no saved chunk refers to are dropped from the index when the map is next opened, and their ids are
+  // handed out again.
   class MapBank
   {
-    using clock_type = std::chrono::steady_clock;
-    using time_point = clock_type::time_point;
-    using duration_type = clock_type::duration;
-
   public:
-    MapBank(std::iostream & stream);
+    MapBank(const boost::filesystem::path & path);
+    ~MapBank();
+
+    const MapCell & get(CellId id) const
+    {
+      const Slot & slot = myCells[id];
+      return slot.loaded.load(boost::memory_order_acquire) ? slot.cell : load(id);
+    }
+    CellId put(const MapCell & cell);
+    // The id of a cell by its hash, for chunks saved before cells had ids
+    CellId find(uint64_t hash) const;
+    std::size_t size() const;
+    // Writes the cells added since the last call to the index file
+    void prune();
 
-    const MapCell & get(uint64_t hash);
-    uint64_t put(const MapCell & cell);
-    void prune(bool pruneAll = false);
+    // A chunk about to be saved adds the ids it is saved with, and sets them once it has been. A save that is
+    // interrupted in between leaves the chunk referring to both its old and new cells, so neither are dropped.
+    void addReferences(int x, int y, int z, std::vector<CellId> ids);
+    void setReferences(int x, int y, int z, std::vector<CellId> ids);
+    // The number of saved chunks that refer to a cell
+    uint32_t references(CellId id) const;
 
   private:
-    MapCell loadCell(uint64_t hash);
+    MapBank(const MapBank &);
+    MapBank & operator=(const MapBank &);
+
+    typedef std::tuple<int, int, int> ChunkKey;
+
+    struct Slot
+    {
+      Slot(): cell(), hash(0), location(0), loaded(false) { }
+      Slot(const Slot & other): cell(other.cell), hash(other.hash), location(other.location),
+        loaded(other.loaded.load()) { }
+      Slot & operator=(const Slot & other)
+      {
+        cell = other.cell;
+        hash = other.hash;
+        location = other.location;
+        loaded.store(other.loaded.load());
+        return *this;
+      }
+
+      MapCell cell;
+      uint64_t hash;
+      // offset of the cell's record in the index file plus one, zero while it is not stored; guarded by myRecordsLock
+      uint64_t location;
+      // whether cell holds the cell, only ever set once the cell is in place
+      boost::atomic_bool loaded;
+    };
+
+    bool lookup(const MapCell & cell, CellId & id) const;
+    // Reads a stored cell that is not resident yet
+    const MapCell & load(CellId id) const;
+    // Copies the record of a stored cell out of the index file
+    void readRecord(CellId id, std::vector<char> & out) const;
+
+    void loadRecords();
+    void loadLegacyRecords();
+    // Reads the table, returning false if it is missing or does not match the index file
+    bool loadTable(uint64_t fileSize);
+    // Adds the records from 'offset' on to the table, returning where the last complete one ends
+    uint64_t indexRecords(uint64_t offset, uint64_t fileSize);
+    void appendRecords(const std::vector<CellId> & ids);
+    void rewriteRecords();
+    void writeTable();
+    void writeTableEntries(const std::vector<CellId> & ids);
+
+    void loadReferences();
+    void applyReferences(const ChunkKey & key, std::vector<CellId> & ids, bool replace);
+    void logReferences(const ChunkKey & key, const std::vector<CellId> & ids, bool replace);
+    void rewriteReferences();
+    // Drops the cells no saved chunk refers to, only while the bank is being opened
+    void compact();
 
   private:
-    std::iostream & myStream;
-    boost::shared_mutex myMutex;
-    tbb::interface5::concurrent_unordered_map<uint64_t, MapCell> myCache;
-    tbb::interface5::concurrent_unordered_map<uint64_t, time_point> myAccessTimes;
-    clock_type myClock;
+    boost::filesystem::path myPath;
+    std::fstream myStream;
+    mutable tbb::concurrent_vector<Slot> myCells;
+    // cell hashes to ids, cells whose hashes collide share a key
+    tbb::interface5::concurrent_unordered_multimap<uint64_t, CellId> myIds;
+    // ids no cell holds, to be handed out again
+    std::vector<CellId> myFreeIds;
+    // ids of cells not in the index file yet
+    std::vector<CellId> myUnstoredIds;
+    // serialises adding cells
+    mutable boost::mutex myMutex;
+    boost::mutex myStoreMutex;
+
+    boost::filesystem::path myTablePath;
+    std::fstream myTableStream;
+    // length of the index file the table covers, records past it are added to the table when the bank is opened
+    uint64_t myIndexedLength;
+    uint64_t myTableCount;
+    mutable boost::iostreams::mapped_file_source myMapping;
+    // held shared to read records through myMapping, exclusively to map the file again or move records
+    mutable boost::shared_mutex myRecordsLock;
+    // serialises publishing cells read back from the index
+    mutable boost::mutex myLoadMutex;
+
+    // journal of the ids saved chunks refer to, only kept for banks that have had one from the start
+    boost::filesystem::path myReferencesPath;
+    std::ofstream myReferencesStream;
+    std::map<ChunkKey, std::vector<CellId>> myChunkReferences;
+    std::vector<uint32_t> myReferenceCounts;
+    std::size_t myReferenceRecords;
+    mutable boost::mutex myReferencesMutex;
   };
 }
 
@@ -0,0 +1,365 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Drives a Map with synthetic workloads at increasing thread counts, so that backends, chunk sizes and codecs can be
+// compared on the same machine. Built as the adwif_map_bench target.
+
+#include "config.hpp"
+#include "adwif.hpp"
+#include "engine.hpp"
+#include "map.hpp"
+#include "mapcell.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <unistd.h>
+
+#include <boost/algorithm/string/join.hpp>
+#include <boost/chrono.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/program_options.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+
+namespace ADWIF
+{
+  boost::program_options::variables_map options;
+}
+
+using namespace ADWIF;
+
+namespace po = boost::program_options;
+
+namespace
+{
+  using clock_type = boost::chrono::steady_clock;
+
+  // The map logs every chunk it loads and saves, which would swamp the results
+  class QuietLogProvider: public StdErrLogProvider
+  {
+  public:
+    virtual void logMessage(LogLevel level, const std::string & source, const std::string & message)
+    {
+      if (level >= LogLevel::Error)
+        StdErrLogProvider::logMessage(level, source, message);
+    }
+  };
+
+  struct Settings
+  {
+    boost::filesystem::path path;
+    std::string backend;
+    unsigned int chunkX, chunkY, chunkZ;
+    unsigned int threads;
+    uint64_t ops;
+    int extentX, extentY, extentZ;
+    unsigned int cellKinds;
+    unsigned long int pressureMB;
+  };
+
+  struct Result
+  {
+    std::string workload;
+    unsigned int threads;
+    uint64_t ops;
+    double seconds;
+    std::vector<uint32_t> latencies; // nanoseconds
+  };
+
+  double percentile(const std::vector<uint32_t> & sorted, double p)
+  {
+    if (sorted.empty())
+      return 0;
+    return sorted[std::min<std::size_t>(sorted.size() - 1, std::size_t(p * sorted.size()))] / 1000.0;
+  }
+
+  double residentMB()
+  {
+    // resident set size of the whole process, the second field of statm in pages
+    std::ifstream statm("/proc/self/statm");
+    std::size_t size = 0, resident = 0;
+    if (!(statm >> size >> resident))
+      return 0;
+    return double(resident) * sysconf(_SC_PAGESIZE) / (1024 * 1024);
+  }
+
+  double diskMB(const boost::filesystem::path & path)
+  {
+    uint64_t bytes = 0;
+    if (boost::filesystem::exists(path))
+      for (boost::filesystem::recursive_directory_iterator i(path), end; i != end; ++i)
+        if (boost::filesystem::is_regular_file(i->status()))
+          bytes += boost::filesystem::file_size(i->path());
+    return double(bytes) / (1024 * 1024);
+  }
+
+  void report(Result & result, const Settings & settings)
+  {
+    std::sort(result.latencies.begin(), result.latencies.end());
+    std::cout << boost::format("%-10s %7u %14.0f %10.2f %10.2f %11.1f %9.1f\n") % result.workload % result.threads %
+      (result.seconds > 0 ? result.ops / result.seconds : 0) % percentile(result.latencies, 0.50) %
+      percentile(result.latencies, 0.99) % residentMB() % diskMB(settings.path);
+    std::cout.flush();
+  }
+
+  // Runs op(thread, index, rng) 'ops' times on each of 'threads' threads, timing every call
+  template <class Op>
+  Result run(const std::string & workload, unsigned int threads, uint64_t ops, Op op)
+  {
+    Result result;
+    result.workload = workload;
+    result.threads = threads;
+    result.ops = ops * threads;
+    result.latencies.resize(result.ops);
+
+    boost::barrier start(threads + 1);
+    boost::thread_group group;
+    for (unsigned int t = 0; t < threads; t++)
+      group.create_thread([&, t]()
+      {
+        std::mt19937_64 rng(t * 7919 + 1);
+        uint32_t * latencies = result.latencies.data() + t * ops;
+        start.wait();
+        for (uint64_t i = 0; i < ops; i++)
+        {
+          const clock_type::time_point before = clock_type::now();
+          op(t, i, rng);
+          latencies[i] = boost::chrono::duration_cast<boost::chrono::nanoseconds>(clock_type::now() - before).count();
+        }
+      });
+
+    start.wait();
+    const clock_type::time_point begin = clock_type::now();
+    group.join_all();
+    result.seconds = boost::chrono::duration<double>(clock_type::now() - begin).count();
+    return result;
+  }
+
+  // A smooth, deterministic ground height for terrain-like writes
+  int terrainHeight(int x, int y, int depth)
+  {
+    const double h = std::sin(x * 0.021) * std::cos(y * 0.017) + 0.5 * std::sin((x + y) * 0.053);
+    return int((h + 1.5) / 3.0 * depth);
+  }
+
+  std::vector<MapCell> makeCells(unsigned int kinds)
+  {
+    std::vector<MapCell> cells(std::max(kinds, 2u));
+    for (unsigned int i = 0; i < cells.size(); i++)
+    {
+      cells[i].temp(200 + i);
+      cells[i].generated(true);
+    }
+    return cells;
+  }
+
+  std::vector<unsigned int> threadCounts(unsigned int max)
+  {
+    std::vector<unsigned int> counts;
+    for (unsigned int t = 1; t < max; t *= 2)
+      counts.push_back(t);
+    counts.push_back(max);
+    return counts;
+  }
+
+  void benchmark(const std::shared_ptr<Engine> & engine, const Settings & settings, ChunkCodec codec, int level)
+  {
+    const std::vector<MapCell> cells = makeCells(settings.cellKinds);
+    const MapCell background;
+
+    std::cout << boost::format("%-10s %7s %14s %10s %10s %11s %9s\n") % "workload" % "threads" % "ops/s" %
+      "p50 us" % "p99 us" % "resident MB" % "disk MB";
+
+    std::unique_ptr<Map> map(new Map(engine, settings.path, false, settings.chunkX, settings.chunkY,
+                                     settings.chunkZ, background, settings.backend));
+    map->codec(codec, level);
+
+    for (unsigned int threads : threadCounts(settings.threads))
+    {
+      // Columns of ground with a differing top layer, like the terrain generator writes. Every thread owns a band
+      // of rows so that columns are not written twice.
+      const int rows = std::max(1, settings.extentY / int(threads));
+      Result fill = run("fill", threads, settings.ops / 16, [&](unsigned int t, uint64_t i, std::mt19937_64 &)
+      {
+        const int x = int(i % settings.extentX);
+        const int y = int(t * rows + (i / settings.extentX) % rows);
+        const int height = terrainHeight(x, y, settings.extentZ);
+        map->fill(Box3D(Point3D(x, y, 0), Point3D(x + 1, y + 1, height)), cells[0]);
+        map->set(x, y, height, cells[1 + (x ^ y) % (cells.size() - 1)]);
+      });
+      report(fill, settings);
+
+      Result random = run("get", threads, settings.ops, [&](unsigned int, uint64_t, std::mt19937_64 & rng)
+      {
+        map->get(int(rng() % settings.extentX), int(rng() % settings.extentY), int(rng() % settings.extentZ));
+      });
+      report(random, settings);
+
+      // x varies fastest, every thread walking its own band of rows one layer at a time
+      Result scan = run("scan", threads, settings.ops, [&](unsigned int t, uint64_t i, std::mt19937_64 &)
+      {
+        const uint64_t row = i / settings.extentX;
+        map->get(int(i % settings.extentX), int(t * rows + row % rows), int(row / rows % settings.extentZ));
+      });
+      report(scan, settings);
+    }
+
+    // Saving everything and reading it all back after reopening are measured once each
+    {
+      Result save = run("save", 1, 1, [&](unsigned int, uint64_t, std::mt19937_64 &) { map->save().wait(); });
+      report(save, settings);
+      map.reset();
+
+      map.reset(new Map(engine, settings.path, true, settings.chunkX, settings.chunkY, settings.chunkZ, background,
+                        settings.backend));
+      map->codec(codec, level);
+      Result load = run("load", 1, 1, [&](unsigned int, uint64_t, std::mt19937_64 &)
+      {
+        std::vector<const MapCell *> out;
+        for (int z = 0; z < settings.extentZ; z += settings.chunkZ)
+          map->getRegion(Box3D(Point3D(0, 0, z), Point3D(settings.extentX, settings.extentY,
+                                                         std::min<int>(z + settings.chunkZ, settings.extentZ))), out);
+      });
+      report(load, settings);
+    }
+
+    // Random writes over an area eight times larger with a small memory limit, pruning as the game would
+    map->memoryLimit(settings.pressureMB);
+    for (unsigned int threads : threadCounts(settings.threads))
+    {
+      Result prune = run("prune", threads, settings.ops / 4, [&](unsigned int t, uint64_t i, std::mt19937_64 & rng)
+      {
+        map->set(int(rng() % (settings.extentX * 8)), int(rng() % (settings.extentY * 8)),
+                 int(rng() % settings.extentZ), cells[rng() % cells.size()]);
+        if (t == 0 && i % 4096 == 0)
+          map->prune();
+      });
+      report(prune, settings);
+    }
+
+    map->save().wait();
+    map.reset();
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  po::options_description odesc("Usage");
+  odesc.add_options()
+    ("path", po::value<std::string>()->default_value("map-bench"), "directory the map is created in, its contents are erased")
+    ("backend", po::value<std::string>()->default_value(ADWIF_MAP_ENGINE),
+     ("map backend to measure: " + boost::algorithm::join(Map::backends(), ", ")).c_str())
+    ("chunk-size", po::value<std::string>()->default_value("64x64x16"), "chunk dimensions as XxYxZ")
+    ("codec", po::value<std::string>()->default_value(chunkCodecStr(defaultChunkCodec())),
+     "compression used for chunks: none, bzip2, lz4 or zstd, optionally followed by ':level'")
+    ("threads", po::value<unsigned int>()->default_value(boost::thread::hardware_concurrency()),
+     "largest thread count, workloads run at powers of two up to it")
+    ("ops", po::value<uint64_t>()->default_value(1000000), "operations per thread for the get and scan workloads")
+    ("extent", po::value<std::string>()->default_value("512x512x64"), "size of the area the workloads touch as XxYxZ")
+    ("cell-kinds", po::value<unsigned int>()->default_value(16), "number of distinct cells written")
+    ("pressure", po::value<unsigned long int>()->default_value(64), "memory limit in MB for the prune workload")
+    ("keep", "keep the map directory afterwards")
+    ("help", "show this help message");
+
+  try
+  {
+    po::store(po::parse_command_line(argc, argv, odesc), options);
+    po::notify(options);
+  }
+  catch (std::exception & e)
+  {
+    std::cerr << e.what() << "\n" << odesc << "\n";
+    return 1;
+  }
+
+  if (options.count("help"))
+  {
+    std::cout << odesc << "\n";
+    return 1;
+  }
+
+  Settings settings;
+  settings.path = options["path"].as<std::string>();
+  settings.backend = options["backend"].as<std::string>();
+  settings.threads = std::max(1u, options["threads"].as<unsigned int>());
+  settings.ops = std::max<uint64_t>(16, options["ops"].as<uint64_t>());
+  settings.cellKinds = options["cell-kinds"].as<unsigned int>();
+  settings.pressureMB = options["pressure"].as<unsigned long int>();
+
+  ChunkCodec codec;
+  int level = 0;
+  try
+  {
+    std::vector<std::string> chunk = split(options["chunk-size"].as<std::string>(), 'x');
+    std::vector<std::string> extent = split(options["extent"].as<std::string>(), 'x');
+    if (chunk.size() != 3 || extent.size() != 3)
+      throw std::invalid_argument("sizes have to be given as XxYxZ");
+    settings.chunkX = boost::lexical_cast<unsigned int>(chunk[0]);
+    settings.chunkY = boost::lexical_cast<unsigned int>(chunk[1]);
+    settings.chunkZ = boost::lexical_cast<unsigned int>(chunk[2]);
+    settings.extentX = boost::lexical_cast<int>(extent[0]);
+    settings.extentY = boost::lexical_cast<int>(extent[1]);
+    settings.extentZ = boost::lexical_cast<int>(extent[2]);
+    if (!settings.chunkX || !settings.chunkY || !settings.chunkZ ||
+        settings.extentX <= 0 || settings.extentY <= 0 || settings.extentZ <= 0)
+      throw std::invalid_argument("sizes have to be positive");
+
+    std::vector<std::string> parts = split(options["codec"].as<std::string>(), ':');
+    codec = strChunkCodec(parts.empty() ? std::string() : parts[0]);
+    level = parts.size() > 1 ? boost::lexical_cast<int>(parts[1]) : 0;
+  }
+  catch (std::exception & e)
+  {
+    std::cerr << e.what() << "\n";
+    return 1;
+  }
+
+  std::shared_ptr<Engine> engine(new Engine(nullptr, nullptr));
+  engine->logProvider(std::make_shared<QuietLogProvider>());
+
+  std::cout << boost::format("backend %s, chunks %ux%ux%u, codec %s:%d, extent %dx%dx%d\n") % settings.backend %
+    settings.chunkX % settings.chunkY % settings.chunkZ % chunkCodecStr(codec) % level % settings.extentX %
+    settings.extentY % settings.extentZ;
+
+  boost::filesystem::create_directories(settings.path);
+
+  try
+  {
+    benchmark(engine, settings, codec, level);
+  }
+  catch (std::exception & e)
+  {
+    std::cerr << "benchmark failed: " << e.what() << "\n";
+    return 1;
+  }
+
+  if (!options.count("keep"))
+    boost::filesystem::remove_all(settings.path);
+
+  return 0;
+}
@@ -122,6 +122,7 @@ namespace ADWIF
     virtual bool isAnchored() const = 0;
 
     virtual MapElement * clone() const = 0;
+    virtual bool equals(const MapElement & other) const = 0;
 
   private:
     template<class Archive>
@@ -244,6 +245,18 @@ namespace ADWIF
       myVolume -= e->volume();
     }
 
+    bool operator== (const MapCell & other) const
+    {
+      if (myGeneratedFlag != other.myGeneratedFlag || mySeenFlag != other.mySeenFlag || myTemp != other.myTemp ||
+          myPressure != other.myPressure || myVolume != other.myVolume || myElements.size() != other.myElements.size())
+        return false;
+      for (std::size_t i = 0; i < myElements.size(); i++)
+        if (!myElements[i]->equals(*other.myElements[i]))
+          return false;
+      return true;
+    }
+    bool operator!= (const MapCell & other) const { return !(*this == other); }
+
     uint64_t hash() const { return myCachedHash; }
 
     uint64_t calcHash() const {
@@ -331,6 +344,13 @@ namespace ADWIF
 
     virtual MapElement * clone() const { return new MaterialMapElement(*this); }
 
+    virtual bool equals(const MapElement & other) const
+    {
+      const MaterialMapElement * e = dynamic_cast<const MaterialMapElement *>(&other);
+      return e && material == e->material && element == e->element && vol == e->vol && wgt == e->wgt &&
+        symIdx == e->symIdx && state == e->state && anchored == e->anchored;
+    }
+
   private:
     template<class Archive>
     void serialize(Archive & ar, const unsigned int version)
@@ -0,0 +1,767 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mapchunk.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+
+namespace ADWIF
+{
+  namespace
+  {
+    // Palettes up to this size are searched linearly, larger ones through myLookup
+    const std::size_t paletteScanLimit = 16;
+
+    inline unsigned int bitsLog2(unsigned int bits)
+    {
+      unsigned int r = 0;
+      while ((1u << r) < bits)
+        r++;
+      return r;
+    }
+
+    inline uint64_t wordCount(uint64_t size, unsigned int bits)
+    {
+      return (size * bits + 63) / 64;
+    }
+
+    // Bricks are at most 8 cells wide along each axis, and never wider than the largest power of two dividing
+    // the chunk size so that they tile the chunk exactly
+    inline unsigned int brickLog2(unsigned int size)
+    {
+      unsigned int r = 0;
+      while (r < 3 && size && !(size & (1u << r)))
+        r++;
+      return r;
+    }
+
+    template <typename T>
+    void append(std::vector<char> & out, const T & value)
+    {
+      const char * p = reinterpret_cast<const char *>(&value);
+      out.insert(out.end(), p, p + sizeof(T));
+    }
+
+    template <typename T>
+    void extract(const char *& data, const char * end, T * out, std::size_t count = 1)
+    {
+      if (std::size_t(end - data) < sizeof(T) * count)
+        throw std::runtime_error("truncated paletted cell data");
+      std::memcpy(out, data, sizeof(T) * count);
+      data += sizeof(T) * count;
+    }
+  }
+
+  PalettedCells::PalettedCells(uint64_t size, uint64_t value): mySize(size), myBits(0), myBitsLog2(0),
+    myPalette(1, value), myLookup(), myWords() { }
+
+  void PalettedCells::set(uint64_t index, uint64_t value)
+  {
+    uint32_t paletteIndex;
+    if (myBits == 64)
+      myWords[index] = value;
+    else if (findIndex(value, paletteIndex))
+    {
+      if (myBits)
+        setIndex(index, paletteIndex);
+    }
+    else if (addIndex(value, paletteIndex))
+      setIndex(index, paletteIndex);
+    else
+      myWords[index] = value;
+  }
+
+  bool PalettedCells::setInPlace(uint64_t index, uint64_t value)
+  {
+    uint32_t paletteIndex;
+    if (myBits == 64)
+      myWords[index] = value;
+    else if (!findIndex(value, paletteIndex))
+      return false;
+    else if (myBits)
+      setIndex(index, paletteIndex);
+    return true;
+  }
+
+  bool PalettedCells::writeInPlace(uint64_t begin, uint64_t count, const uint64_t * values)
+  {
+    uint32_t paletteIndex;
+    if (myBits != 64)
+      for (uint64_t i = 0; i < count; i++)
+        if (!findIndex(values[i], paletteIndex))
+          return false;
+    for (uint64_t i = 0; i < count; i++)
+      setInPlace(begin + i, values[i]);
+    return true;
+  }
+
+  bool PalettedCells::fillInPlace(uint64_t begin, uint64_t count, uint64_t value)
+  {
+    uint32_t paletteIndex = 0;
+    if (myBits != 64 && !findIndex(value, paletteIndex))
+      return false;
+    if (myBits == 64)
+      std::fill_n(myWords.begin() + begin, count, value);
+    else if (myBits)
+      for (uint64_t i = begin; i < begin + count; i++)
+        setIndex(i, paletteIndex);
+    return true;
+  }
+
+  void PalettedCells::read(uint64_t begin, uint64_t count, uint64_t * out) const
+  {
+    switch (myBits)
+    {
+      case 0:
+        std::fill_n(out, count, myPalette[0]);
+        break;
+      case 64:
+        std::copy(myWords.begin() + begin, myWords.begin() + begin + count, out);
+        break;
+      default:
+        for (uint64_t i = 0; i < count; i++)
+          out[i] = myPalette[getIndex(begin + i)];
+    }
+  }
+
+  void PalettedCells::write(uint64_t begin, uint64_t count, const uint64_t * values)
+  {
+    for (uint64_t i = 0; i < count; i++)
+      set(begin + i, values[i]);
+  }
+
+  void PalettedCells::fill(uint64_t begin, uint64_t count, uint64_t value)
+  {
+    if (begin == 0 && count == mySize)
+    {
+      reset(value);
+      return;
+    }
+
+    uint32_t paletteIndex = 0;
+    if (myBits != 64 && !findIndex(value, paletteIndex))
+      addIndex(value, paletteIndex);
+
+    if (myBits == 64)
+      std::fill_n(myWords.begin() + begin, count, value);
+    else if (myBits)
+      for (uint64_t i = begin; i < begin + count; i++)
+        setIndex(i, paletteIndex);
+  }
+
+  void PalettedCells::compact()
+  {
+    if (!mySize || myBits == 0 || myBits == 64)
+      return;
+
+    std::vector<bool> used(myPalette.size(), false);
+    std::size_t usedCount = 0;
+    for (uint64_t i = 0; i < mySize && usedCount < myPalette.size(); i++)
+    {
+      uint32_t paletteIndex = getIndex(i);
+      if (!used[paletteIndex])
+      {
+        used[paletteIndex] = true;
+        usedCount++;
+      }
+    }
+
+    if (usedCount == myPalette.size())
+      return;
+
+    PalettedCells packed(mySize, get(0));
+    for (uint64_t i = 1; i < mySize; i++)
+      packed.set(i, get(i));
+    *this = std::move(packed);
+  }
+
+  void PalettedCells::values(std::vector<uint64_t> & out) const
+  {
+    if (myBits == 64)
+      out.insert(out.end(), myWords.begin(), myWords.end());
+    else
+      out.insert(out.end(), myPalette.begin(), myPalette.end());
+  }
+
+  std::size_t PalettedCells::memoryUsage() const
+  {
+    return sizeof(PalettedCells) + (myPalette.capacity() + myWords.capacity()) * sizeof(uint64_t) +
+      myLookup.bucket_count() * sizeof(void *) +
+      myLookup.size() * (sizeof(std::pair<const uint64_t, uint32_t>) + sizeof(void *) * 2);
+  }
+
+  void PalettedCells::serialise(std::vector<char> & out) const
+  {
+    out.clear();
+    out.reserve(sizeof(uint64_t) * (2 + myPalette.size() + myWords.size()));
+    append(out, mySize);
+    append(out, uint8_t(myBits));
+    append(out, uint32_t(myBits == 64 ? 0 : myPalette.size()));
+    if (myBits != 64)
+      out.insert(out.end(), reinterpret_cast<const char *>(myPalette.data()),
+                 reinterpret_cast<const char *>(myPalette.data() + myPalette.size()));
+    out.insert(out.end(), reinterpret_cast<const char *>(myWords.data()),
+               reinterpret_cast<const char *>(myWords.data() + myWords.size()));
+  }
+
+  void PalettedCells::deserialise(const char * data, std::size_t size)
+  {
+    const char * end = data + size;
+    uint64_t cells;
+    uint8_t bits;
+    uint32_t paletteSize;
+
+    extract(data, end, &cells);
+    extract(data, end, &bits);
+    extract(data, end, &paletteSize);
+
+    if ((bits != 0 && bits != 1 && bits != 2 && bits != 4 && bits != 8 && bits != 16 && bits != 64) ||
+        (bits == 0 && paletteSize != 1) || (bits == 64 && paletteSize != 0) ||
+        (bits != 0 && bits != 64 && (paletteSize == 0 || paletteSize > (uint32_t(1) << bits))))
+      throw std::runtime_error("malformed paletted cell data");
+
+    PalettedCells cellData;
+    cellData.mySize = cells;
+    cellData.myBits = bits;
+    cellData.myBitsLog2 = bitsLog2(bits);
+    cellData.myPalette.resize(paletteSize);
+    extract(data, end, cellData.myPalette.data(), paletteSize);
+    cellData.myWords.resize(wordCount(cells, bits));
+    extract(data, end, cellData.myWords.data(), cellData.myWords.size());
+
+    if (paletteSize > paletteScanLimit)
+      for (uint32_t i = 0; i < paletteSize; i++)
+        cellData.myLookup[cellData.myPalette[i]] = i;
+
+    *this = std::move(cellData);
+  }
+
+  bool PalettedCells::findIndex(uint64_t value, uint32_t & paletteIndex) const
+  {
+    if (myPalette.size() > paletteScanLimit)
+    {
+      auto i = myLookup.find(value);
+      if (i == myLookup.end())
+        return false;
+      paletteIndex = i->second;
+      return true;
+    }
+
+    for (uint32_t i = 0; i < myPalette.size(); i++)
+      if (myPalette[i] == value)
+      {
+        paletteIndex = i;
+        return true;
+      }
+    return false;
+  }
+
+  bool PalettedCells::addIndex(uint64_t value, uint32_t & paletteIndex)
+  {
+    if (myPalette.size() >= (std::size_t(1) << myBits))
+    {
+      const unsigned int bits = myBits ? myBits * 2 : 1;
+      if (bits > 16)
+      {
+        repack(64);
+        return false;
+      }
+      repack(bits);
+    }
+
+    paletteIndex = myPalette.size();
+    myPalette.push_back(value);
+
+    if (myPalette.size() == paletteScanLimit + 1)
+      for (uint32_t i = 0; i < myPalette.size(); i++)
+        myLookup[myPalette[i]] = i;
+    else if (myPalette.size() > paletteScanLimit + 1)
+      myLookup[value] = paletteIndex;
+
+    return true;
+  }
+
+  void PalettedCells::repack(unsigned int bits)
+  {
+    PalettedCells packed;
+    packed.mySize = mySize;
+    packed.myBits = bits;
+    packed.myBitsLog2 = bitsLog2(bits);
+    packed.myWords.assign(wordCount(mySize, bits), 0);
+
+    if (bits == 64)
+    {
+      packed.myPalette.clear();
+      for (uint64_t i = 0; i < mySize; i++)
+        packed.myWords[i] = get(i);
+    }
+    else
+    {
+      if (myBits)
+        for (uint64_t i = 0; i < mySize; i++)
+          packed.setIndex(i, getIndex(i));
+      packed.myPalette = std::move(myPalette);
+      packed.myLookup = std::move(myLookup);
+    }
+
+    *this = std::move(packed);
+  }
+
+  void PalettedCells::reset(uint64_t value)
+  {
+    myBits = 0;
+    myBitsLog2 = 0;
+    myPalette.assign(1, value);
+    myLookup.clear();
+    std::vector<uint64_t>().swap(myWords);
+  }
+
+  ChunkCells::ChunkCells(unsigned int sizeX, unsigned int sizeY, unsigned int sizeZ, uint64_t value):
+    mySizeX(sizeX), mySizeY(sizeY), mySizeZ(sizeZ), myBrickLog2X(brickLog2(sizeX)), myBrickLog2Y(brickLog2(sizeY)),
+    myBrickLog2Z(brickLog2(sizeZ)), myBrickMaskX((1u << myBrickLog2X) - 1), myBrickMaskY((1u << myBrickLog2Y) - 1),
+    myBrickMaskZ((1u << myBrickLog2Z) - 1), myBricksX(sizeX >> myBrickLog2X), myBricksY(sizeY >> myBrickLog2Y),
+    myBricksZ(sizeZ >> myBrickLog2Z), myValue(value), myBrickValues(), myBricks(), myBrickMemory(0) { }
+
+  ChunkCells::ChunkCells(const ChunkCells & other): mySizeX(other.mySizeX), mySizeY(other.mySizeY),
+    mySizeZ(other.mySizeZ), myBrickLog2X(other.myBrickLog2X), myBrickLog2Y(other.myBrickLog2Y),
+    myBrickLog2Z(other.myBrickLog2Z), myBrickMaskX(other.myBrickMaskX), myBrickMaskY(other.myBrickMaskY),
+    myBrickMaskZ(other.myBrickMaskZ), myBricksX(other.myBricksX), myBricksY(other.myBricksY),
+    myBricksZ(other.myBricksZ), myValue(other.myValue), myBrickValues(other.myBrickValues),
+    myBricks(other.myBricks.size()), myBrickMemory(other.myBrickMemory)
+  {
+    for (std::size_t i = 0; i < myBricks.size(); i++)
+      if (other.myBricks[i])
+        myBricks[i].reset(new PalettedCells(*other.myBricks[i]));
+  }
+
+  void ChunkCells::set(unsigned int x, unsigned int y, unsigned int z, uint64_t value)
+  {
+    if (uniform())
+    {
+      if (value == myValue)
+        return;
+      split();
+    }
+
+    const unsigned int brick = brickIndex(x, y, z);
+    PalettedCells * cells = myBricks[brick].get();
+    if (!cells)
+    {
+      if (myBrickValues[brick] == value)
+        return;
+      cells = &expand(brick);
+    }
+
+    const std::size_t before = cells->memoryUsage();
+    cells->set(cellIndex(x, y, z), value);
+    myBrickMemory += cells->memoryUsage() - before;
+  }
+
+  bool ChunkCells::setShared(unsigned int x, unsigned int y, unsigned int z, uint64_t value,
+                             std::unique_ptr<PalettedCells> & retired)
+  {
+    if (uniform())
+      return value == myValue;
+
+    const unsigned int brick = brickIndex(x, y, z);
+    PalettedCells * cells = myBricks[brick].get();
+    if (!cells && myBrickValues[brick] == value)
+      return true;
+    if (cells && cells->setInPlace(cellIndex(x, y, z), value))
+      return true;
+
+    // the brick is fully built before it is published
+    std::unique_ptr<PalettedCells> rebuilt(cells ? new PalettedCells(*cells) :
+      new PalettedCells(uint64_t(1) << (myBrickLog2X + myBrickLog2Y + myBrickLog2Z), myBrickValues[brick]));
+    rebuilt->set(cellIndex(x, y, z), value);
+    myBrickMemory += rebuilt->memoryUsage() - (cells ? cells->memoryUsage() : 0);
+    std::atomic_thread_fence(std::memory_order_release);
+    retired.reset(myBricks[brick].release());
+    myBricks[brick] = std::move(rebuilt);
+    return true;
+  }
+
+  void ChunkCells::readRow(unsigned int x, unsigned int y, unsigned int z, unsigned int count, uint64_t * out) const
+  {
+    if (uniform())
+    {
+      std::fill_n(out, count, myValue);
+      return;
+    }
+
+    while (count)
+    {
+      const unsigned int n = std::min(count, (myBrickMaskX + 1) - (x & myBrickMaskX));
+      const unsigned int brick = brickIndex(x, y, z);
+      if (myBricks[brick])
+        myBricks[brick]->read(cellIndex(x, y, z), n, out);
+      else
+        std::fill_n(out, n, myBrickValues[brick]);
+      x += n;
+      out += n;
+      count -= n;
+    }
+  }
+
+  void ChunkCells::writeRow(unsigned int x, unsigned int y, unsigned int z, unsigned int count, const uint64_t * values)
+  {
+    if (uniform())
+    {
+      if (std::all_of(values, values + count, [&](uint64_t v) { return v == myValue; }))
+        return;
+      split();
+    }
+
+    while (count)
+    {
+      const unsigned int n = std::min(count, (myBrickMaskX + 1) - (x & myBrickMaskX));
+      const unsigned int brick = brickIndex(x, y, z);
+      PalettedCells * cells = myBricks[brick].get();
+      const uint64_t brickValue = myBrickValues[brick];
+      if (cells || !std::all_of(values, values + n, [&](uint64_t v) { return v == brickValue; }))
+      {
+        if (!cells)
+          cells = &expand(brick);
+        const std::size_t before = cells->memoryUsage();
+        cells->write(cellIndex(x, y, z), n, values);
+        myBrickMemory += cells->memoryUsage() - before;
+      }
+      x += n;
+      values += n;
+      count -= n;
+    }
+  }
+
+  void ChunkCells::fill(unsigned int minX, unsigned int minY, unsigned int minZ,
+                        unsigned int maxX, unsigned int maxY, unsigned int maxZ, uint64_t value)
+  {
+    if (minX >= maxX || minY >= maxY || minZ >= maxZ)
+      return;
+
+    if (!minX && !minY && !minZ && maxX == mySizeX && maxY == mySizeY && maxZ == mySizeZ)
+    {
+      reset(value);
+      return;
+    }
+
+    if (uniform())
+    {
+      if (value == myValue)
+        return;
+      split();
+    }
+
+    for (unsigned int bz = minZ >> myBrickLog2Z; bz <= (maxZ - 1) >> myBrickLog2Z; bz++)
+      for (unsigned int by = minY >> myBrickLog2Y; by <= (maxY - 1) >> myBrickLog2Y; by++)
+        for (unsigned int bx = minX >> myBrickLog2X; bx <= (maxX - 1) >> myBrickLog2X; bx++)
+        {
+          const unsigned int x0 = std::max(minX, bx << myBrickLog2X), x1 = std::min(maxX, (bx + 1) << myBrickLog2X);
+          const unsigned int y0 = std::max(minY, by << myBrickLog2Y), y1 = std::min(maxY, (by + 1) << myBrickLog2Y);
+          const unsigned int z0 = std::max(minZ, bz << myBrickLog2Z), z1 = std::min(maxZ, (bz + 1) << myBrickLog2Z);
+          const unsigned int brick = (bz * myBricksY + by) * myBricksX + bx;
+
+          if (x1 - x0 == myBrickMaskX + 1 && y1 - y0 == myBrickMaskY + 1 && z1 - z0 == myBrickMaskZ + 1)
+          {
+            dropBrick(brick, value);
+            continue;
+          }
+
+          PalettedCells * cells = myBricks[brick].get();
+          if (!cells)
+          {
+            if (myBrickValues[brick] == value)
+              continue;
+            cells = &expand(brick);
+          }
+
+          const std::size_t before = cells->memoryUsage();
+          for (unsigned int z = z0; z < z1; z++)
+            for (unsigned int y = y0; y < y1; y++)
+              cells->fill(cellIndex(x0, y, z), x1 - x0, value);
+          myBrickMemory += cells->memoryUsage() - before;
+        }
+  }
+
+  bool ChunkCells::writeRowShared(unsigned int x, unsigned int y, unsigned int z, unsigned int count,
+                                  const uint64_t * values, std::vector<std::unique_ptr<PalettedCells>> & retired)
+  {
+    if (uniform())
+      return std::all_of(values, values + count, [&](uint64_t v) { return v == myValue; });
+
+    while (count)
+    {
+      const unsigned int n = std::min(count, (myBrickMaskX + 1) - (x & myBrickMaskX));
+      const unsigned int brick = brickIndex(x, y, z);
+      PalettedCells * cells = myBricks[brick].get();
+      const uint64_t brickValue = myBrickValues[brick];
+      if (cells ? !cells->writeInPlace(cellIndex(x, y, z), n, values) :
+          !std::all_of(values, values + n, [&](uint64_t v) { return v == brickValue; }))
+      {
+        std::unique_ptr<PalettedCells> rebuilt = copyBrick(brick);
+        rebuilt->write(cellIndex(x, y, z), n, values);
+        publishBrick(brick, std::move(rebuilt), retired);
+      }
+      x += n;
+      values += n;
+      count -= n;
+    }
+    return true;
+  }
+
+  bool ChunkCells::fillShared(unsigned int minX, unsigned int minY, unsigned int minZ,
+                              unsigned int maxX, unsigned int maxY, unsigned int maxZ, uint64_t value,
+                              std::vector<std::unique_ptr<PalettedCells>> & retired)
+  {
+    if (minX >= maxX || minY >= maxY || minZ >= maxZ)
+      return true;
+    if (uniform())
+      return value == myValue;
+
+    for (unsigned int bz = minZ >> myBrickLog2Z; bz <= (maxZ - 1) >> myBrickLog2Z; bz++)
+      for (unsigned int by = minY >> myBrickLog2Y; by <= (maxY - 1) >> myBrickLog2Y; by++)
+        for (unsigned int bx = minX >> myBrickLog2X; bx <= (maxX - 1) >> myBrickLog2X; bx++)
+        {
+          const unsigned int x0 = std::max(minX, bx << myBrickLog2X), x1 = std::min(maxX, (bx + 1) << myBrickLog2X);
+          const unsigned int y0 = std::max(minY, by << myBrickLog2Y), y1 = std::min(maxY, (by + 1) << myBrickLog2Y);
+          const unsigned int z0 = std::max(minZ, bz << myBrickLog2Z), z1 = std::min(maxZ, (bz + 1) << myBrickLog2Z);
+          const unsigned int brick = (bz * myBricksY + by) * myBricksX + bx;
+          PalettedCells * cells = myBricks[brick].get();
+
+          if (x1 - x0 == myBrickMaskX + 1 && y1 - y0 == myBrickMaskY + 1 && z1 - z0 == myBrickMaskZ + 1)
+          {
+            // the value is in place before readers stop finding the brick
+            myBrickValues[brick] = value;
+            if (cells)
+              publishBrick(brick, std::unique_ptr<PalettedCells>(), retired);
+            continue;
+          }
+
+          if (!cells && myBrickValues[brick] == value)
+            continue;
+          bool inPlace = cells != nullptr;
+          for (unsigned int z = z0; z < z1 && inPlace; z++)
+            for (unsigned int y = y0; y < y1 && inPlace; y++)
+              inPlace = cells->fillInPlace(cellIndex(x0, y, z), x1 - x0, value);
+          if (inPlace)
+            continue;
+
+          std::unique_ptr<PalettedCells> rebuilt = copyBrick(brick);
+          for (unsigned int z = z0; z < z1; z++)
+            for (unsigned int y = y0; y < y1; y++)
+              rebuilt->fill(cellIndex(x0, y, z), x1 - x0, value);
+          publishBrick(brick, std::move(rebuilt), retired);
+        }
+    return true;
+  }
+
+  void ChunkCells::compact()
+  {
+    if (uniform())
+      return;
+
+    bool collapse = true;
+    for (unsigned int brick = 0; brick < myBricks.size(); brick++)
+    {
+      if (PalettedCells * cells = myBricks[brick].get())
+      {
+        const std::size_t before = cells->memoryUsage();
+        cells->compact();
+        myBrickMemory += cells->memoryUsage() - before;
+        if (cells->uniform())
+          dropBrick(brick, cells->get(0));
+      }
+      collapse = collapse && !myBricks[brick] && myBrickValues[brick] == myBrickValues[0];
+    }
+
+    if (collapse)
+      reset(myBrickValues[0]);
+  }
+
+  void ChunkCells::values(std::vector<uint64_t> & out) const
+  {
+    if (uniform())
+    {
+      out.push_back(myValue);
+      return;
+    }
+    for (unsigned int brick = 0; brick < myBricks.size(); brick++)
+    {
+      if (myBricks[brick])
+        myBricks[brick]->values(out);
+      else
+        out.push_back(myBrickValues[brick]);
+    }
+  }
+
+  std::size_t ChunkCells::memoryUsage() const
+  {
+    return sizeof(ChunkCells) + myBrickValues.capacity() * sizeof(uint64_t) +
+      myBricks.capacity() * sizeof(std::unique_ptr<PalettedCells>) + myBrickMemory;
+  }
+
+  void ChunkCells::serialise(std::vector<char> & out) const
+  {
+    std::vector<char> brickData;
+    out.clear();
+    append(out, uint32_t(mySizeX));
+    append(out, uint32_t(mySizeY));
+    append(out, uint32_t(mySizeZ));
+    append(out, uint8_t(uniform()));
+    if (uniform())
+    {
+      append(out, myValue);
+      return;
+    }
+    for (unsigned int brick = 0; brick < myBricks.size(); brick++)
+    {
+      if (myBricks[brick])
+      {
+        myBricks[brick]->serialise(brickData);
+        append(out, uint8_t(1));
+        append(out, uint32_t(brickData.size()));
+        out.insert(out.end(), brickData.begin(), brickData.end());
+      }
+      else
+      {
+        append(out, uint8_t(0));
+        append(out, myBrickValues[brick]);
+      }
+    }
+  }
+
+  void ChunkCells::deserialise(const char * data, std::size_t size)
+  {
+    const char * end = data + size;
+    uint32_t sizeX, sizeY, sizeZ;
+    uint8_t isUniform;
+    uint64_t value = 0;
+
+    extract(data, end, &sizeX);
+    extract(data, end, &sizeY);
+    extract(data, end, &sizeZ);
+    extract(data, end, &isUniform);
+
+    ChunkCells cells(sizeX, sizeY, sizeZ);
+    if (isUniform)
+    {
+      extract(data, end, &value);
+      cells.reset(value);
+    }
+    else
+    {
+      cells.split();
+      const uint64_t brickCellCount = uint64_t(1) << (cells.myBrickLog2X + cells.myBrickLog2Y + cells.myBrickLog2Z);
+      for (unsigned int brick = 0; brick < cells.myBricks.size(); brick++)
+      {
+        uint8_t kind;
+        extract(data, end, &kind);
+        if (kind)
+        {
+          uint32_t length;
+          extract(data, end, &length);
+          if (std::size_t(end - data) < length)
+            throw std::runtime_error("truncated chunk cell data");
+          std::unique_ptr<PalettedCells> brickCells(new PalettedCells);
+          brickCells->deserialise(data, length);
+          if (brickCells->size() != brickCellCount)
+            throw std::runtime_error("malformed chunk cell data");
+          data += length;
+          cells.myBrickMemory += brickCells->memoryUsage();
+          cells.myBricks[brick] = std::move(brickCells);
+        }
+        else
+          extract(data, end, &cells.myBrickValues[brick]);
+      }
+    }
+
+    std::swap(mySizeX, cells.mySizeX);
+    std::swap(mySizeY, cells.mySizeY);
+    std::swap(mySizeZ, cells.mySizeZ);
+    std::swap(myBrickLog2X, cells.myBrickLog2X);
+    std::swap(myBrickLog2Y, cells.myBrickLog2Y);
+    std::swap(myBrickLog2Z, cells.myBrickLog2Z);
+    std::swap(myBrickMaskX, cells.myBrickMaskX);
+    std::swap(myBrickMaskY, cells.myBrickMaskY);
+    std::swap(myBrickMaskZ, cells.myBrickMaskZ);
+    std::swap(myBricksX, cells.myBricksX);
+    std::swap(myBricksY, cells.myBricksY);
+    std::swap(myBricksZ, cells.myBricksZ);
+    std::swap(myValue, cells.myValue);
+    std::swap(myBrickValues, cells.myBrickValues);
+    std::swap(myBricks, cells.myBricks);
+    std::swap(myBrickMemory, cells.myBrickMemory);
+  }
+
+  void ChunkCells::reset(uint64_t value)
+  {
+    myValue = value;
+    std::vector<uint64_t>().swap(myBrickValues);
+    std::vector<std::unique_ptr<PalettedCells>>().swap(myBricks);
+    myBrickMemory = 0;
+  }
+
+  void ChunkCells::split()
+  {
+    const std::size_t count = std::size_t(myBricksX) * myBricksY * myBricksZ;
+    myBrickValues.assign(count, myValue);
+    myBricks.clear();
+    myBricks.resize(count);
+    myBrickMemory = 0;
+  }
+
+  std::unique_ptr<PalettedCells> ChunkCells::copyBrick(unsigned int brick) const
+  {
+    if (myBricks[brick])
+      return std::unique_ptr<PalettedCells>(new PalettedCells(*myBricks[brick]));
+    return std::unique_ptr<PalettedCells>(new PalettedCells(
+      uint64_t(1) << (myBrickLog2X + myBrickLog2Y + myBrickLog2Z), myBrickValues[brick]));
+  }
+
+  void ChunkCells::publishBrick(unsigned int brick, std::unique_ptr<PalettedCells> cells,
+                                std::vector<std::unique_ptr<PalettedCells>> & retired)
+  {
+    myBrickMemory += (cells ? cells->memoryUsage() : 0) - (myBricks[brick] ? myBricks[brick]->memoryUsage() : 0);
+    // the brick is fully built before it is published
+    std::atomic_thread_fence(std::memory_order_release);
+    myBricks[brick].swap(cells);
+    if (cells)
+      retired.push_back(std::move(cells));
+  }
+
+  PalettedCells & ChunkCells::expand(unsigned int brick)
+  {
+    myBricks[brick].reset(new PalettedCells(uint64_t(1) << (myBrickLog2X + myBrickLog2Y + myBrickLog2Z),
+                                            myBrickValues[brick]));
+    myBrickMemory += myBricks[brick]->memoryUsage();
+    return *myBricks[brick];
+  }
+
+  void ChunkCells::dropBrick(unsigned int brick, uint64_t value)
+  {
+    if (myBricks[brick])
+    {
+      myBrickMemory -= myBricks[brick]->memoryUsage();
+      myBricks[brick].reset();
+    }
+    myBrickValues[brick] = value;
+  }
+}
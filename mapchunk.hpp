@@ -0,0 +1,197 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MAPCHUNK_H
+#define MAPCHUNK_H
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace ADWIF
+{
+  // Cell hashes for one chunk, stored as a local palette of distinct hashes plus indices packed into 0, 1, 2, 4, 8
+  // or 16 bits. The index width grows as the palette does; past 65536 distinct cells the hashes are stored directly.
+  class PalettedCells
+  {
+  public:
+    PalettedCells(uint64_t size = 0, uint64_t value = 0);
+
+    uint64_t size() const { return mySize; }
+    unsigned int bits() const { return myBits; }
+    bool uniform() const { return myBits == 0; }
+    std::size_t paletteSize() const { return myPalette.size(); }
+
+    inline uint64_t get(uint64_t index) const
+    {
+      switch (myBits)
+      {
+        case 0: return myPalette[0];
+        case 64: return myWords[index];
+        default: return myPalette[getIndex(index)];
+      }
+    }
+
+    void set(uint64_t index, uint64_t value);
+    // Sets a cell only if that needs no new palette entry, so nothing is reallocated. Returns false otherwise.
+    bool setInPlace(uint64_t index, uint64_t value);
+    // Like write() and fill(), but only if no new palette entry is needed. Return false, writing nothing, otherwise.
+    bool writeInPlace(uint64_t begin, uint64_t count, const uint64_t * values);
+    bool fillInPlace(uint64_t begin, uint64_t count, uint64_t value);
+
+    void read(uint64_t begin, uint64_t count, uint64_t * out) const;
+    void write(uint64_t begin, uint64_t count, const uint64_t * values);
+    void fill(uint64_t begin, uint64_t count, uint64_t value);
+
+    // Drops palette entries that are no longer referenced and narrows the indices to match
+    void compact();
+    // Appends the values held, possibly more than once and, short of compact(), some that no cell holds anymore
+    void values(std::vector<uint64_t> & out) const;
+
+    std::size_t memoryUsage() const;
+
+    void serialise(std::vector<char> & out) const;
+    void deserialise(const char * data, std::size_t size);
+
+  private:
+    inline uint32_t getIndex(uint64_t index) const
+    {
+      const unsigned int shift = 6 - myBitsLog2;
+      const unsigned int offset = (index & ((uint64_t(1) << shift) - 1)) << myBitsLog2;
+      return (myWords[index >> shift] >> offset) & ((uint64_t(1) << myBits) - 1);
+    }
+
+    inline void setIndex(uint64_t index, uint32_t paletteIndex)
+    {
+      const unsigned int shift = 6 - myBitsLog2;
+      const unsigned int offset = (index & ((uint64_t(1) << shift) - 1)) << myBitsLog2;
+      const uint64_t mask = ((uint64_t(1) << myBits) - 1) << offset;
+      uint64_t & word = myWords[index >> shift];
+      word = (word & ~mask) | (uint64_t(paletteIndex) << offset);
+    }
+
+    bool findIndex(uint64_t value, uint32_t & paletteIndex) const;
+    // Adds value to the palette, widening the indices when needed. Returns false if storage became direct instead.
+    bool addIndex(uint64_t value, uint32_t & paletteIndex);
+    void repack(unsigned int bits);
+    void reset(uint64_t value);
+
+  private:
+    uint64_t mySize;
+    unsigned int myBits;
+    unsigned int myBitsLog2;
+    std::vector<uint64_t> myPalette;
+    std::unordered_map<uint64_t, uint32_t> myLookup; // only kept for palettes too large to scan
+    std::vector<uint64_t> myWords;
+  };
+
+  // The cells of a whole chunk split into bricks of up to 8x8x8. A brick holding a single value is stored as just that
+  // value and only expanded into PalettedCells on the first write that differs, and a chunk that is entirely uniform
+  // allocates no bricks at all. Coordinates are local to the chunk.
+  class ChunkCells
+  {
+  public:
+    ChunkCells(unsigned int sizeX = 0, unsigned int sizeY = 0, unsigned int sizeZ = 0, uint64_t value = 0);
+    ChunkCells(const ChunkCells & other);
+
+    unsigned int sizeX() const { return mySizeX; }
+    unsigned int sizeY() const { return mySizeY; }
+    unsigned int sizeZ() const { return mySizeZ; }
+
+    bool uniform() const { return myBrickValues.empty(); }
+    uint64_t uniformValue() const { return myValue; }
+
+    inline uint64_t get(unsigned int x, unsigned int y, unsigned int z) const
+    {
+      if (uniform())
+        return myValue;
+      const unsigned int brick = brickIndex(x, y, z);
+      return myBricks[brick] ? myBricks[brick]->get(cellIndex(x, y, z)) : myBrickValues[brick];
+    }
+
+    void set(unsigned int x, unsigned int y, unsigned int z, uint64_t value);
+    // Like set(), but safe against readers running concurrently with it: memory they may be reading is never freed
+    // or reallocated. A brick that has to change layout is rebuilt and the old one handed back through 'retired',
+    // to be destroyed once those readers are done. Returns false, without modifying anything, when the chunk itself
+    // would have to be split; the caller then has to write to a copy instead.
+    bool setShared(unsigned int x, unsigned int y, unsigned int z, uint64_t value,
+                   std::unique_ptr<PalettedCells> & retired);
+
+    // Reads or writes 'count' cells along x starting at x, y, z
+    void readRow(unsigned int x, unsigned int y, unsigned int z, unsigned int count, uint64_t * out) const;
+    void writeRow(unsigned int x, unsigned int y, unsigned int z, unsigned int count, const uint64_t * values);
+    // Fills the box between the min and (exclusive) max corners
+    void fill(unsigned int minX, unsigned int minY, unsigned int minZ,
+              unsigned int maxX, unsigned int maxY, unsigned int maxZ, uint64_t value);
+    // Like writeRow() and fill(), but safe against concurrent readers the way setShared() is. Bricks are written in
+    // place where their palettes allow it, any other brick that changes is rebuilt and the old one appended to
+    // 'retired'. Return false, without modifying anything, when the chunk itself would have to be split.
+    bool writeRowShared(unsigned int x, unsigned int y, unsigned int z, unsigned int count, const uint64_t * values,
+                        std::vector<std::unique_ptr<PalettedCells>> & retired);
+    bool fillShared(unsigned int minX, unsigned int minY, unsigned int minZ,
+                    unsigned int maxX, unsigned int maxY, unsigned int maxZ, uint64_t value,
+                    std::vector<std::unique_ptr<PalettedCells>> & retired);
+
+    // Collapses bricks, and the chunk itself, back to single values where possible
+    void compact();
+    // Appends the values held, as PalettedCells::values() does
+    void values(std::vector<uint64_t> & out) const;
+
+    std::size_t memoryUsage() const;
+
+    void serialise(std::vector<char> & out) const;
+    void deserialise(const char * data, std::size_t size);
+
+  private:
+    ChunkCells & operator=(const ChunkCells &);
+
+    inline unsigned int brickIndex(unsigned int x, unsigned int y, unsigned int z) const
+    {
+      return ((z >> myBrickLog2Z) * myBricksY + (y >> myBrickLog2Y)) * myBricksX + (x >> myBrickLog2X);
+    }
+
+    inline unsigned int cellIndex(unsigned int x, unsigned int y, unsigned int z) const
+    {
+      return ((z & myBrickMaskZ) << (myBrickLog2X + myBrickLog2Y)) | ((y & myBrickMaskY) << myBrickLog2X) |
+        (x & myBrickMaskX);
+    }
+
+    void reset(uint64_t value);
+    void split();
+    PalettedCells & expand(unsigned int brick);
+    void dropBrick(unsigned int brick, uint64_t value);
+    // A private copy of a brick to be written to and then published in its place, readers never see it half built
+    std::unique_ptr<PalettedCells> copyBrick(unsigned int brick) const;
+    void publishBrick(unsigned int brick, std::unique_ptr<PalettedCells> cells,
+                      std::vector<std::unique_ptr<PalettedCells>> & retired);
+
+  private:
+    unsigned int mySizeX, mySizeY, mySizeZ;
+    unsigned int myBrickLog2X, myBrickLog2Y, myBrickLog2Z;
+    unsigned int myBrickMaskX, myBrickMaskY, myBrickMaskZ;
+    unsigned int myBricksX, myBricksY, myBricksZ;
+    uint64_t myValue;
+    std::vector<uint64_t> myBrickValues;
+    std::vector<std::unique_ptr<PalettedCells>> myBricks;
+    std::size_t myBrickMemory;
+  };
+}
+
+#endif // MAPCHUNK_H
@@ -85,8 +85,23 @@ namespace ADWIF
 
       int counter = 0;
 
+      // keep the area and the chunks around it resident while it is generated
+      const std::shared_ptr<Map> map = generator()->game()->map();
+      const int marginX = generator()->chunkSizeX();
+      const int marginY = generator()->chunkSizeY();
+      const int marginZ = generator()->chunkSizeZ();
+      const Map::PinHandle pin = map->pin(Box3D(Point3D(myX - marginX, myY - marginY, myZ - myDepth + 1 - marginZ),
+                                                Point3D(myX + myWidth + marginX, myY + myHeight + marginY,
+                                                        myZ + 1 + marginZ)));
+
+      std::vector<const MapCell *> current;
+      std::vector<MapCell> layer;
+
       for (int z = myZ; z > myZ - myDepth; z--)
       {
+        // Each layer is read and written back in bulk, but only once a cell in it actually needs generating
+        const Box3D layerBox(Point3D(myX, myY, z), Point3D(myX + myWidth, myY + myHeight, z + 1));
+        layer.clear();
         for (unsigned int y = myY; y < myY + myHeight; y++)
         {
           for (unsigned int x = myX; x < myX + myWidth; x++)
@@ -103,9 +118,20 @@ namespace ADWIF
             }
             int height = generator()->getHeight(x, y);
             if (z <= 0 || z <= height + 1)
-              generateCell(x, y, z, height);
+            {
+              if (layer.empty())
+              {
+                map->getRegion(layerBox, current);
+                layer.reserve(current.size());
+                for (const MapCell * cell : current)
+                  layer.push_back(*cell);
+              }
+              generateCell(x, y, z, height, layer[(y - myY) * myWidth + (x - myX)]);
+            }
           }
         }
+        if (!layer.empty())
+          writeLayer(*map, z, current, layer);
       }
 
       generator()->game()->engine()->log("GenerateAreaTask"),
@@ -117,6 +143,46 @@ namespace ADWIF
       generator()->notifyComplete(shared_from_this());
     }
 
+    // Writes back only the runs of cells generation changed, so chunks it left alone are not marked dirty
+    void writeLayer(Map & map, int z, const std::vector<const MapCell *> & current, const std::vector<MapCell> & layer)
+    {
+      std::size_t changed = 0;
+      for (std::size_t i = 0; i < layer.size(); i++)
+        if (layer[i] != *current[i])
+          changed++;
+      if (!changed)
+        return;
+      if (changed == layer.size())
+      {
+        map.setRegion(Box3D(Point3D(myX, myY, z), Point3D(myX + myWidth, myY + myHeight, z + 1)), layer);
+        return;
+      }
+
+      for (int y = 0; y < myHeight; y++)
+      {
+        const std::size_t row = std::size_t(y) * myWidth;
+        int x = 0;
+        while (x < myWidth)
+        {
+          if (layer[row + x] == *current[row + x])
+          {
+            x++;
+            continue;
+          }
+          int end = x + 1;
+          bool uniform = true;
+          for (; end < myWidth && layer[row + end] != *current[row + end]; end++)
+            uniform = uniform && layer[row + end] == layer[row + x];
+          const Box3D run(Point3D(myX + x, myY + y, z), Point3D(myX + end, myY + y + 1, z + 1));
+          if (uniform)
+            map.fill(run, layer[row + x]);
+          else
+            map.setRegion(run, std::vector<MapCell>(layer.begin() + row + x, layer.begin() + row + end));
+          x = end;
+        }
+      }
+    }
+
     std::pair<Material*,MaterialState> getMaterial(int x, int y, int z, int height, Biome * biome)
     {
       std::vector<std::string> possible;
@@ -143,10 +209,8 @@ namespace ADWIF
       return std::make_pair(generator()->game()->materials()[material], state);
     }
 
-    void generateCell(int x, int y, int z, int height)
+    void generateCell(int x, int y, int z, int height, MapCell & c)
     {
-      MapCell c(generator()->game()->map()->get(x, y, z));
-
       if (c.generated() && !myRegenFlag)
         return;
 
@@ -242,8 +306,6 @@ namespace ADWIF
 
       if (mat)
         c.addElement(mat);
-
-      generator()->game()->map()->set(x, y, z, c);
     }
 
     bool done() const { return myDoneFlag.load(); }
@@ -23,6 +23,7 @@
 #include "config.hpp"
 
 #include "animation.hpp"
+#include "map.hpp"
 
 #include <vector>
 #include <string>
@@ -64,8 +65,6 @@ namespace ADWIF
   typedef boost::polygon::polygon_with_holes_data<double> Polygon;
   typedef boost::polygon::polygon_traits<Polygon>::point_type Point2D;
 
-  typedef boost::geometry::model::point<int, 3, boost::geometry::cs::cartesian> Point3D;
-  typedef boost::geometry::model::box<Point3D> Box3D;
   typedef std::pair<Box3D, std::shared_ptr<GenerateTerrainTask>> SIVal;
   typedef boost::geometry::index::rtree<SIVal, boost::geometry::index::quadratic<16> > SpatialIndex;
 
@@ -160,6 +159,8 @@ namespace ADWIF
     template<class Archive>
     void serialize(Archive & ar, const unsigned int version)
     {
+      // tasks completing while the generator is saved update the generation map
+      boost::shared_lock<boost::shared_mutex> guard(myGenerationLock);
       ar & mySeed;
       ar & myChunkSizeX;
       ar & myChunkSizeY;
@@ -30,13 +30,16 @@
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/format.hpp>
+#include <algorithm>
 #include <fstream>
 #include <stdio.h>
 
 namespace ADWIF
 {
   MapGenState::MapGenState(const std::shared_ptr<ADWIF::Engine> & engine, std::shared_ptr<ADWIF::Game> & game):
-    myEngine(engine), myGame(game), myViewOffX(0), myViewOffY(0), myViewOffZ(0)
+    myEngine(engine), myGame(game), myViewOffX(0), myViewOffY(0), myViewOffZ(0),
+    myLastViewOffX(0), myLastViewOffY(0), myLastViewOffZ(0), myViewDirX(0), myViewDirY(0), myViewDirZ(0),
+    myViewPin(), myChanges(), myChangedBoxes(), myDrawnX(0), myDrawnY(0), myDrawnZ(0), myDrawnWidth(0), myDrawnHeight(0)
   {
     myEngine->delay(0);
     myEngine->input()->setTimeout(1000);
@@ -87,6 +90,8 @@ namespace ADWIF
 
   void MapGenState::exit()
   {
+    myViewPin.release();
+    myChanges.release();
     myGame->save("default");
     myGame->shutdown();
   }
@@ -97,19 +102,119 @@ namespace ADWIF
     int chunkY = myViewOffY / myGame->generator()->chunkSizeY();
     int chunkZ = myViewOffZ / myGame->generator()->chunkSizeZ();
 
-    myEngine->renderer()->clear();
-    myEngine->renderer()->drawRegion(myViewOffX, myViewOffY, myViewOffZ+1, myEngine->renderer()->width(),
-                                     myEngine->renderer()->height(), 0, 0, myGame.get(), myGame->map().get());
+    myGame->map()->focus(myViewOffX + myEngine->renderer()->width() / 2,
+                         myViewOffY + myEngine->renderer()->height() / 2, myViewOffZ);
+    pinView();
+    prefetchAhead();
+
+    drawView();
     myEngine->renderer()->style(White, Black, Style::Bold);
     myEngine->renderer()->drawChar(myEngine->renderer()->width() / 2, myEngine->renderer()->height() / 2, '@');
-    std::string str = boost::str(boost::format("Position %ix%ix%i (%ix%ix%i) Height: %d (%i)")
+    const bool saving = mySaveFuture.valid() &&
+      mySaveFuture.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+    std::string str = boost::str(boost::format("Position %ix%ix%i (%ix%ix%i) Height: %i%s")
     % myViewOffX % myViewOffY % myViewOffZ % chunkX % chunkY % chunkZ %
-      myGame->generator()->getHeightReal(myViewOffX + myEngine->renderer()->width() / 2, myViewOffY + myEngine->renderer()->height() / 2) %
-      myGame->generator()->getHeight(myViewOffX + myEngine->renderer()->width() / 2, myViewOffY + myEngine->renderer()->height() / 2));
+      surfaceHeight(myViewOffX + myEngine->renderer()->width() / 2, myViewOffY + myEngine->renderer()->height() / 2) %
+      (saving ? " Saving..." : ""));
     myEngine->renderer()->style(White, Black, Style::Bold);
     myEngine->renderer()->drawText(1,1, str + std::string(myEngine->renderer()->width() - 2 - str.size(),  ' '));
   }
 
+  int MapGenState::surfaceHeight(int x, int y) const
+  {
+    const Map::ColumnSummary column = myGame->map()->surfaceAt(x, y);
+    if (column.top != Map::ColumnSummary::noHeight)
+      return column.top;
+    return myGame->generator()->getHeight(x, y);
+  }
+
+  void MapGenState::drawView()
+  {
+    const int width = myEngine->renderer()->width(), height = myEngine->renderer()->height();
+    const int z = myViewOffZ + 1;
+
+    // a feed that was just created has nothing in it, which is fine as the whole view is drawn then
+    const bool fresh = myChanges.empty();
+    if (fresh)
+      myChanges = myGame->map()->changes();
+    myChanges.drain(myChangedBoxes);
+
+    if (fresh || myDrawnX != myViewOffX || myDrawnY != myViewOffY || myDrawnZ != z || myDrawnWidth != width ||
+        myDrawnHeight != height)
+    {
+      myEngine->renderer()->clear();
+      myEngine->renderer()->drawRegion(myViewOffX, myViewOffY, z, width, height, 0, 0, myGame.get(),
+                                       myGame->map().get());
+      myDrawnX = myViewOffX;
+      myDrawnY = myViewOffY;
+      myDrawnZ = z;
+      myDrawnWidth = width;
+      myDrawnHeight = height;
+      return;
+    }
+
+    // drawRegion() looks up to three levels down from the one it draws
+    for (const Box3D & box : myChangedBoxes)
+    {
+      if (box.min_corner().get<2>() > z || box.max_corner().get<2>() <= z - 3)
+        continue;
+      const int minX = std::max(box.min_corner().get<0>(), myViewOffX);
+      const int minY = std::max(box.min_corner().get<1>(), myViewOffY);
+      const int maxX = std::min(box.max_corner().get<0>(), myViewOffX + width);
+      const int maxY = std::min(box.max_corner().get<1>(), myViewOffY + height);
+      if (minX < maxX && minY < maxY)
+        myEngine->renderer()->drawRegion(minX, minY, z, maxX - minX, maxY - minY, minX - myViewOffX, minY - myViewOffY,
+                                         myGame.get(), myGame->map().get());
+    }
+  }
+
+  void MapGenState::pinView()
+  {
+    // prefetchAhead() has not yet caught up with the view, so this sees whether it moved
+    if (!myViewPin.empty() && myViewOffX == myLastViewOffX && myViewOffY == myLastViewOffY &&
+        myViewOffZ == myLastViewOffZ)
+      return;
+
+    // the new pin is taken before the old one goes, so chunks visible in both stay pinned throughout
+    myViewPin = myGame->map()->pin(Box3D(Point3D(myViewOffX, myViewOffY, myViewOffZ - 2),
+                                         Point3D(myViewOffX + myEngine->renderer()->width(),
+                                                 myViewOffY + myEngine->renderer()->height(), myViewOffZ + 2)));
+  }
+
+  void MapGenState::prefetchAhead()
+  {
+    const int dirX = (myViewOffX > myLastViewOffX) - (myViewOffX < myLastViewOffX);
+    const int dirY = (myViewOffY > myLastViewOffY) - (myViewOffY < myLastViewOffY);
+    const int dirZ = (myViewOffZ > myLastViewOffZ) - (myViewOffZ < myLastViewOffZ);
+
+    myLastViewOffX = myViewOffX;
+    myLastViewOffY = myViewOffY;
+    myLastViewOffZ = myViewOffZ;
+
+    if (!dirX && !dirY && !dirZ)
+      return;
+
+    // whatever was queued for the old heading is no longer useful
+    if (dirX != myViewDirX || dirY != myViewDirY || dirZ != myViewDirZ)
+      myGame->map()->cancelPrefetch();
+
+    myViewDirX = dirX;
+    myViewDirY = dirY;
+    myViewDirZ = dirZ;
+
+    // look one chunk ahead of the visible area in the direction the view is moving
+    const int aheadX = dirX * myGame->generator()->chunkSizeX();
+    const int aheadY = dirY * myGame->generator()->chunkSizeY();
+    const int aheadZ = dirZ * myGame->generator()->chunkSizeZ();
+
+    const Box3D ahead(Point3D(myViewOffX + std::min(aheadX, 0), myViewOffY + std::min(aheadY, 0),
+                              myViewOffZ - 2 + std::min(aheadZ, 0)),
+                      Point3D(myViewOffX + myEngine->renderer()->width() + std::max(aheadX, 0),
+                              myViewOffY + myEngine->renderer()->height() + std::max(aheadY, 0),
+                              myViewOffZ + 2 + std::max(aheadZ, 0)));
+    myGame->map()->prefetch(ahead);
+  }
+
   void MapGenState::consume(int key)
   {
     if (key == Key::Escape)
@@ -118,7 +223,9 @@ namespace ADWIF
       myEngine->renderer()->style(White, Black, Style::Bold);
       myEngine->renderer()->drawText(1,1, str + std::string(myEngine->renderer()->width() - 2 - str.size(),  ' '));
       myEngine->renderer()->refresh();
-      myGame->saveMap();
+      // generation stops for good here, unlike saves made while playing
+      myGame->generator()->abort();
+      myGame->saveMap().wait();
       done(true);
     }
     else if (key == Key::Up)
@@ -146,11 +253,19 @@ namespace ADWIF
       myViewOffZ++;
     }
     else if (key == 'c')
+    {
+      myViewPin.release();
+      myChanges.release();
       myGame->createMap();
+    }
     else if (key == 'l')
+    {
+      myViewPin.release();
+      myChanges.release();
       myGame->loadMap();
+    }
     else if (key == 's')
-      myGame->saveMap();
+      mySaveFuture = myGame->saveMap();
 //     else if (key == 'g')
 //     {
 //       myEngine->input()->setTimeout(0);
@@ -177,8 +292,8 @@ namespace ADWIF
 //     }
     if (key)
     {
-      myViewOffZ = myGame->generator()->getHeight(myViewOffX + myEngine->renderer()->width() / 2,
-                                                  myViewOffY + myEngine->renderer()->height() / 2) - 1;
+      myViewOffZ = surfaceHeight(myViewOffX + myEngine->renderer()->width() / 2,
+                                 myViewOffY + myEngine->renderer()->height() / 2) - 1;
 
 //       myGame->generator()->generateAround(myViewOffX + myEngine->renderer()->width() / 2,
 //                                           myViewOffY + myEngine->renderer()->height() / 2,
@@ -24,8 +24,10 @@
 #include "mapgenerator.hpp"
 
 #include <fstream>
+#include <future>
 #include <memory>
 #include <random>
+#include <vector>
 
 namespace ADWIF
 {
@@ -45,10 +47,25 @@ namespace ADWIF
     virtual void activate();
     virtual void exit();
 
+  private:
+    void prefetchAhead();
+    void pinView();
+    // Redraws the whole view when it moved, otherwise only the parts of it the map reports as changed
+    void drawView();
+    // Height of the ground at x, y: the map's column summary once the column was generated, the generator's otherwise
+    int surfaceHeight(int x, int y) const;
+
   private:
     std::shared_ptr<Engine> myEngine;
     std::shared_ptr<Game> myGame;
     int myViewOffX, myViewOffY, myViewOffZ;
+    int myLastViewOffX, myLastViewOffY, myLastViewOffZ;
+    int myViewDirX, myViewDirY, myViewDirZ;
+    std::shared_future<void> mySaveFuture;
+    Map::PinHandle myViewPin;
+    Map::ChangeFeed myChanges;
+    std::vector<Box3D> myChangedBoxes;
+    int myDrawnX, myDrawnY, myDrawnZ, myDrawnWidth, myDrawnHeight;
   };
 }
 
@@ -0,0 +1,141 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MAPIMPL_H
+#define MAPIMPL_H
+
+#include "map.hpp"
+#include "mapmanifest.hpp"
+
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/atomic.hpp>
+
+namespace ADWIF
+{
+  // What a backend hands Map::Cursor, see there for the rules it follows
+  class MapCursor
+  {
+  public:
+    virtual ~MapCursor() { }
+    virtual const MapCell & get(int x, int y, int z) = 0;
+    virtual void set(int x, int y, int z, const MapCell & cell) = 0;
+    // Like set(), returning the cell that was replaced
+    virtual const MapCell & exchange(int x, int y, int z, const MapCell & cell)
+    {
+      const MapCell & before = get(x, y, z);
+      set(x, y, z, cell);
+      return before;
+    }
+    virtual void release() = 0;
+  };
+
+  // What a backend hands Map::PinHandle, destroying it unpins the chunks
+  class MapPin
+  {
+  public:
+    virtual ~MapPin() { }
+  };
+
+  // Storage interface implemented by every map backend. Each backend registers a factory under its name during static
+  // initialisation, and Map picks one of them by name when it is constructed. Backends skip looking for chunks on disk
+  // that the manifest says were never written, and insert chunks into it before writing them.
+  class MapImpl
+  {
+  public:
+    typedef std::function<MapImpl * (Map * parent, const std::shared_ptr<class Engine> & engine,
+                                     const boost::filesystem::path & mapPath, bool load,
+                                     const std::shared_ptr<MapManifest> & manifest, const MapCell & bgValue)> Factory;
+
+    // Declare one of these at namespace scope in a backend's translation unit to make it available
+    struct Registration
+    {
+      Registration(const std::string & name, const Factory & factory) { registerBackend(name, factory); }
+    };
+
+    MapImpl(): myUnloaded(), myAttachedMemory(), myAttachedFlag(false) { }
+    virtual ~MapImpl() { }
+
+    virtual const MapCell & get(int x, int y, int z) const = 0;
+    virtual void set(int x, int y, int z, const MapCell & cell) = 0;
+
+    virtual void getRegion(const Box3D & box, std::vector<const MapCell *> & out) const = 0;
+    virtual void setRegion(const Box3D & box, const std::vector<MapCell> & cells) = 0;
+    virtual void fill(const Box3D & box, const MapCell & cell) = 0;
+
+    // Like set(), setRegion() and fill(), handing back the cells they replaced in getRegion() order. The defaults read
+    // the cells before writing them, backends that find them while writing override these.
+    virtual const MapCell & exchange(int x, int y, int z, const MapCell & cell);
+    virtual void exchangeRegion(const Box3D & box, const std::vector<MapCell> & cells,
+                                std::vector<const MapCell *> & replaced);
+    virtual void exchangeFill(const Box3D & box, const MapCell & cell, std::vector<const MapCell *> & replaced);
+
+    virtual void focus(int x, int y, int z) = 0;
+
+    virtual void prefetch(const Box3D & box, int priority) = 0;
+    virtual void cancelPrefetch() = 0;
+
+    virtual MapCursor * cursor() = 0;
+    virtual MapPin * pin(const Box3D & box) = 0;
+
+    virtual ChunkCodec codec() const = 0;
+    virtual int codecLevel() const = 0;
+    virtual void codec(ChunkCodec codec, int level) = 0;
+
+    virtual unsigned long int memoryLimit() const = 0;
+    virtual void memoryLimit(unsigned long int megabytes) = 0;
+
+    virtual const MapCell & background() const = 0;
+
+    virtual void prune() const = 0;
+    virtual std::shared_future<void> save() const = 0;
+    // Backends whose chunks cannot be frozen while they are written simply save them
+    virtual std::shared_future<void> snapshot() const { return save(); }
+
+    // Calls 'fn' with every chunk stored on disk, used to rebuild a manifest that was not saved cleanly
+    virtual void enumerateChunks(const std::function<void (int x, int y, int z)> & fn) const = 0;
+
+    // Hands the backend what Map keeps alongside its chunks: 'unloaded' is told about every chunk whose cells were freed,
+    // and 'memory' returns bytes that pruning counts against memoryLimit() together with the chunks
+    void attach(const std::function<void (int x, int y, int z)> & unloaded, const std::function<std::size_t ()> & memory);
+
+    static void registerBackend(const std::string & name, const Factory & factory);
+    // Throws std::runtime_error when no backend was registered under 'name'
+    static MapImpl * create(const std::string & name, Map * parent, const std::shared_ptr<class Engine> & engine,
+                            const boost::filesystem::path & mapPath, bool load,
+                            const std::shared_ptr<MapManifest> & manifest, const MapCell & bgValue);
+    static std::vector<std::string> backends();
+
+  protected:
+    // Both do nothing until attach() was called
+    void chunkUnloaded(int x, int y, int z) const;
+    std::size_t attachedMemory() const;
+
+  private:
+    std::function<void (int x, int y, int z)> myUnloaded;
+    std::function<std::size_t ()> myAttachedMemory;
+    boost::atomic_bool myAttachedFlag;
+  };
+}
+
+#endif // MAPIMPL_H
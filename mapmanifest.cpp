@@ -0,0 +1,249 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mapmanifest.hpp"
+#include "chunkdirectory.hpp"
+#include "util.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+namespace ADWIF
+{
+  namespace
+  {
+    const char manifestMagic[4] = { 'A', 'D', 'W', 'M' };
+    const uint8_t manifestCleanFlag = 1;
+
+    template <class T> void writeValue(std::ostream & os, const T & value)
+    {
+      os.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    template <class T> void readValue(std::istream & is, T & value)
+    {
+      is.read(reinterpret_cast<char *>(&value), sizeof(value));
+    }
+  }
+
+  const uint32_t MapManifest::formatVersion;
+
+  MapManifest::MapManifest(const boost::filesystem::path & path): myPath(path), myBackend(), myChunkSizeX(0),
+    myChunkSizeY(0), myChunkSizeZ(0), myCodec(ChunkCodec::None), myCodecLevel(0), myBlocks(), myCompleteFlag(false),
+    myCleanOnDiskFlag(false), myLock()
+  {
+  }
+
+  bool MapManifest::load()
+  {
+    boost::unique_lock<boost::shared_mutex> guard(myLock);
+    std::ifstream is(myPath.native(), std::ios_base::binary);
+    if (!is)
+      return false;
+
+    char magic[4];
+    uint32_t version = 0;
+    uint8_t flags[4];
+    uint32_t size[3];
+    uint8_t codec[4];
+    int32_t level = 0;
+    uint32_t nameLength = 0;
+    is.read(magic, sizeof(magic));
+    readValue(is, version);
+    if (!is || std::memcmp(magic, manifestMagic, sizeof(magic)) != 0)
+      throw std::runtime_error("invalid map manifest " + myPath.string());
+    if (version > formatVersion)
+      throw std::runtime_error("map manifest " + myPath.string() + " was written by a newer version");
+    readValue(is, flags);
+    readValue(is, size);
+    readValue(is, codec);
+    readValue(is, level);
+    readValue(is, nameLength);
+    std::string name(is ? nameLength : 0, '\0');
+    is.read(&name[0], name.size());
+
+    uint64_t blockCount = 0;
+    readValue(is, blockCount);
+    std::unordered_map<uint64_t, Block> blocks;
+    for (uint64_t i = 0; i < blockCount && is; i++)
+    {
+      uint64_t key;
+      Block block;
+      readValue(is, key);
+      is.read(reinterpret_cast<char *>(block.data()), sizeof(Block));
+      blocks[key] = block;
+    }
+    if (!is)
+      throw std::runtime_error("truncated map manifest " + myPath.string());
+
+    myBackend = name;
+    myChunkSizeX = size[0];
+    myChunkSizeY = size[1];
+    myChunkSizeZ = size[2];
+    myCodec = ChunkCodec(codec[0]);
+    myCodecLevel = level;
+    myBlocks.swap(blocks);
+    myCompleteFlag = myCleanOnDiskFlag = (flags[0] & manifestCleanFlag) != 0;
+    return true;
+  }
+
+  void MapManifest::save()
+  {
+    boost::unique_lock<boost::shared_mutex> guard(myLock);
+    write(myCompleteFlag);
+  }
+
+  bool MapManifest::complete() const
+  {
+    boost::shared_lock<boost::shared_mutex> guard(myLock);
+    return myCompleteFlag;
+  }
+
+  void MapManifest::markComplete()
+  {
+    boost::unique_lock<boost::shared_mutex> guard(myLock);
+    myCompleteFlag = true;
+  }
+
+  void MapManifest::chunkSize(unsigned int x, unsigned int y, unsigned int z)
+  {
+    myChunkSizeX = x;
+    myChunkSizeY = y;
+    myChunkSizeZ = z;
+  }
+
+  ChunkCodec MapManifest::codec() const
+  {
+    boost::shared_lock<boost::shared_mutex> guard(myLock);
+    return myCodec;
+  }
+
+  int MapManifest::codecLevel() const
+  {
+    boost::shared_lock<boost::shared_mutex> guard(myLock);
+    return myCodecLevel;
+  }
+
+  void MapManifest::codec(ChunkCodec codec, int level)
+  {
+    boost::unique_lock<boost::shared_mutex> guard(myLock);
+    myCodec = codec;
+    myCodecLevel = level;
+  }
+
+  bool MapManifest::mayExist(int x, int y, int z) const
+  {
+    boost::shared_lock<boost::shared_mutex> guard(myLock);
+    if (!myCompleteFlag)
+      return true;
+    auto i = myBlocks.find(blockKey(x, y, z));
+    if (i == myBlocks.end())
+      return false;
+    const unsigned int bit = blockBit(x, y, z);
+    return (i->second[bit / 64] >> (bit % 64)) & 1;
+  }
+
+  void MapManifest::insert(int x, int y, int z)
+  {
+    const uint64_t key = blockKey(x, y, z);
+    const unsigned int bit = blockBit(x, y, z);
+    const uint64_t mask = uint64_t(1) << (bit % 64);
+    {
+      boost::shared_lock<boost::shared_mutex> guard(myLock);
+      auto i = myBlocks.find(key);
+      if (i != myBlocks.end() && (i->second[bit / 64] & mask))
+        return;
+    }
+    boost::unique_lock<boost::shared_mutex> guard(myLock);
+    auto i = myBlocks.find(key);
+    if (i == myBlocks.end())
+    {
+      Block block;
+      block.fill(0);
+      i = myBlocks.insert(std::make_pair(key, block)).first;
+    }
+    i->second[bit / 64] |= mask;
+    // the chunk is about to be written, so a manifest on disk that claims to know every chunk would be wrong now
+    if (myCleanOnDiskFlag)
+      write(false);
+  }
+
+  void MapManifest::forEachChunk(const std::function<void (int x, int y, int z)> & fn) const
+  {
+    std::vector<std::array<int, 3>> chunks;
+    {
+      boost::shared_lock<boost::shared_mutex> guard(myLock);
+      for (auto & block : myBlocks)
+      {
+        int bx, by, bz;
+        unpackChunkKey(block.first, bx, by, bz);
+        for (unsigned int bit = 0; bit < block.second.size() * 64; bit++)
+          if ((block.second[bit / 64] >> (bit % 64)) & 1)
+            chunks.push_back({{ bx * blockSizeX + int(bit % blockSizeX), by * blockSizeY + int(bit / blockSizeX % blockSizeY),
+                                bz * blockSizeZ + int(bit / (blockSizeX * blockSizeY)) }});
+      }
+    }
+    // called without the lock held so that 'fn' may use the manifest
+    for (auto & chunk : chunks)
+      fn(chunk[0], chunk[1], chunk[2]);
+  }
+
+  uint64_t MapManifest::blockKey(int x, int y, int z)
+  {
+    return packChunkKey(floorDiv(x, blockSizeX), floorDiv(y, blockSizeY), floorDiv(z, blockSizeZ));
+  }
+
+  unsigned int MapManifest::blockBit(int x, int y, int z)
+  {
+    return (floorMod(z, blockSizeZ) * blockSizeY + floorMod(y, blockSizeY)) * blockSizeX + floorMod(x, blockSizeX);
+  }
+
+  void MapManifest::write(bool clean)
+  {
+    // written next to the manifest first so that a crash never leaves half of one behind
+    const boost::filesystem::path temp = myPath.string() + ".tmp";
+    {
+      std::ofstream os(temp.native(), std::ios_base::binary | std::ios_base::trunc);
+      const uint8_t flags[4] = { uint8_t(clean ? manifestCleanFlag : 0), 0, 0, 0 };
+      const uint32_t size[3] = { myChunkSizeX, myChunkSizeY, myChunkSizeZ };
+      const uint8_t codec[4] = { uint8_t(myCodec), 0, 0, 0 };
+      os.write(manifestMagic, sizeof(manifestMagic));
+      writeValue(os, formatVersion);
+      writeValue(os, flags);
+      writeValue(os, size);
+      writeValue(os, codec);
+      writeValue(os, int32_t(myCodecLevel));
+      writeValue(os, uint32_t(myBackend.size()));
+      os.write(myBackend.data(), myBackend.size());
+      writeValue(os, uint64_t(myBlocks.size()));
+      for (auto & entry : myBlocks)
+      {
+        writeValue(os, entry.first);
+        os.write(reinterpret_cast<const char *>(entry.second.data()), sizeof(Block));
+      }
+      os.flush();
+      if (!os)
+        throw std::runtime_error("could not write map manifest " + temp.string());
+    }
+    boost::filesystem::rename(temp, myPath);
+    myCleanOnDiskFlag = clean;
+  }
+}
@@ -0,0 +1,107 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MAPMANIFEST_H
+#define MAPMANIFEST_H
+
+#include "chunkcodec.hpp"
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+namespace ADWIF
+{
+  // Describes a map on disk: the backend and chunk geometry it was created with, the codec its chunks were last
+  // written with, and a bitmap of the chunks that may have been written. Bits are only ever set, so a chunk that was
+  // erased again still reads as possibly present and merely costs a lookup.
+  //
+  // The file is marked unclean before the first chunk missing from the bitmap is written, and only marked clean again
+  // by save(). A manifest that was not saved cleanly does not know every chunk on disk and has to be rebuilt.
+  class MapManifest
+  {
+  public:
+    static const uint32_t formatVersion = 1;
+
+    MapManifest(const boost::filesystem::path & path);
+
+    // Returns false when the map has no manifest yet, throws std::runtime_error when it cannot be read
+    bool load();
+    // Writes the manifest and marks it clean
+    void save();
+
+    // Whether the bitmap lists every chunk on disk, only true for cleanly saved manifests until markComplete()
+    bool complete() const;
+    // Declares the bitmap complete once it was rebuilt from the chunks on disk
+    void markComplete();
+
+    const std::string & backend() const { return myBackend; }
+    void backend(const std::string & name) { myBackend = name; }
+
+    unsigned int chunkSizeX() const { return myChunkSizeX; }
+    unsigned int chunkSizeY() const { return myChunkSizeY; }
+    unsigned int chunkSizeZ() const { return myChunkSizeZ; }
+    void chunkSize(unsigned int x, unsigned int y, unsigned int z);
+
+    ChunkCodec codec() const;
+    int codecLevel() const;
+    void codec(ChunkCodec codec, int level);
+
+    // Whether the chunk may have been written; always true while the bitmap is incomplete
+    bool mayExist(int x, int y, int z) const;
+    // Has to be called before a chunk is written to disk
+    void insert(int x, int y, int z);
+    // Calls 'fn' for every chunk that may have been written
+    void forEachChunk(const std::function<void (int x, int y, int z)> & fn) const;
+
+  private:
+    MapManifest(const MapManifest &);
+    MapManifest & operator=(const MapManifest &);
+
+    // Each block covers blockSizeX * blockSizeY * blockSizeZ chunks, one bit each
+    static const int blockSizeX = 16;
+    static const int blockSizeY = 16;
+    static const int blockSizeZ = 4;
+    typedef std::array<uint64_t, blockSizeX * blockSizeY * blockSizeZ / 64> Block;
+
+    static uint64_t blockKey(int x, int y, int z);
+    static unsigned int blockBit(int x, int y, int z);
+
+    // Expects myLock to be held exclusively
+    void write(bool clean);
+
+  private:
+    boost::filesystem::path myPath;
+    std::string myBackend;
+    unsigned int myChunkSizeX, myChunkSizeY, myChunkSizeZ;
+    ChunkCodec myCodec;
+    int myCodecLevel;
+    std::unordered_map<uint64_t, Block> myBlocks;
+    bool myCompleteFlag;
+    bool myCleanOnDiskFlag;
+    mutable boost::shared_mutex myLock;
+  };
+}
+
+#endif // MAPMANIFEST_H
@@ -0,0 +1,101 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MAPUTILS_H
+#define MAPUTILS_H
+
+#include "map.hpp"
+#include "mapbank.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <vector>
+
+namespace ADWIF
+{
+  // The part of a region that falls inside a single chunk, in world coordinates (max exclusive)
+  struct RegionSlice
+  {
+    int chunkX, chunkY, chunkZ;
+    int minX, minY, minZ;
+    int maxX, maxY, maxZ;
+  };
+
+  inline std::size_t regionVolume(const Box3D & box)
+  {
+    const int w = box.max_corner().get<0>() - box.min_corner().get<0>();
+    const int h = box.max_corner().get<1>() - box.min_corner().get<1>();
+    const int d = box.max_corner().get<2>() - box.min_corner().get<2>();
+    return (w > 0 && h > 0 && d > 0) ? std::size_t(w) * h * d : 0;
+  }
+
+  // Offset of a world position inside a dense buffer covering box, laid out x first, then y, then z
+  inline std::size_t regionOffset(const Box3D & box, int x, int y, int z)
+  {
+    const int w = box.max_corner().get<0>() - box.min_corner().get<0>();
+    const int h = box.max_corner().get<1>() - box.min_corner().get<1>();
+    return (std::size_t(z - box.min_corner().get<2>()) * h + (y - box.min_corner().get<1>())) * w +
+      (x - box.min_corner().get<0>());
+  }
+
+  // Splits box along chunk boundaries and calls fn once per intersecting chunk
+  template <class Fn>
+  void forEachRegionSlice(const Box3D & box, int chunkSizeX, int chunkSizeY, int chunkSizeZ, Fn fn)
+  {
+    if (!regionVolume(box))
+      return;
+
+    const int minX = box.min_corner().get<0>(), minY = box.min_corner().get<1>(), minZ = box.min_corner().get<2>();
+    const int maxX = box.max_corner().get<0>(), maxY = box.max_corner().get<1>(), maxZ = box.max_corner().get<2>();
+
+    RegionSlice slice;
+    for (slice.chunkZ = floorDiv(minZ, chunkSizeZ); slice.chunkZ <= floorDiv(maxZ - 1, chunkSizeZ); slice.chunkZ++)
+      for (slice.chunkY = floorDiv(minY, chunkSizeY); slice.chunkY <= floorDiv(maxY - 1, chunkSizeY); slice.chunkY++)
+        for (slice.chunkX = floorDiv(minX, chunkSizeX); slice.chunkX <= floorDiv(maxX - 1, chunkSizeX); slice.chunkX++)
+        {
+          slice.minX = std::max(minX, slice.chunkX * chunkSizeX);
+          slice.maxX = std::min(maxX, (slice.chunkX + 1) * chunkSizeX);
+          slice.minY = std::max(minY, slice.chunkY * chunkSizeY);
+          slice.maxY = std::min(maxY, (slice.chunkY + 1) * chunkSizeY);
+          slice.minZ = std::max(minZ, slice.chunkZ * chunkSizeZ);
+          slice.maxZ = std::min(maxZ, (slice.chunkZ + 1) * chunkSizeZ);
+          fn(slice);
+        }
+  }
+
+  // Resolves cell ids to the cells the bank holds for them
+  template <class Id>
+  inline void resolveCells(const MapBank & bank, const std::vector<Id> & ids, std::vector<const MapCell *> & out)
+  {
+    out.resize(ids.size());
+    for (std::size_t i = 0; i < ids.size(); i++)
+      out[i] = &bank.get(ids[i]);
+  }
+
+  // Interns cells into the bank, storing each distinct run only once
+  template <class Id>
+  inline void internCells(MapBank & bank, const std::vector<MapCell> & cells, std::vector<Id> & ids)
+  {
+    ids.resize(cells.size());
+    for (std::size_t i = 0; i < cells.size(); i++)
+      ids[i] = i && cells[i] == cells[i - 1] ? ids[i - 1] : bank.put(cells[i]);
+  }
+}
+
+#endif // MAPUTILS_H
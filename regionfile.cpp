@@ -0,0 +1,233 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "regionfile.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace ADWIF
+{
+  namespace
+  {
+    const char regionMagic[4] = { 'A', 'D', 'W', 'R' };
+    const uint8_t regionVersion = 1;
+    // magic, version and three reserved bytes, then the dimensions
+    const std::size_t regionPreambleSize = 8 + 3 * sizeof(uint32_t);
+
+    inline uint32_t sectorsFor(uint64_t size)
+    {
+      return (size + RegionFile::sectorSize - 1) / RegionFile::sectorSize;
+    }
+  }
+
+  const std::size_t RegionFile::sectorSize;
+
+  RegionFile::RegionFile(const boost::filesystem::path & path, unsigned int sizeX, unsigned int sizeY, unsigned int sizeZ):
+    myPath(path), mySizeX(sizeX), mySizeY(sizeY), mySizeZ(sizeZ), myHeaderSectors(0), myEntries(), mySectors(),
+    myStream(), myMapping(), myLock()
+  {
+    const std::size_t count = std::size_t(sizeX) * sizeY * sizeZ;
+    myHeaderSectors = sectorsFor(regionPreambleSize + count * sizeof(Entry));
+    myEntries.assign(count, Entry { 0, 0 });
+
+    if (!boost::filesystem::exists(myPath) || boost::filesystem::file_size(myPath) == 0)
+    {
+      std::vector<char> header(myHeaderSectors * sectorSize, 0);
+      const uint32_t dims[3] = { sizeX, sizeY, sizeZ };
+      std::memcpy(header.data(), regionMagic, sizeof(regionMagic));
+      header[4] = regionVersion;
+      std::memcpy(header.data() + 8, dims, sizeof(dims));
+      std::ofstream os(myPath.native(), std::ios_base::binary | std::ios_base::trunc);
+      os.write(header.data(), header.size());
+      if (!os)
+        throw std::runtime_error("could not create region file " + myPath.string());
+    }
+
+    myStream.open(myPath.native(), std::ios_base::binary | std::ios_base::in | std::ios_base::out);
+
+    char magic[4];
+    char version[4];
+    uint32_t dims[3];
+    myStream.read(magic, sizeof(magic));
+    myStream.read(version, sizeof(version));
+    myStream.read(reinterpret_cast<char *>(dims), sizeof(dims));
+    myStream.read(reinterpret_cast<char *>(myEntries.data()), count * sizeof(Entry));
+
+    if (!myStream || std::memcmp(magic, regionMagic, sizeof(magic)) != 0)
+      throw std::runtime_error("invalid region file " + myPath.string());
+    if (version[0] != regionVersion)
+      throw std::runtime_error("unsupported region file version in " + myPath.string());
+    if (dims[0] != sizeX || dims[1] != sizeY || dims[2] != sizeZ)
+      throw std::runtime_error("region file " + myPath.string() + " has different dimensions");
+
+    const uint32_t fileSectors = sectorsFor(boost::filesystem::file_size(myPath));
+    mySectors.assign(std::max(fileSectors, myHeaderSectors), false);
+    std::fill_n(mySectors.begin(), myHeaderSectors, true);
+
+    for (Entry & entry : myEntries)
+    {
+      if (!entry.length)
+        continue;
+      // drop records that point outside the file, as left behind by an interrupted write
+      if (entry.sector < myHeaderSectors || entry.sector + sectorsFor(entry.length) > fileSectors)
+      {
+        entry = Entry { 0, 0 };
+        continue;
+      }
+      std::fill_n(mySectors.begin() + entry.sector, sectorsFor(entry.length), true);
+    }
+  }
+
+  RegionFile::~RegionFile()
+  {
+    if (myMapping.is_open())
+      myMapping.close();
+    myStream.close();
+  }
+
+  bool RegionFile::contains(unsigned int x, unsigned int y, unsigned int z) const
+  {
+    boost::shared_lock<boost::shared_mutex> guard(myLock);
+    return myEntries[entryIndex(x, y, z)].length != 0;
+  }
+
+  bool RegionFile::read(unsigned int x, unsigned int y, unsigned int z, std::vector<char> & out)
+  {
+    const unsigned int index = entryIndex(x, y, z);
+
+    {
+      boost::shared_lock<boost::shared_mutex> guard(myLock);
+      const Entry & entry = myEntries[index];
+      if (!entry.length)
+        return false;
+      const uint64_t begin = uint64_t(entry.sector) * sectorSize;
+      if (myMapping.is_open() && begin + entry.length <= myMapping.size())
+      {
+        out.assign(myMapping.data() + begin, myMapping.data() + begin + entry.length);
+        return true;
+      }
+    }
+
+    // The record lies past the end of the current mapping, map the file again now that it has grown
+    boost::unique_lock<boost::shared_mutex> guard(myLock);
+    const Entry & entry = myEntries[index];
+    if (!entry.length)
+      return false;
+    const uint64_t begin = uint64_t(entry.sector) * sectorSize;
+    if (!myMapping.is_open() || begin + entry.length > myMapping.size())
+    {
+      if (myMapping.is_open())
+        myMapping.close();
+      myStream.flush();
+      myMapping.open(myPath.native());
+    }
+    out.assign(myMapping.data() + begin, myMapping.data() + begin + entry.length);
+    return true;
+  }
+
+  void RegionFile::write(unsigned int x, unsigned int y, unsigned int z, const char * data, std::size_t size)
+  {
+    if (!size)
+    {
+      erase(x, y, z);
+      return;
+    }
+
+    boost::unique_lock<boost::shared_mutex> guard(myLock);
+    const unsigned int index = entryIndex(x, y, z);
+    Entry & entry = myEntries[index];
+    const uint32_t sectors = sectorsFor(size);
+    // The old record stays intact and its sectors taken until the entry points at the new one, so a write that
+    // is interrupted leaves the previous record readable
+    const uint32_t sector = allocate(sectors);
+
+    static const char padding[sectorSize] = { };
+    myStream.seekp(uint64_t(sector) * sectorSize);
+    myStream.write(data, size);
+    myStream.write(padding, uint64_t(sectors) * sectorSize - size);
+    myStream.flush();
+    if (!myStream)
+    {
+      release(sector, sectors);
+      throw std::runtime_error("could not write to region file " + myPath.string());
+    }
+
+    const Entry old = entry;
+    entry = Entry { sector, uint32_t(size) };
+    writeEntry(index);
+    myStream.flush();
+
+    if (old.length)
+      release(old.sector, sectorsFor(old.length));
+
+    if (!myStream)
+      throw std::runtime_error("could not write to region file " + myPath.string());
+  }
+
+  void RegionFile::erase(unsigned int x, unsigned int y, unsigned int z)
+  {
+    boost::unique_lock<boost::shared_mutex> guard(myLock);
+    const unsigned int index = entryIndex(x, y, z);
+    Entry & entry = myEntries[index];
+    if (!entry.length)
+      return;
+    release(entry.sector, sectorsFor(entry.length));
+    entry = Entry { 0, 0 };
+    writeEntry(index);
+    myStream.flush();
+  }
+
+  unsigned int RegionFile::entryIndex(unsigned int x, unsigned int y, unsigned int z) const
+  {
+    return (z * mySizeY + y) * mySizeX + x;
+  }
+
+  uint32_t RegionFile::allocate(uint32_t sectors)
+  {
+    // first fit among the free sectors, otherwise grow the file, reusing any free run at its end
+    uint32_t run = 0;
+    for (uint32_t i = myHeaderSectors; i < mySectors.size(); i++)
+    {
+      run = mySectors[i] ? 0 : run + 1;
+      if (run == sectors)
+      {
+        std::fill_n(mySectors.begin() + (i + 1 - sectors), sectors, true);
+        return i + 1 - sectors;
+      }
+    }
+
+    const uint32_t sector = mySectors.size() - run;
+    mySectors.resize(sector + sectors, false);
+    std::fill_n(mySectors.begin() + sector, sectors, true);
+    return sector;
+  }
+
+  void RegionFile::release(uint32_t sector, uint32_t sectors)
+  {
+    std::fill_n(mySectors.begin() + sector, sectors, false);
+  }
+
+  void RegionFile::writeEntry(unsigned int index)
+  {
+    myStream.seekp(regionPreambleSize + uint64_t(index) * sizeof(Entry));
+    myStream.write(reinterpret_cast<const char *>(&myEntries[index]), sizeof(Entry));
+  }
+}
@@ -0,0 +1,78 @@
+/*  Copyright (c) 2013, Abdullah A. Hassan <voodooattack@hotmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ *  OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ *  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef REGIONFILE_H
+#define REGIONFILE_H
+
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+namespace ADWIF
+{
+  // Packs the records of a block of chunks into one file. A fixed size table at the start of the file holds the
+  // sector offset and byte length of every chunk; records are stored in whole sectors, and sectors freed by
+  // rewritten or erased chunks are reused. Reads are served from a memory mapping of the file.
+  class RegionFile
+  {
+  public:
+    static const std::size_t sectorSize = 4096;
+
+    RegionFile(const boost::filesystem::path & path, unsigned int sizeX, unsigned int sizeY, unsigned int sizeZ);
+    ~RegionFile();
+
+    const boost::filesystem::path & path() const { return myPath; }
+
+    bool contains(unsigned int x, unsigned int y, unsigned int z) const;
+    bool read(unsigned int x, unsigned int y, unsigned int z, std::vector<char> & out);
+    void write(unsigned int x, unsigned int y, unsigned int z, const char * data, std::size_t size);
+    void erase(unsigned int x, unsigned int y, unsigned int z);
+
+  private:
+    RegionFile(const RegionFile &);
+    RegionFile & operator=(const RegionFile &);
+
+    struct Entry
+    {
+      uint32_t sector;
+      uint32_t length;
+    };
+
+    unsigned int entryIndex(unsigned int x, unsigned int y, unsigned int z) const;
+    uint32_t allocate(uint32_t sectors);
+    void release(uint32_t sector, uint32_t sectors);
+    void writeEntry(unsigned int index);
+
+  private:
+    boost::filesystem::path myPath;
+    unsigned int mySizeX, mySizeY, mySizeZ;
+    uint32_t myHeaderSectors;
+    std::vector<Entry> myEntries;
+    std::vector<bool> mySectors;
+    std::fstream myStream;
+    boost::iostreams::mapped_file_source myMapping;
+    mutable boost::shared_mutex myLock;
+  };
+}
+
+#endif // REGIONFILE_H
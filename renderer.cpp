@@ -209,11 +209,20 @@ namespace ADWIF
 //       }
     };
 
+    // Fetch every layer that may be looked through in one pass instead of querying the map per cell
+    const int layers = supportsMultiLayers() ? 4 : 1;
+    std::vector<const MapCell *> cells;
+    map->getRegion(Box3D(Point3D(x, y, z - layers + 1), Point3D(x + w, y + h, z + 1)), cells);
+
+    auto cellAt = [&](int xx, int yy, int depth) -> const MapCell & {
+      return *cells[(std::size_t(layers - 1 - depth) * h + yy) * w + xx];
+    };
+
     for (int yy = 0; yy < h; yy++)
     {
       for (int xx = 0; xx < w; xx++)
       {
-        const MapCell & c = map->get(x + xx, y + yy, z);
+        const MapCell & c = cellAt(xx, yy, 0);
         if (!c.seen() && c.free() == 0)
         {
           style(Colour::Black, Colour::Black, Style::Normal);
@@ -228,7 +237,7 @@ namespace ADWIF
           }
           else
           {
-            const MapCell & cc = map->get(x + xx, y + yy, z-1);
+            const MapCell & cc = cellAt(xx, yy, 1);
             if (!cc.seen() && cc.free() == 0)
             {
               style(Colour::Black, Colour::Black, Style::Normal);
@@ -236,7 +245,7 @@ namespace ADWIF
             }
             else if (cc.used() == 0)
             {
-              const MapCell & ccc = map->get(x + xx, y + yy, z-2);
+              const MapCell & ccc = cellAt(xx, yy, 2);
               if (!ccc.seen() && ccc.free() == 0)
               {
                 style(Colour::Black, Colour::Black, Style::Normal);
@@ -244,7 +253,7 @@ namespace ADWIF
               }
               else if (ccc.used() == 0)
               {
-                if (map->get(x + xx, y + yy, z-3).used() == 0)
+                if (cellAt(xx, yy, 3).used() == 0)
                 {
                   style(Colour::Cyan, Colour::Cyan, Style::Dim);
                   drawChar(scrx + xx, scry + yy, ' ');
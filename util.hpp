@@ -40,6 +40,10 @@ namespace ADWIF
   // convert a colour code to its value (format: #000000)
   uint32_t hexStringToColour(const std::string & str);
   std::string colourToHexString(uint32_t colour);
+  // integer division rounding towards negative infinity
+  inline int floorDiv(int a, int b) { return a / b - ((a % b != 0) && ((a < 0) != (b < 0))); }
+  // integer remainder taking the sign of the divisor
+  inline int floorMod(int a, int b) { return ((a % b) + b) % b; }
 }
 
 #endif // UTIL_HPP